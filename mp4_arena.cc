@@ -0,0 +1,107 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#include "mp4_arena.h"
+
+#define mp4_arena_align(n) (((n) + MP4_ARENA_ALIGN - 1) & ~((size_t) MP4_ARENA_ALIGN - 1))
+
+thread_local Mp4Arena::Mp4ArenaBlock *Mp4Arena::free_blocks = nullptr;
+thread_local int Mp4Arena::free_num = 0;
+
+Mp4Arena *
+Mp4Arena::create() {
+    Mp4ArenaBlock *blk;
+    Mp4Arena *arena;
+
+    if (free_blocks) {
+        blk = free_blocks;
+        free_blocks = blk->next;
+        free_num--;
+
+    } else {
+        blk = (Mp4ArenaBlock *) mp4_malloc(MP4_ARENA_BLOCK_SIZE);
+    }
+
+    blk->next = nullptr;
+    blk->size = MP4_ARENA_BLOCK_SIZE;
+    blk->used = mp4_arena_align(sizeof(Mp4ArenaBlock));
+
+    arena = (Mp4Arena *) ((char *) blk + blk->used);
+    arena->head = blk;
+    blk->used += mp4_arena_align(sizeof(Mp4Arena));
+
+    return arena;
+}
+
+void
+Mp4Arena::destroy(Mp4Arena *arena) {
+    Mp4ArenaBlock *blk, *next, *first;
+
+    // arena 在首块里, 先算出首块并取出链表头
+    first = (Mp4ArenaBlock *) ((char *) arena - mp4_arena_align(sizeof(Mp4ArenaBlock)));
+
+    for (blk = arena->head; blk != nullptr; blk = next) {
+        next = blk->next;
+
+        if (blk != first) {
+            mp4_free(blk);
+        }
+    }
+
+    // 事务可能在别的线程上结束(并行裁剪的任务), 缓存个数有上限, 不会在某个线程上无限堆积
+    if (free_num < MP4_ARENA_FREE_MAX) {
+        first->next = free_blocks;
+        free_blocks = first;
+        free_num++;
+
+    } else {
+        mp4_free(first);
+    }
+}
+
+void *
+Mp4Arena::alloc(size_t size) {
+    size_t hsize;
+    void *p;
+    Mp4ArenaBlock *blk;
+
+    size = mp4_arena_align(size);
+    hsize = mp4_arena_align(sizeof(Mp4ArenaBlock));
+
+    if (head->used + size <= head->size) {
+        p = (char *) head + head->used;
+        head->used += size;
+        return p;
+    }
+
+    if (size > (MP4_ARENA_BLOCK_SIZE - hsize) / 4) { // 大的分配单独一块, head 剩下的空间留给后面小的分配
+        blk = (Mp4ArenaBlock *) mp4_malloc(hsize + size);
+        blk->size = hsize + size;
+        blk->used = blk->size;
+        blk->next = head->next;
+        head->next = blk;
+        return (char *) blk + hsize;
+    }
+
+    blk = (Mp4ArenaBlock *) mp4_malloc(MP4_ARENA_BLOCK_SIZE);
+    blk->size = MP4_ARENA_BLOCK_SIZE;
+    blk->used = hsize + size;
+    blk->next = head;
+    head = blk;
+
+    return (char *) blk + hsize;
+}
@@ -0,0 +1,64 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef _MP4_ARENA_H
+#define _MP4_ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+
+#include "mp4_buffer.h"
+
+#define MP4_ARENA_BLOCK_SIZE (16 * 1024) // arena 每次向 mp4_malloc 申请的块大小, 一般的请求一块就够
+#define MP4_ARENA_ALIGN 16
+#define MP4_ARENA_FREE_MAX 32 // 每个线程缓存的空闲首块个数
+
+/*
+ * 一个事务的 Mp4Context, Mp4TransformContext, Mp4Trak 等对象都从这里顺序分配,
+ * 不单独释放, 事务结束时整体归还. arena 本身放在第一块的开头, 第一块归还到当前线程的空闲链表.
+ * 不是线程安全的, 只在持有事务或 transform 的 mutex 时分配.
+ */
+class Mp4Arena {
+public:
+    static Mp4Arena *create();
+
+    static void destroy(Mp4Arena *arena);
+
+    void *alloc(size_t size);
+
+    template <typename T, typename... Args>
+    T *
+    make(Args &&... args) {
+        return new (alloc(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+private:
+    typedef struct Mp4ArenaBlock {
+        struct Mp4ArenaBlock *next;
+        size_t size;
+        size_t used;
+    } Mp4ArenaBlock;
+
+    Mp4ArenaBlock *head; // 当前分配的块, 大的分配单独成块, 挂在 head 后面
+
+    // 每个线程归还的首块, 下一个事务直接复用, 不经过 mp4_malloc/mp4_free
+    static thread_local Mp4ArenaBlock *free_blocks;
+    static thread_local int free_num;
+};
+
+#endif
@@ -0,0 +1,290 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#include "mp4_buffer.h"
+
+#ifdef MP4_STANDALONE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define MP4_MEM_BUFFER_MIN_SIZE 4096
+
+// BlockReadStart 返回 data 中的 [start, end)
+struct Mp4MemBlock {
+    struct Mp4MemBuffer *buffer;
+    int64_t start;
+    int64_t end;
+};
+
+struct Mp4MemReader {
+    struct Mp4MemBuffer *buffer;
+    int64_t pos; // 在 data 中的偏移
+    bool used;
+    Mp4MemBlock block; // ReaderStart 返回它, BlockNext 原地后移, 所以每个 reader 同时只能有一次遍历
+};
+
+/*
+ * 连续内存的 buffer. data 中 [0, size) 为有效数据, 所有 reader 都已经消费过的部分在扩容前移走,
+ * 所以流式地写入和消费时内存不会一直增长. 扩容或移动之后, 之前 BlockReadStart 返回的指针失效.
+ */
+struct Mp4MemBuffer {
+    char *data;
+    int64_t size;
+    int64_t cap;
+    Mp4MemReader readers[MP4_IOBUFFER_READERS];
+};
+
+bool mp4_debug_enabled = false;
+int64_t mp4_mem_block_size = 0;
+
+/*
+ * pos 所在 block 的结尾, block 按 mp4_mem_block_size 对齐到 data 的开头
+ */
+static int64_t
+mp4_mem_block_end(Mp4IOBuffer bufp, int64_t pos) {
+    int64_t end;
+
+    if (mp4_mem_block_size <= 0) {
+        return bufp->size;
+    }
+
+    end = (pos / mp4_mem_block_size + 1) * mp4_mem_block_size;
+    return end < bufp->size ? end : bufp->size;
+}
+
+static void
+mp4_mem_buffer_reserve(Mp4IOBuffer bufp, int64_t length) {
+    int i;
+    int64_t min, cap;
+
+    if (bufp->size + length <= bufp->cap) {
+        return;
+    }
+
+    // 先移走所有 reader 都已经消费的数据, 没有 reader 时保留全部数据
+    min = -1;
+    for (i = 0; i < MP4_IOBUFFER_READERS; i++) {
+        if (bufp->readers[i].used && (min < 0 || bufp->readers[i].pos < min)) {
+            min = bufp->readers[i].pos;
+        }
+    }
+
+    if (min > 0) {
+        memmove(bufp->data, bufp->data + min, bufp->size - min);
+        bufp->size -= min;
+
+        for (i = 0; i < MP4_IOBUFFER_READERS; i++) {
+            if (bufp->readers[i].used) {
+                bufp->readers[i].pos -= min;
+            }
+        }
+
+        if (bufp->size + length <= bufp->cap) {
+            return;
+        }
+    }
+
+    cap = bufp->cap > 0 ? bufp->cap : MP4_MEM_BUFFER_MIN_SIZE;
+    while (cap < bufp->size + length) {
+        cap *= 2;
+    }
+
+    bufp->data = (char *) realloc(bufp->data, cap);
+    bufp->cap = cap;
+}
+
+Mp4IOBuffer
+Mp4IOBufferCreate() {
+    return (Mp4IOBuffer) calloc(1, sizeof(Mp4MemBuffer));
+}
+
+Mp4IOBuffer
+Mp4IOBufferSizedCreate(Mp4IOBufferSizeIndex index) {
+    Mp4IOBuffer bufp;
+
+    bufp = Mp4IOBufferCreate();
+    mp4_mem_buffer_reserve(bufp, (int64_t) 128 << index);
+
+    return bufp;
+}
+
+void
+Mp4IOBufferDestroy(Mp4IOBuffer bufp) {
+    free(bufp->data);
+    free(bufp);
+}
+
+int64_t
+Mp4IOBufferWrite(Mp4IOBuffer bufp, const void *buf, int64_t length) {
+    if (length <= 0) {
+        return 0;
+    }
+
+    mp4_mem_buffer_reserve(bufp, length);
+    memcpy(bufp->data + bufp->size, buf, length);
+    bufp->size += length;
+
+    return length;
+}
+
+/*
+ * 从 readerp 当前位置之后 offset 字节开始, 拷贝最多 length 字节追加到 bufp, 不消费 readerp
+ */
+int64_t
+Mp4IOBufferCopy(Mp4IOBuffer bufp, Mp4IOBufferReader readerp, int64_t length, int64_t offset) {
+    int64_t avail;
+
+    avail = Mp4IOBufferReaderAvail(readerp) - offset;
+    if (length > avail) {
+        length = avail;
+    }
+
+    if (length <= 0) {
+        return 0;
+    }
+
+    if (bufp == readerp->buffer) { // 扩容会移动源数据, 先拷贝出来
+        char *tmp = (char *) malloc(length);
+        memcpy(tmp, readerp->buffer->data + readerp->pos + offset, length);
+        Mp4IOBufferWrite(bufp, tmp, length);
+        free(tmp);
+        return length;
+    }
+
+    return Mp4IOBufferWrite(bufp, readerp->buffer->data + readerp->pos + offset, length);
+}
+
+Mp4IOBufferReader
+Mp4IOBufferReaderAlloc(Mp4IOBuffer bufp) {
+    int i;
+
+    for (i = 0; i < MP4_IOBUFFER_READERS; i++) {
+        if (!bufp->readers[i].used) {
+            bufp->readers[i].buffer = bufp;
+            bufp->readers[i].pos = 0;
+            bufp->readers[i].used = true;
+            return &bufp->readers[i];
+        }
+    }
+
+    return nullptr;
+}
+
+Mp4IOBufferReader
+Mp4IOBufferReaderClone(Mp4IOBufferReader readerp) {
+    Mp4IOBufferReader clone;
+
+    clone = Mp4IOBufferReaderAlloc(readerp->buffer);
+    if (clone) {
+        clone->pos = readerp->pos;
+    }
+
+    return clone;
+}
+
+void
+Mp4IOBufferReaderFree(Mp4IOBufferReader readerp) {
+    readerp->used = false;
+}
+
+int64_t
+Mp4IOBufferReaderAvail(Mp4IOBufferReader readerp) {
+    return readerp->buffer->size - readerp->pos;
+}
+
+void
+Mp4IOBufferReaderConsume(Mp4IOBufferReader readerp, int64_t nbytes) {
+    int64_t avail;
+
+    avail = Mp4IOBufferReaderAvail(readerp);
+    readerp->pos += nbytes < avail ? nbytes : avail;
+}
+
+/*
+ * 第一个 block 从 reader 的当前位置开始, 和 TSIOBufferBlockReadStart 一样已经跳过了消费的部分
+ */
+Mp4IOBufferBlock
+Mp4IOBufferReaderStart(Mp4IOBufferReader readerp) {
+    if (Mp4IOBufferReaderAvail(readerp) <= 0) {
+        return nullptr;
+    }
+
+    readerp->block.buffer = readerp->buffer;
+    readerp->block.start = readerp->pos;
+    readerp->block.end = mp4_mem_block_end(readerp->buffer, readerp->pos);
+
+    return &readerp->block;
+}
+
+Mp4IOBufferBlock
+Mp4IOBufferBlockNext(Mp4IOBufferBlock blockp) {
+    if (blockp->end >= blockp->buffer->size) {
+        return nullptr;
+    }
+
+    blockp->start = blockp->end;
+    blockp->end = mp4_mem_block_end(blockp->buffer, blockp->start);
+
+    return blockp;
+}
+
+const char *
+Mp4IOBufferBlockReadStart(Mp4IOBufferBlock blockp, Mp4IOBufferReader /* readerp ATS_UNUSED */, int64_t *avail) {
+    if (avail) {
+        *avail = blockp->end - blockp->start;
+    }
+
+    return blockp->buffer->data + blockp->start;
+}
+
+void *
+mp4_malloc(size_t size) {
+    void *ptr;
+
+    ptr = malloc(size);
+    if (ptr == nullptr && size > 0) {
+        fprintf(stderr, "[mp4_malloc] out of memory allocating %zu bytes\n", size);
+        abort();
+    }
+
+    return ptr;
+}
+
+void
+mp4_free(void *ptr) {
+    free(ptr);
+}
+
+void
+mp4_debug(const char *tag, const char *fmt, ...) {
+    va_list args;
+
+    if (!mp4_debug_enabled) {
+        return;
+    }
+
+    va_start(args, fmt);
+    fprintf(stderr, "[%s] ", tag);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef _MP4_BUFFER_H
+#define _MP4_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+/*
+ * 解析, 裁剪, 生成 meta 的代码(mp4_meta, mp4_arena)只通过这里使用缓冲区, 内存和调试日志.
+ * 接口和 TSIOBuffer 的一个子集一一对应:
+ *   插件里(默认)直接映射到 TSIOBuffer, 没有额外开销;
+ *   定义 MP4_STANDALONE 时使用连续内存的实现(mp4_buffer.cc), 不依赖 traffic_server,
+ *   可以单独编译, 用来做命令行工具, 基准测试和 profiling.
+ * 和 TSIOBuffer 一样, 数据只在末尾追加, reader 独立消费, 可以通过 reader 原地修改已写入的数据,
+ * 每个 buffer 最多 MP4_IOBUFFER_READERS 个 reader.
+ */
+
+#ifndef MP4_STANDALONE
+
+#include <ts/ts.h>
+
+typedef TSIOBuffer Mp4IOBuffer;
+typedef TSIOBufferReader Mp4IOBufferReader;
+typedef TSIOBufferBlock Mp4IOBufferBlock;
+typedef TSIOBufferSizeIndex Mp4IOBufferSizeIndex;
+
+#define MP4_IOBUFFER_SIZE_INDEX_128 TS_IOBUFFER_SIZE_INDEX_128
+#define MP4_IOBUFFER_SIZE_INDEX_2M TS_IOBUFFER_SIZE_INDEX_2M
+
+#define Mp4IOBufferCreate TSIOBufferCreate
+#define Mp4IOBufferSizedCreate TSIOBufferSizedCreate
+#define Mp4IOBufferDestroy TSIOBufferDestroy
+#define Mp4IOBufferWrite TSIOBufferWrite
+#define Mp4IOBufferCopy TSIOBufferCopy
+#define Mp4IOBufferReaderAlloc TSIOBufferReaderAlloc
+#define Mp4IOBufferReaderClone TSIOBufferReaderClone
+#define Mp4IOBufferReaderFree TSIOBufferReaderFree
+#define Mp4IOBufferReaderAvail TSIOBufferReaderAvail
+#define Mp4IOBufferReaderConsume TSIOBufferReaderConsume
+#define Mp4IOBufferReaderStart TSIOBufferReaderStart
+#define Mp4IOBufferBlockNext TSIOBufferBlockNext
+#define Mp4IOBufferBlockReadStart TSIOBufferBlockReadStart
+
+#define mp4_malloc TSmalloc
+#define mp4_free TSfree
+#define mp4_debug TSDebug
+
+#else
+
+#define MP4_IOBUFFER_READERS 5 // 和 TSIOBuffer 的 reader 个数上限相同
+
+typedef struct Mp4MemBuffer *Mp4IOBuffer;
+typedef struct Mp4MemReader *Mp4IOBufferReader;
+typedef struct Mp4MemBlock *Mp4IOBufferBlock; // 连续内存中的一段, 见 mp4_mem_block_size
+
+typedef enum {
+    MP4_IOBUFFER_SIZE_INDEX_128 = 0, // 只用作初始容量 128 << index
+    MP4_IOBUFFER_SIZE_INDEX_2M = 14,
+} Mp4IOBufferSizeIndex;
+
+Mp4IOBuffer Mp4IOBufferCreate();
+
+Mp4IOBuffer Mp4IOBufferSizedCreate(Mp4IOBufferSizeIndex index);
+
+void Mp4IOBufferDestroy(Mp4IOBuffer bufp);
+
+int64_t Mp4IOBufferWrite(Mp4IOBuffer bufp, const void *buf, int64_t length);
+
+int64_t Mp4IOBufferCopy(Mp4IOBuffer bufp, Mp4IOBufferReader readerp, int64_t length, int64_t offset);
+
+Mp4IOBufferReader Mp4IOBufferReaderAlloc(Mp4IOBuffer bufp);
+
+Mp4IOBufferReader Mp4IOBufferReaderClone(Mp4IOBufferReader readerp);
+
+void Mp4IOBufferReaderFree(Mp4IOBufferReader readerp);
+
+int64_t Mp4IOBufferReaderAvail(Mp4IOBufferReader readerp);
+
+void Mp4IOBufferReaderConsume(Mp4IOBufferReader readerp, int64_t nbytes);
+
+Mp4IOBufferBlock Mp4IOBufferReaderStart(Mp4IOBufferReader readerp);
+
+Mp4IOBufferBlock Mp4IOBufferBlockNext(Mp4IOBufferBlock blockp);
+
+const char *Mp4IOBufferBlockReadStart(Mp4IOBufferBlock blockp, Mp4IOBufferReader readerp, int64_t *avail);
+
+void *mp4_malloc(size_t size);
+
+void mp4_free(void *ptr);
+
+void mp4_debug(const char *tag, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+extern bool mp4_debug_enabled; // 调试日志写到 stderr, 默认关闭
+
+/*
+ * 数据仍然连续存放, 但按这个大小切成 block 交给调用方遍历, 用来模拟 TSIOBuffer 的 4K/32K/2M block,
+ * 衡量跨 block 的读写开销. 0(默认)表示整个 buffer 是一个 block
+ */
+extern int64_t mp4_mem_block_size;
+
+#endif
+
+#endif
@@ -27,6 +27,44 @@
 #include <ts/experimental.h>
 #include <ts/remap.h>
 #include "mp4_meta.h"
+#include "mp4_stats.h"
+
+#define MP4_OFFLOAD_ENTRIES (64 * 1024) // 表 entry 总数超过这个值时, 裁剪放到 task 线程执行
+
+typedef enum {
+    MP4_OFFLOAD_NONE = 0,
+    MP4_OFFLOAD_PENDING, // post_process_meta 已调度到 task 线程, 还没有执行
+    MP4_OFFLOAD_RUN,     // 正在 task 线程上执行
+    MP4_OFFLOAD_CROP,    // 其余 trak 正在 task 线程池上并行裁剪
+    MP4_OFFLOAD_JOIN     // 所有 trak 都裁剪完了
+} TSMp4OffloadState;
+
+// remap 参数
+class Mp4Config {
+public:
+    Mp4Config() : meta_budget(MP4_META_BUDGET), work_budget(MP4_WORK_BUDGET), offload_entries(MP4_OFFLOAD_ENTRIES),
+                  server_timing(false), slow_parse_ms(0), slow_total_ms(0), slow_moov(0), slow_discard(0),
+                  seek_log(0) {};
+
+    bool
+    slow_log() const {
+        return slow_parse_ms > 0 || slow_total_ms > 0 || slow_moov > 0 || slow_discard > 0;
+    }
+
+public:
+    int64_t meta_budget; // --meta-budget=<bytes>[K|M|G]
+    int64_t work_budget; // --work-budget=<entries>[K|M|G]
+    int64_t offload_entries; // --offload-entries=<entries>[K|M|G]
+    bool server_timing;      // --server-timing, 响应中加上各阶段耗时
+
+    // 超过任一阈值的请求写入慢请求日志, 0 表示不检查
+    int64_t slow_parse_ms;   // --slow-parse-ms=<ms>, 解析和裁剪 meta 的耗时
+    int64_t slow_total_ms;   // --slow-total-ms=<ms>, 整个事务的耗时
+    int64_t slow_moov;       // --slow-moov=<bytes>[K|M|G], 原文件 moov 大小
+    int64_t slow_discard;    // --slow-discard=<bytes>[K|M|G], start_tail 之前丢弃的字节
+
+    int64_t seek_log;        // --seek-log=<seconds>, 按文件累计裁剪代价, 每个周期写入 ts_mp4_seek.log
+};
 
 class IOHandle {
 public:
@@ -52,9 +90,13 @@ public:
 
 class Mp4TransformContext {
 public:
-    Mp4TransformContext(float offset, float end_offset, int64_t cl)
-            : total(0), start_tail(0), end_tail(0), start_pos(0), end_pos(0), content_length(0), meta_length(0),
+    Mp4TransformContext(float offset, float end_offset, int64_t cl, const Mp4Config &conf, Mp4Arena *arena)
+            : mm(arena), total(0), start_tail(0), end_tail(0), start_pos(0), end_pos(0), content_length(0), meta_length(0),
+              meta_pos(0), offload_entries(conf.offload_entries), offload_action(nullptr),
+              offload(MP4_OFFLOAD_NONE), crop_jobs(0), crop_failed(false), crop_join(nullptr), transform(nullptr),
+              transform_closed(false), mem_cur(0), mem_peak(0), first_byte_time(0), first_out_time(0), crop_start(0),
               parse_over(false), raw_transform(false) {
+        memset(phase_time, 0, sizeof(phase_time));
         res_buffer = TSIOBufferCreate();
         res_reader = TSIOBufferReaderAlloc(res_buffer);
         dup_reader = TSIOBufferReaderAlloc(res_buffer);
@@ -71,6 +113,8 @@ public:
             }
         }
         mm.cl = cl;
+        mm.meta_budget = conf.meta_budget;
+        mm.work_budget = conf.work_budget;
     }
 
     ~Mp4TransformContext() {
@@ -87,6 +131,35 @@ public:
         }
     }
 
+    /*
+     * 采样当前请求占用的内存: 缓存的响应, 下游还没取走的输出, 以及 meta 的各个 atom 和索引.
+     * 并行裁剪时 trak 正在被 task 线程修改, 只算缓冲区. 变化量累加到 MP4_STAT_MEM_CURRENT.
+     */
+    void
+    mp4_memory_sample() {
+        int64_t bytes, n;
+
+        bytes = res_reader ? TSIOBufferReaderAvail(res_reader) : 0;
+        if (dup_reader) {
+            n = TSIOBufferReaderAvail(dup_reader); // 与 res_reader 共享 res_buffer, 取较早的那个
+            bytes = n > bytes ? n : bytes;
+        }
+
+        if (output.reader) {
+            bytes += TSIOBufferReaderAvail(output.reader);
+        }
+
+        if (offload != MP4_OFFLOAD_CROP) {
+            bytes += mm.mp4_meta_bytes();
+        }
+
+        mp4_stat_increment(MP4_STAT_MEM_CURRENT, bytes - mem_cur);
+        mem_cur = bytes;
+        if (bytes > mem_peak) {
+            mem_peak = bytes;
+        }
+    }
+
 public:
     IOHandle output;
     Mp4Meta mm;
@@ -97,6 +170,21 @@ public:
     int64_t end_pos; //end 丢弃的位置
     int64_t content_length;
     int64_t meta_length;
+    int64_t meta_pos; // 已经输出或跳过的 meta 字节数
+    int64_t offload_entries;
+    TSAction offload_action;
+    TSMp4OffloadState offload;
+    std::atomic<int> crop_jobs;     // 还没完成的 trak 裁剪任务
+    std::atomic<bool> crop_failed;
+    TSCont crop_join;               // 所有 trak 任务完成后回到 transform 的 mutex 下
+    TSCont transform;
+    std::atomic<bool> transform_closed;
+    int64_t mem_cur;  // 最近一次采样的内存
+    int64_t mem_peak; // 采样到的内存峰值
+    TSHRTime first_byte_time; // 第一次收到响应数据
+    TSHRTime first_out_time;  // 第一次输出数据
+    TSHRTime crop_start;      // moov 读完, 开始裁剪
+    TSHRTime phase_time[MP4_PHASE_MAX]; // 各阶段耗时(ns), 用于 Server-Timing
 
     TSIOBuffer res_buffer;
     TSIOBufferReader res_reader;
@@ -106,24 +194,51 @@ public:
     bool raw_transform;
 };
 
+class Mp4Context;
+
+// 在 task 线程池上裁剪一个 trak, 从事务的 arena 分配
+class Mp4CropJob {
+public:
+    Mp4CropJob(Mp4Context *c, Mp4Trak *t) : mc(c), trak(t) {};
+
+    Mp4Context *mc;
+    Mp4Trak *trak;
+};
+
 class Mp4Context {
 public:
-    Mp4Context(float s, float e, int64_t r_start, bool r_tag) : start(s), end(e), range_start(r_start),
+    Mp4Context(float s, float e, int64_t r_start, bool r_tag, const Mp4Config &c, Mp4Arena *a) : start(s), end(e), range_start(r_start),
                                                                 range_start_pos(r_start),
                                                                 range_end_pos(0),
                                                                 mp4_meta_start_dup(0),
                                                                 range_tag(r_tag),
                                                                 cl(0), real_cl(0),range_cl(0),
+                                                                conf(c),
+                                                                arena(a),
                                                                 mtc(NULL),
+                                                                refcount(1),
+                                                                start_time(TShrtime()),
                                                                 transform_added(false),meta_copy(false){};
 
     ~Mp4Context() {
         if (mtc) {
-            delete mtc;
+            mtc->~Mp4TransformContext();
             mtc = NULL;
         }
     }
 
+    // 事务结束和并行裁剪的任务各持有一个引用, 最后一个释放的负责析构并归还整个 arena
+    void
+    release() {
+        Mp4Arena *a;
+
+        if (--refcount == 0) {
+            a = arena;
+            this->~Mp4Context();
+            Mp4Arena::destroy(a);
+        }
+    }
+
     void
     mp4_calculation_range(int64_t mp4_meta, int64_t s_pos, int64_t e_pos, int64_t content_length) {
         if (!range_tag)
@@ -178,11 +293,15 @@ public:
     int64_t cl;
     int64_t real_cl;//start,end的长度
     int64_t range_cl;
+    Mp4Config conf; // remap 参数的拷贝, remap 重新加载时请求仍在进行
 
+    Mp4Arena *arena; // Mp4Context 本身也在 arena 里
     Mp4TransformContext *mtc;
+    std::atomic<int> refcount;
+    TSHRTime start_time; // 进入 remap 的时间
 
     bool transform_added;
-    bool meta_copy; //是否已经复制过
+    bool meta_copy; //新的 meta 是否已经全部输出
 };
 
 #endif
\ No newline at end of file
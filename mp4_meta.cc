@@ -16,63 +16,169 @@
 
 #include "mp4_meta.h"
 
-static mp4_atom_handler mp4_atoms[] = {{"ftyp",  &Mp4Meta::mp4_read_ftyp_atom},//表明文件类型
-                                       {"moov",  &Mp4Meta::mp4_read_moov_atom},//包含了媒体metadata信息,包含1个“mvhd”和若干个“trak”,子box
-                                       {"mdat",  &Mp4Meta::mp4_read_mdat_atom},//存放了媒体数据
-                                       {nullptr, nullptr}};
-
-static mp4_atom_handler mp4_moov_atoms[] = {{"mvhd",  &Mp4Meta::mp4_read_mvhd_atom},//文件总体信息，如时长，创建时间等
-                                            {"trak",  &Mp4Meta::mp4_read_trak_atom},//存放视频，音频的容器  包括video trak,audio trak
-                                            {"cmov",  &Mp4Meta::mp4_read_cmov_atom},//
-                                            {nullptr, nullptr}};
-
-static mp4_atom_handler mp4_trak_atoms[] = {{"tkhd",  &Mp4Meta::mp4_read_tkhd_atom},//track的总体信息，如时长，高宽等
-                                            {"mdia",  &Mp4Meta::mp4_read_mdia_atom},//定义了track媒体类型以及sample数据，描述sample信息
-                                            {nullptr, nullptr}};
-
-static mp4_atom_handler mp4_mdia_atoms[] = {{"mdhd",  &Mp4Meta::mp4_read_mdhd_atom},//定义了timescale,trak需要通过timescale换算成真实时间
-                                            {"hdlr",  &Mp4Meta::mp4_read_hdlr_atom},//表明trak类型，是video/audio/hint
-                                            {"minf",  &Mp4Meta::mp4_read_minf_atom},//数据在子box中
-                                            {nullptr, nullptr}};
-
-static mp4_atom_handler mp4_minf_atoms[] = {{"vmhd",  &Mp4Meta::mp4_read_vmhd_atom},//
-                                            {"smhd",  &Mp4Meta::mp4_read_smhd_atom},
-                                            {"dinf",  &Mp4Meta::mp4_read_dinf_atom},
-                                            {"stbl",  &Mp4Meta::mp4_read_stbl_atom},//sample table box存放是时间/偏移的映射关系表
-                                            {nullptr, nullptr}};
-
 static mp4_atom_handler mp4_stbl_atoms[] = {
-        {"stsd",  &Mp4Meta::mp4_read_stsd_atom},
-        {"stts",  &Mp4Meta::mp4_read_stts_atom},// time to sample, 时间戳—sample序号 映射表
-        {"stss",  &Mp4Meta::mp4_read_stss_atom},//确定media中的关键帧
-        {"ctts",  &Mp4Meta::mp4_read_ctts_atom},
-        {"stsc",  &Mp4Meta::mp4_read_stsc_atom},// sample to chunk, sample 和chunk 映射表
-        {"stsz",  &Mp4Meta::mp4_read_stsz_atom},// sample size , 每个sample 大小
-        {"stco",  &Mp4Meta::mp4_read_stco_atom},//chunk offset, 每个chunk的偏移，sample的偏移可根据其他box推算出来
-        {"co64",  &Mp4Meta::mp4_read_co64_atom},//64-bit chunk offseet
-        {nullptr, nullptr}};
+        {mp4_fourcc("stsd"), &Mp4Meta::mp4_read_stsd_atom, nullptr},
+        {mp4_fourcc("stts"), &Mp4Meta::mp4_read_stts_atom, nullptr},// time to sample, 时间戳—sample序号 映射表
+        {mp4_fourcc("stss"), &Mp4Meta::mp4_read_stss_atom, nullptr},//确定media中的关键帧
+        {mp4_fourcc("ctts"), &Mp4Meta::mp4_read_ctts_atom, nullptr},
+        {mp4_fourcc("stsc"), &Mp4Meta::mp4_read_stsc_atom, nullptr},// sample to chunk, sample 和chunk 映射表
+        {mp4_fourcc("stsz"), &Mp4Meta::mp4_read_stsz_atom, nullptr},// sample size , 每个sample 大小
+        {mp4_fourcc("stz2"), &Mp4Meta::mp4_read_stz2_atom, nullptr},// compact sample size, 4/8/16 位的 sample 大小
+        {mp4_fourcc("stco"), &Mp4Meta::mp4_read_stco_atom, nullptr},//chunk offset, 每个chunk的偏移，sample的偏移可根据其他box推算出来
+        {mp4_fourcc("co64"), &Mp4Meta::mp4_read_co64_atom, nullptr},//64-bit chunk offseet
+        {0, nullptr, nullptr}};
+
+static mp4_atom_handler mp4_minf_atoms[] = {{mp4_fourcc("vmhd"), &Mp4Meta::mp4_read_vmhd_atom, nullptr},//
+                                            {mp4_fourcc("smhd"), &Mp4Meta::mp4_read_smhd_atom, nullptr},
+                                            {mp4_fourcc("dinf"), &Mp4Meta::mp4_read_dinf_atom, nullptr},
+                                            {mp4_fourcc("stbl"), &Mp4Meta::mp4_read_stbl_atom, mp4_stbl_atoms},//sample table box存放是时间/偏移的映射关系表
+                                            {0, nullptr, nullptr}};
+
+static mp4_atom_handler mp4_mdia_atoms[] = {{mp4_fourcc("mdhd"), &Mp4Meta::mp4_read_mdhd_atom, nullptr},//定义了timescale,trak需要通过timescale换算成真实时间
+                                            {mp4_fourcc("hdlr"), &Mp4Meta::mp4_read_hdlr_atom, nullptr},//表明trak类型，是video/audio/hint
+                                            {mp4_fourcc("minf"), &Mp4Meta::mp4_read_minf_atom, mp4_minf_atoms},//数据在子box中
+                                            {0, nullptr, nullptr}};
+
+static mp4_atom_handler mp4_trak_atoms[] = {{mp4_fourcc("tkhd"), &Mp4Meta::mp4_read_tkhd_atom, nullptr},//track的总体信息，如时长，高宽等
+                                            {mp4_fourcc("mdia"), &Mp4Meta::mp4_read_mdia_atom, mp4_mdia_atoms},//定义了track媒体类型以及sample数据，描述sample信息
+                                            {0, nullptr, nullptr}};
+
+static mp4_atom_handler mp4_moov_atoms[] = {{mp4_fourcc("mvhd"), &Mp4Meta::mp4_read_mvhd_atom, nullptr},//文件总体信息，如时长，创建时间等
+                                            {mp4_fourcc("trak"), &Mp4Meta::mp4_read_trak_atom, mp4_trak_atoms},//存放视频，音频的容器  包括video trak,audio trak
+                                            {mp4_fourcc("cmov"), &Mp4Meta::mp4_read_cmov_atom, nullptr},//
+                                            {0, nullptr, nullptr}};
+
+// 容器 box 的 handler 只处理 box header, 子 box 由 mp4_read_atom 按 children 逐个解析
+static mp4_atom_handler mp4_atoms[] = {{mp4_fourcc("ftyp"), &Mp4Meta::mp4_read_ftyp_atom, nullptr},//表明文件类型
+                                       {mp4_fourcc("moov"), &Mp4Meta::mp4_read_moov_atom, mp4_moov_atoms},//包含了媒体metadata信息,包含1个“mvhd”和若干个“trak”,子box
+                                       {mp4_fourcc("mdat"), &Mp4Meta::mp4_read_mdat_atom, nullptr},//存放了媒体数据
+                                       {0, nullptr, nullptr}};
 
-static void mp4_reader_set_32value(TSIOBufferReader readerp, int64_t offset, uint32_t n);
+static int64_t IOBufferWriteReader(Mp4IOBuffer bufp, Mp4IOBufferReader readerp);
 
-static void mp4_reader_set_64value(TSIOBufferReader readerp, int64_t offset, uint64_t n);
+static Mp4IOBufferSizeIndex mp4_buffer_size_index(int64_t size);
 
-static uint32_t mp4_reader_get_32value(TSIOBufferReader readerp, int64_t offset);
+static uint32_t mp4_index_search32(const uint32_t *v, uint32_t n, uint32_t key);
 
-static uint64_t mp4_reader_get_64value(TSIOBufferReader readerp, int64_t offset);
+static uint32_t mp4_get_sample_size(const u_char *buf, uint32_t field_size, uint32_t i);
+
+static uint32_t mp4_index_search64(const uint64_t *v, uint32_t n, uint64_t key);
+
+// 按字段宽度(4/8 字节)在编译期选择读写函数
+template <size_t N>
+struct Mp4Field;
+
+template <>
+struct Mp4Field<sizeof(uint32_t)> {
+    static uint64_t get(Mp4IOBufferReader readerp, int64_t offset) {
+        return mp4_reader_get_32value(readerp, offset);
+    }
+
+    static void set(Mp4IOBufferReader readerp, int64_t offset, uint64_t n) {
+        mp4_reader_set_32value(readerp, offset, (uint32_t) n);
+    }
+};
+
+template <>
+struct Mp4Field<sizeof(uint64_t)> {
+    static uint64_t get(Mp4IOBufferReader readerp, int64_t offset) {
+        return mp4_reader_get_64value(readerp, offset);
+    }
+
+    static void set(Mp4IOBufferReader readerp, int64_t offset, uint64_t n) {
+        mp4_reader_set_64value(readerp, offset, n);
+    }
+};
+
+#define mp4_field(A, f) Mp4Field<sizeof(((A *) nullptr)->f)>
+
+// 单一布局 A 的字段访问, 偏移和宽度在编译期确定
+template <typename A>
+struct Mp4AtomLayout {
+    static uint32_t get_timescale(Mp4IOBufferReader readerp) {
+        return mp4_reader_get_32value(readerp, offsetof(A, timescale));
+    }
+
+    static uint64_t get_duration(Mp4IOBufferReader readerp) {
+        return mp4_field(A, duration)::get(readerp, offsetof(A, duration));
+    }
+
+    static void set_duration(Mp4IOBufferReader readerp, uint64_t duration) {
+        mp4_field(A, duration)::set(readerp, offsetof(A, duration), duration);
+    }
 
-static int64_t IOBufferReaderCopy(TSIOBufferReader readerp, void *buf, int64_t length);
+    static const Mp4HeaderLayout layout;
+};
+
+template <typename A>
+const Mp4HeaderLayout Mp4AtomLayout<A>::layout = {sizeof(A), &Mp4AtomLayout<A>::get_duration,
+                                                  &Mp4AtomLayout<A>::set_duration};
+
+/*
+ * mvhd/tkhd/mdhd 的 version 0(V0) 和 version 1(V1) 布局不同. 读 box 时只看一次 version,
+ * 之后的读写都走选定布局的 Mp4HeaderLayout, 不再判断 version.
+ */
+template <typename V0, typename V1>
+struct Mp4VersionedAtom {
+    static bool v1(Mp4IOBufferReader readerp) {
+        return (mp4_reader_get_32value(readerp, offsetof(V0, version)) >> 24) != 0;
+    }
+
+    static const Mp4HeaderLayout *layout(Mp4IOBufferReader readerp) {
+        return v1(readerp) ? &Mp4AtomLayout<V1>::layout : &Mp4AtomLayout<V0>::layout;
+    }
+
+    static uint32_t get_timescale(const Mp4HeaderLayout *layout, Mp4IOBufferReader readerp) {
+        return layout == &Mp4AtomLayout<V1>::layout ? Mp4AtomLayout<V1>::get_timescale(readerp)
+                                                     : Mp4AtomLayout<V0>::get_timescale(readerp);
+    }
+};
+
+typedef Mp4VersionedAtom<mp4_mvhd_atom, mp4_mvhd64_atom> Mp4MvhdAtom;
+typedef Mp4VersionedAtom<mp4_tkhd_atom, mp4_tkhd64_atom> Mp4TkhdAtom;
+typedef Mp4VersionedAtom<mp4_mdhd_atom, mp4_mdhd64_atom> Mp4MdhdAtom;
 
 int
 Mp4Meta::parse_meta(bool body_complete) {
     int ret, rc;
 
-    meta_avail = TSIOBufferReaderAvail(meta_reader);
+    ret = this->parse_meta_atoms(body_complete);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    // generate new meta data
+    //然后进行 start end 操作
+    rc = this->post_process_meta();
+//    mp4_debug(PLUGIN_NAME, "end post_process_meta rc = %d", rc);
+    if (rc != 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * 只解析 box, 不做裁剪. 裁剪(post_process_meta)开销大时可以放到别的线程执行
+ *  -1: error
+ *   0: unfinished
+ *   1: success
+ */
+int
+Mp4Meta::parse_meta_atoms(bool body_complete) {
+    int ret;
+
+    meta_avail = Mp4IOBufferReaderAvail(meta_reader);
 
     if (wait_next && wait_next <= meta_avail) {
         mp4_meta_consume(wait_next);
         wait_next = 0;
     }
 
+    if (wait_next) { // 还在跳过无用的 box
+        return body_complete ? -1 : 0;
+    }
+
     if (meta_avail < MP4_MIN_BUFFER_SIZE && !body_complete) {
         return 0;
     }
@@ -92,31 +198,149 @@ Mp4Meta::parse_meta(bool body_complete) {
         }
     }
 
-    // generate new meta data
-    //然后进行 start end 操作
-    rc = this->post_process_meta();
-//    TSDebug(PLUGIN_NAME, "end post_process_meta rc = %d", rc);
-    if (rc != 0) {
-        return -1;
+    return 1;
+}
+
+/*
+ * 所有 sample 表的 entry 总数, 用来估计 post_process_meta 的开销
+ */
+int64_t
+Mp4Meta::mp4_table_entries() {
+    uint32_t i;
+    int64_t entries;
+    Mp4Trak *trak;
+
+    entries = 0;
+
+    for (i = 0; i < trak_num; i++) {
+        trak = trak_vec[i];
+        entries += (int64_t) trak->time_to_sample_entries + trak->sync_samples_entries + trak->composition_offset_entries +
+                   trak->sample_to_chunk_entries + trak->sample_sizes_entries + trak->chunks;
     }
 
-    return 1;
+    return entries;
+}
+
+/*
+ * meta 当前占用的内存: 还没解析的数据, 各个 atom, 输出中的表, 待输出的新 meta 和 trak 的索引
+ */
+int64_t
+Mp4Meta::mp4_meta_bytes() {
+    uint32_t i, j;
+    int64_t bytes;
+    Mp4Trak *trak;
+
+    bytes = Mp4IOBufferReaderAvail(meta_reader) + ftyp_atom.bytes() + moov_atom.bytes() + mvhd_atom.bytes() +
+            mdat_atom.bytes() + mdat_data.bytes() + out_handle.bytes();
+
+    if (write_reader) {
+        bytes += Mp4IOBufferReaderAvail(write_reader);
+    }
+
+    for (i = 0; i < trak_num; i++) {
+        trak = trak_vec[i];
+
+        for (j = 0; j <= MP4_LAST_ATOM; j++) {
+            bytes += trak->atoms[j].bytes();
+        }
+
+        bytes += trak->index.bytes();
+    }
+
+    return bytes;
 }
 
 void
 Mp4Meta::mp4_meta_consume(int64_t size) {
-    TSIOBufferReaderConsume(meta_reader, size);
+    Mp4IOBufferReaderConsume(meta_reader, size);
     meta_avail -= size;
     passed += size;
 }
 
+/*
+ * 记录 meta 占用的内存, 超出 remap 配置的预算时返回 -1, 按原文件输出
+ */
+int
+Mp4Meta::mp4_meta_charge(int64_t size) {
+    int64_t used;
+
+    used = meta_used.fetch_add(size) + size;
+
+    if (used > meta_budget) {
+        mp4_debug(PLUGIN_NAME, "[mp4_meta_charge] meta uses %" PRId64 " bytes, exceeds budget %" PRId64,
+                used, meta_budget);
+        return mp4_meta_error(MP4_ERROR_META_BUDGET);
+    }
+
+    return 1;
+}
+
+/*
+ * 记录处理过的表 entry 数, 超出 work budget 时返回 -1, 避免异常的 moov 长时间占用线程
+ */
+int
+Mp4Meta::mp4_meta_work(int64_t entries) {
+    int64_t done;
+
+    done = work_done.fetch_add(entries) + entries;
+
+    if (done > work_budget) {
+        mp4_debug(PLUGIN_NAME, "[mp4_meta_work] processed %" PRId64 " entries, exceeds budget %" PRId64,
+                done, work_budget);
+        return mp4_meta_error(MP4_ERROR_WORK_BUDGET);
+    }
+
+    return 1;
+}
+
+static const char *mp4_parse_error_names[] = {"ok", "malformed", "moov_too_big", "work_budget", "cmov",
+                                              "moov_after_mdat"};
+
+/*
+ * 失败原因的名字, 用于日志
+ */
+const char *
+mp4_parse_error_name(TSMp4ParseError err) {
+    return mp4_parse_error_names[err];
+}
+
+/*
+ * 记录失败原因, 已有原因时保留第一个. 总是返回 -1
+ */
+int
+Mp4Meta::mp4_meta_error(TSMp4ParseError err) {
+    TSMp4ParseError none;
+
+    none = MP4_ERROR_NONE;
+    parse_error.compare_exchange_strong(none, err);
+
+    return -1;
+}
+
 int//开始进行moov box 修改
 Mp4Meta::post_process_meta() {
-    //偏移 ， 调整
-    off_t start_offset, adjustment, end_offset;
-    uint32_t i, j;
-    int64_t avail;
-    Mp4Trak *trak;
+    uint32_t i;
+    Mp4Trak *lead;
+
+    if (mp4_start_meta(&lead) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < trak_num; i++) {
+        if (trak_vec[i] != lead && mp4_process_trak(trak_vec[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return mp4_finish_meta();
+}
+
+/*
+ * 检查 meta 并裁剪 lead trak. 返回后其余 trak 可以按任意顺序(或并行)交给 mp4_process_trak
+ */
+int
+Mp4Meta::mp4_start_meta(Mp4Trak **lead) {
+    *lead = nullptr;
 
     if (this->trak_num == 0) {
         return -1;
@@ -126,59 +350,71 @@ Mp4Meta::post_process_meta() {
         return -1;
     }
 
-    out_handle.buffer = TSIOBufferCreate();
-    out_handle.reader = TSIOBufferReaderAlloc(out_handle.buffer);
+    // 先裁剪第一个带关键帧(stss)的 trak, 起点对齐到关键帧后得到 rs, 其余 trak 只读 rs, 相互独立
+    *lead = mp4_lead_trak();
 
-    if (ftyp_atom.buffer) {// 不用修改直接copy
-        TSIOBufferCopy(out_handle.buffer, ftyp_atom.reader, TSIOBufferReaderAvail(ftyp_atom.reader), 0);
+    if (*lead && mp4_process_trak(*lead) != 0) {
+        return -1;
     }
 
-    if (moov_atom.buffer) {// moov header
-        TSIOBufferCopy(out_handle.buffer, moov_atom.reader, TSIOBufferReaderAvail(moov_atom.reader), 0);
+    return 0;
+}
+
+/*
+ * 决定 rs 的 trak: 第一个带关键帧的 trak, 没有时返回 nullptr
+ */
+Mp4Trak *
+Mp4Meta::mp4_lead_trak() {
+    uint32_t i;
+
+    for (i = 0; i < trak_num; i++) {
+        if (trak_vec[i]->atoms[MP4_STSS_DATA].buffer && trak_vec[i]->sync_samples_entries > 0) {
+            return trak_vec[i];
+        }
     }
 
+    return nullptr;
+}
+
+/*
+ * 建索引并裁剪一个 trak. lead trak 处理完之后, 其余的 trak 可以在不同线程上同时处理,
+ * 它们只修改自己的 trak, 共享的只有 meta_used/work_done 两个原子计数
+ */
+int
+Mp4Meta::mp4_process_trak(Mp4Trak *trak) {
+    if (mp4_build_sample_index(trak) != 0) {
+        return -1;
+    }
+
+    return mp4_crop_trak(trak);
+}
+
+/*
+ * 所有 trak 裁剪完之后, 计算 moov 大小, chunk 偏移的调整量, 准备输出
+ */
+int
+Mp4Meta::mp4_finish_meta() {
+    //偏移 ， 调整
+    off_t start_offset, end_offset;
+    uint32_t i;
+    Mp4Trak *trak;
+
+    mp4_update_mvhd_duration();//更新duration
+
     if (mvhd_atom.buffer) {// mvhd
-        avail = TSIOBufferReaderAvail(mvhd_atom.reader);
-        TSIOBufferCopy(out_handle.buffer, mvhd_atom.reader, avail, 0);
-        this->moov_size += avail; //计算move size
+        this->moov_size += Mp4IOBufferReaderAvail(mvhd_atom.reader); //计算move size
     }
 
     start_offset = cl;
     //start_offset= 86812929
     end_offset = 0;
-    TSDebug(PLUGIN_NAME, "[post_process_meta] start_offset= %ld", start_offset);
+    mp4_debug(PLUGIN_NAME, "[mp4_finish_meta] start_offset= %ld", start_offset);
     for (i = 0; i < trak_num; i++) {
         trak = trak_vec[i];
-        if (mp4_update_stts_atom(trak) != 0) {
-            return -1;
-        }
-        if (mp4_update_stss_atom(trak) != 0) {
-            return -1;
-        }
-        mp4_update_ctts_atom(trak);
-        if (mp4_update_stsc_atom(trak) != 0) {
-            return -1;
-        }
-        if (mp4_update_stsz_atom(trak) != 0) {
-            return -1;
-        }
-        if (trak->atoms[MP4_CO64_DATA].buffer) {
-            if (mp4_update_co64_atom(trak) != 0) {
-                return -1;
-            }
-
-        } else if (mp4_update_stco_atom(trak) != 0) {
-            return -1;
-        }
-        mp4_update_stbl_atom(trak);
-        mp4_update_minf_atom(trak);
-        trak->size += trak->mdhd_size;
-        trak->size += trak->hdlr_size;
-        mp4_update_mdia_atom(trak);
-        trak->size += trak->tkhd_size;
-        mp4_update_trak_atom(trak);
 
         this->moov_size += trak->size;//moov size = mvhd size + trak size
+        trak->index.clear(); // 索引只在裁剪时使用
+        mp4_trim_tables(trak);
         //trak->start_offset 每个trak 的偏移量
         //因为包含了多个trak 列入 video trak, audio trak 所以多者之间要找最小的start_offset
         if (start_offset > trak->start_offset) {
@@ -190,55 +426,79 @@ Mp4Meta::post_process_meta() {
             if (start_offset > end_offset)
                 end_offset = 0;
         }
-//        TSDebug(PLUGIN_NAME, "[post_process_meta] start_offset = %ld, end_offset=%ld", start_offset, end_offset);
-
-        for (j = 0; j <= MP4_LAST_ATOM; j++) {
-            if (trak->atoms[j].buffer) {
-                int64_t a = TSIOBufferReaderAvail(trak->atoms[j].reader);
-                TSIOBufferCopy(out_handle.buffer, trak->atoms[j].reader, TSIOBufferReaderAvail(trak->atoms[j].reader),
-                               0);
-            }
-        }
-
-//        mp4_update_tkhd_duration(trak);//更新duration
-//        mp4_update_mdhd_duration(trak);//更新duration
+//        mp4_debug(PLUGIN_NAME, "[post_process_meta] start_offset = %ld, end_offset=%ld", start_offset, end_offset);
     }
 
     if (end_offset < start_offset) {
         end_offset = start_offset;
     }
 
-    this->moov_size += 8;//加上本身的 size + name 大小
+    this->moov_size += sizeof(mp4_atom_header);//加上本身的 size + name 大小
 
-    mp4_reader_set_32value(moov_atom.reader, 0, this->moov_size);
     this->content_length += this->moov_size;// content_length = ftype+ moov size
     // content_length= 39840, moov_size=39808
-//    TSDebug(PLUGIN_NAME, "[post_process_meta] content_length= %ld, moov_size=%ld", this->content_length,
+//    mp4_debug(PLUGIN_NAME, "[post_process_meta] content_length= %ld, moov_size=%ld", this->content_length,
 //            this->moov_size);
     //this->content_length + (cl-start_offset)的长度 + mdat header size
     //为一个负数，丢弃了多少字节
     //adjustment=-23640769,ftyp=32, moov_size=39808, start_offset= 23680617, mdat_header=8  end_offset= 48723014
-    adjustment = this->ftyp_size + this->moov_size + mp4_update_mdat_atom(start_offset, end_offset) - start_offset;
-//    TSDebug(PLUGIN_NAME,
+    mdat_header_size = mp4_update_mdat_atom(start_offset, end_offset);
+    mp4_seek_cost(start_offset, end_offset);
+    adjustment = this->ftyp_size + this->moov_size + mdat_header_size - start_offset;
+    meta_size = this->ftyp_size + this->moov_size + mdat_header_size;
+//    mp4_debug(PLUGIN_NAME,
 //            "[post_process_meta] adjustment=%ld,ftyp=%ld, moov_size=%ld, start_offset= %ld, mdat_header=%ld",
 //            adjustment, this->ftyp_size, this->moov_size, start_offset,
 //            (start_offset + adjustment - this->ftyp_size - this->moov_size));
-    TSIOBufferCopy(out_handle.buffer, mdat_atom.reader, TSIOBufferReaderAvail(mdat_atom.reader), 0);
 
-    for (i = 0; i < trak_num; i++) {
-        trak = trak_vec[i];
+    // 所有 size 和 adjustment 都已确定, 新的 ftyp + moov + mdat header 由 mp4_write_meta 按输出的需要分批生成,
+    // 每批都是按顺序追加, 不会回头修改已经输出的数据
+    out_handle.buffer = Mp4IOBufferSizedCreate(
+            mp4_buffer_size_index(meta_size < MP4_META_WRITE_SIZE ? meta_size : MP4_META_WRITE_SIZE));
+    out_handle.reader = Mp4IOBufferReaderAlloc(out_handle.buffer);
 
-        //减去偏移量
-        if (trak->atoms[MP4_CO64_DATA].buffer) {
-            mp4_adjust_co64_atom(trak, adjustment);
+    write_stage = MP4_WRITE_HEADER;
 
-        } else {
-            mp4_adjust_stco_atom(trak, adjustment);
+//    mp4_debug(PLUGIN_NAME, "[post_process_meta] last  content_length= %ld", this->content_length);
+    return 0;
+}
+
+/**
+ * 裁剪单个 trak 的 sample 表并计算各层 atom 的新 size
+ */
+int
+Mp4Meta::mp4_crop_trak(Mp4Trak *trak) {
+    if (mp4_update_stts_atom(trak) != 0) {
+        return -1;
+    }
+    if (mp4_update_stss_atom(trak) != 0) {
+        return -1;
+    }
+    mp4_update_ctts_atom(trak);
+    if (mp4_update_stsc_atom(trak) != 0) {
+        return -1;
+    }
+    if (mp4_update_stsz_atom(trak) != 0) {
+        return -1;
+    }
+    if (trak->atoms[MP4_CO64_DATA].buffer) {
+        if (mp4_update_co64_atom(trak) != 0) {
+            return -1;
         }
+
+    } else if (mp4_update_stco_atom(trak) != 0) {
+        return -1;
     }
+    mp4_update_stbl_atom(trak);
+    mp4_update_minf_atom(trak);
+    trak->size += trak->mdhd_size;
+    trak->size += trak->hdlr_size;
+    mp4_update_mdia_atom(trak);
+    trak->size += trak->tkhd_size;
+    mp4_update_trak_atom(trak);
 
-//    mp4_update_mvhd_duration();//更新duration
-//    TSDebug(PLUGIN_NAME, "[post_process_meta] last  content_length= %ld", this->content_length);
+    mp4_update_mdhd_duration(trak);//更新duration
+    mp4_update_tkhd_duration(trak);//更新duration
     return 0;
 }
 
@@ -251,11 +511,19 @@ int
 Mp4Meta::parse_root_atoms() {
     int i, ret, rc;
     int64_t atom_size, atom_header_size, copied_size;
+    uint32_t atom_type;
     char buf[64];
-    char *atom_header, *atom_name;
+    char *atom_header;
 
     memset(buf, 0, sizeof(buf));
 
+    if (read_depth > 0) { // 上次 moov 还没解析完, 从断点继续
+        ret = mp4_read_atom();
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
     for (;;) {
         if (meta_avail < (int64_t) sizeof(uint32_t)) {
             return 0;
@@ -294,14 +562,14 @@ Mp4Meta::parse_root_atoms() {
             atom_header_size = sizeof(mp4_atom_header);
         }
 
-        atom_name = atom_header + 4;
+        atom_type = mp4_get_32value(atom_header + 4);
 
         if (atom_size + this->passed > this->cl) {//超过总长度
             return -1;
         }
 
-        for (i = 0; mp4_atoms[i].name; i++) {// box header + box body
-            if (memcmp(atom_name, mp4_atoms[i].name, 4) == 0) {
+        for (i = 0; mp4_atoms[i].type; i++) {// box header + box body
+            if (atom_type == mp4_atoms[i].type) {
                 ret = (this->*mp4_atoms[i].handler)(atom_header_size, atom_size -
                                                                       atom_header_size); // -1: error, 0: unfinished, 1: success
 
@@ -312,6 +580,17 @@ Mp4Meta::parse_root_atoms() {
                     return 1;
                 }
 
+                if (mp4_atoms[i].children) {
+                    if (mp4_push_atom(mp4_atoms[i].children, atom_size - atom_header_size) < 0) {
+                        return -1;
+                    }
+
+                    ret = mp4_read_atom();
+                    if (ret <= 0) {
+                        return ret;
+                    }
+                }
+
                 goto next;
             }
         }
@@ -344,88 +623,125 @@ Mp4Meta::mp4_atom_next(int64_t atom_size, bool wait) {
     return -1;
 }
 
+int
+Mp4Meta::mp4_push_atom(mp4_atom_handler *atom, int64_t size) {
+    if (read_depth >= MP4_MAX_ATOM_DEPTH) {
+        return -1;
+    }
+
+    read_stack[read_depth].atom = atom;
+    read_stack[read_depth].left = size;
+    read_depth++;
+
+    return 1;
+}
+
 /*
+ * 从最内层的容器 box 继续解析, 子 box 的数据全了就处理, 不全就返回 0 等下次数据到来
  *  -1: error
+ *   0: unfinished
  *   1: success
  */
 int
-Mp4Meta::mp4_read_atom(mp4_atom_handler *atom, int64_t size) {
+Mp4Meta::mp4_read_atom() {
     int i, ret, rc;
     int64_t atom_size, atom_header_size, copied_size;
+    uint32_t atom_type;
     char buf[32];
     char *atom_header, *atom_name;
+    Mp4AtomFrame *frame;
+    mp4_atom_handler *atom;
 
-    if (meta_avail < size) { // data insufficient, not reasonable for internal atom box. 数据应该是全的
-        return -1;
-    }
+    while (read_depth > 0) {
+        frame = &read_stack[read_depth - 1];
 
-    while (size > 0) {
-        if (meta_avail < (int64_t) sizeof(uint32_t)) { // data insufficient, not reasonable for internal atom box.
-            return -1;
+        if (frame->left <= 0) { // 这个容器解析完了
+            read_depth--;
+            continue;
+        }
+
+        if (meta_avail < (int64_t) sizeof(mp4_atom_header)) {
+            return 0;
         }
 
         copied_size = IOBufferReaderCopy(meta_reader, buf, sizeof(mp4_atom_header64));
         atom_size = copied_size > 0 ? mp4_get_32value(buf) : 0;
 
-        if (atom_size == 0) {
-            return 1;
-        }
-
         atom_header = buf;
+        atom_header_size = sizeof(mp4_atom_header);
 
-        if (atom_size < (int64_t) sizeof(mp4_atom_header)) { //判断是32位还是64位的
-            if (atom_size == 1) {
-                if (meta_avail < (int64_t) sizeof(mp4_atom_header64)) {
-                    return -1;
-                }
+        if (atom_size == 0) { // 一直延伸到容器末尾
+            atom_size = frame->left;
 
-            } else {
+        } else if (atom_size < (int64_t) sizeof(mp4_atom_header)) { //判断是32位还是64位的
+            if (atom_size != 1) {
                 return -1;
             }
 
+            if (meta_avail < (int64_t) sizeof(mp4_atom_header64)) {
+                return 0;
+            }
+
             atom_size = mp4_get_64value(atom_header + 8);
             atom_header_size = sizeof(mp4_atom_header64);
 
-        } else { // regular atom
-
-            if (meta_avail < (int64_t) sizeof(mp4_atom_header)) {
+            if (atom_size < atom_header_size) {
                 return -1;
             }
-
-            atom_header_size = sizeof(mp4_atom_header);
         }
 
         atom_name = atom_header + 4;
+        atom_type = mp4_get_32value(atom_name);
 
         if (atom_size + this->passed > this->cl) { //判断一下总长度
             return -1;
         }
 
-        for (i = 0; atom[i].name; i++) {
-            if (memcmp(atom_name, atom[i].name, 4) == 0) {
-                if (meta_avail < atom_size) {
-                    return -1;
+        atom = frame->atom;
+
+        for (i = 0; atom[i].type; i++) {
+            if (atom_type == atom[i].type) {
+                if (atom[i].children == nullptr) { // 叶子 box 要等数据全了再解析, 解析后一直保留到输出完成
+                    if (meta_used + atom_size > meta_budget) {
+                        mp4_debug(PLUGIN_NAME, "[mp4_read_atom] %.4s exceeds meta budget %" PRId64, atom_name, meta_budget);
+                        return mp4_meta_error(MP4_ERROR_META_BUDGET);
+                    }
+
+                    if (meta_avail < atom_size) {
+                        return 0;
+                    }
+
+                    meta_used += atom_size;
                 }
 
+                frame->left -= atom_size;
+
                 ret = (this->*atom[i].handler)(atom_header_size,
-                                               atom_size - atom_header_size); // -1: error, 0: success.
+                                               atom_size - atom_header_size); // -1: error, 1: success.
 
                 if (ret < 0) {
                     return ret;
                 }
 
+                if (atom[i].children) { // 只消费了 box header, 接着解析子 box
+                    if (mp4_push_atom(atom[i].children, atom_size - atom_header_size) < 0) {
+                        return -1;
+                    }
+                }
+
                 goto next;
             }
         }
 
         // insignificant atom box
-        rc = mp4_atom_next(atom_size, false); //可以忽视的box
-        if (rc < 0) {
-            return rc;
+        frame->left -= atom_size;
+
+        rc = mp4_atom_next(atom_size, true); //可以忽视的box, 数据不全时由 parse_meta 跳过
+        if (rc == 0) {
+            return 0;
         }
 
         next:
-        size -= atom_size;
         continue;
     }
 
@@ -446,10 +762,10 @@ Mp4Meta::mp4_read_ftyp_atom(int64_t atom_header_size, int64_t atom_data_size) {
         return 0;
     }
 
-    ftyp_atom.buffer = TSIOBufferCreate();
-    ftyp_atom.reader = TSIOBufferReaderAlloc(ftyp_atom.buffer);
+    ftyp_atom.buffer = Mp4IOBufferCreate();
+    ftyp_atom.reader = Mp4IOBufferReaderAlloc(ftyp_atom.buffer);
 
-    TSIOBufferCopy(ftyp_atom.buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(ftyp_atom.buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     content_length = atom_size;//文件长度
@@ -460,135 +776,116 @@ Mp4Meta::mp4_read_ftyp_atom(int64_t atom_header_size, int64_t atom_data_size) {
 
 int//读取moov
 Mp4Meta::mp4_read_moov_atom(int64_t atom_header_size, int64_t atom_data_size) {
-    int64_t atom_size;
-    int ret;
-
     if (mdat_atom.buffer != nullptr) { // not reasonable for streaming media 如果先读的mdata 的话，就当失败来处理
-        return -1;
+        return mp4_meta_error(MP4_ERROR_MOOV_AFTER_MDAT);
     }
 
-    atom_size = atom_header_size + atom_data_size;
+    src_moov_size = atom_header_size + atom_data_size;
 
-    if (atom_data_size >= MP4_MAX_BUFFER_SIZE) { //如果大于限定的buffer 当出错处理
-        return -1;
-    }
+    moov_atom.buffer = Mp4IOBufferCreate();
+    moov_atom.reader = Mp4IOBufferReaderAlloc(moov_atom.buffer);
 
-    if (meta_avail < atom_size) { // data unsufficient, wait 数据不全，继续等待
-        return 0;
-    }
-
-    moov_atom.buffer = TSIOBufferCreate();
-    moov_atom.reader = TSIOBufferReaderAlloc(moov_atom.buffer);
-
-    TSIOBufferCopy(moov_atom.buffer, meta_reader, atom_header_size, 0); //先拷贝 BOX HEADER
+    Mp4IOBufferCopy(moov_atom.buffer, meta_reader, atom_header_size, 0); //先拷贝 BOX HEADER, mvhd + track 随数据到来逐个解析
     mp4_meta_consume(atom_header_size);
 
-    ret = mp4_read_atom(mp4_moov_atoms, atom_data_size);//开始解析mvhd + track.........
-
-    return ret;
+    return 1;
 }
 
 int
 Mp4Meta::mp4_read_mvhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
     int64_t atom_size;
-    uint32_t timescale;
-    mp4_mvhd_atom *mvhd;
-    mp4_mvhd64_atom mvhd64;
     uint64_t duration, start_time, length_time;
 
-    if (sizeof(mp4_mvhd_atom) - 8 > (size_t) atom_data_size) {
-        return -1;
-    }
-
-    memset(&mvhd64, 0, sizeof(mvhd64));
-    IOBufferReaderCopy(meta_reader, &mvhd64, sizeof(mp4_mvhd64_atom));
-    mvhd = (mp4_mvhd_atom *) &mvhd64;
-
-    if (mvhd->version[0] == 0) {
-        timescale = mp4_get_32value(mvhd->timescale);
-        duration = mp4_get_32value(mvhd->duration);
-
-    } else { // 64-bit duration
-        timescale = mp4_get_32value(mvhd64.timescale);
-        duration = mp4_get_64value(mvhd64.duration);
-    }
-
-    this->timescale = timescale;  //获取整部电影的time scale
-//    TSDebug(PLUGIN_NAME, "[mp4_read_mvhd_atom] timescale = %lu, duration=%llu", this->timescale, duration);
     atom_size = atom_header_size + atom_data_size;
 
-    mvhd_atom.buffer = TSIOBufferCreate();
-    mvhd_atom.reader = TSIOBufferReaderAlloc(mvhd_atom.buffer);
+    mvhd_atom.buffer = Mp4IOBufferCreate();
+    mvhd_atom.reader = Mp4IOBufferReaderAlloc(mvhd_atom.buffer);
 
-    TSIOBufferCopy(mvhd_atom.buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(mvhd_atom.buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
+    mvhd_layout = Mp4MvhdAtom::layout(mvhd_atom.reader);
+    if ((size_t) atom_size < mvhd_layout->size) {
+        return -1;
+    }
+
+    this->timescale = Mp4MvhdAtom::get_timescale(mvhd_layout, mvhd_atom.reader);  //获取整部电影的time scale
+    duration = mvhd_layout->get_duration(mvhd_atom.reader);
 
-//    TSDebug(PLUGIN_NAME, "[mp4_read_mvhd_atom] mvhd timescale:%uD, duration:%uL, time:%.3fs",
+//    mp4_debug(PLUGIN_NAME, "[mp4_read_mvhd_atom] mvhd timescale:%uD, duration:%uL, time:%.3fs",
 //            timescale, duration, (double) duration / timescale);
 
-    start_time = (uint64_t) this->start * timescale / 1000;
+    start_time = (uint64_t) this->start * this->timescale / 1000;
 
     if (duration < start_time) {
-        TSDebug(PLUGIN_NAME, "[mp4_read_mvhd_atom]  mp4 start time exceeds file duration");
+        mp4_debug(PLUGIN_NAME, "[mp4_read_mvhd_atom]  mp4 start time exceeds file duration");
         return -1;
     }
 
     duration -= start_time;
 
     if (this->length) {
-        length_time = (uint64_t) this->length * timescale / 1000;
+        length_time = (uint64_t) this->length * this->timescale / 1000;
 
         if (duration > length_time) {
             duration = length_time;
         }
     }
 
-//    TSDebug(PLUGIN_NAME, "[mp4_read_mvhd_atom] mvhd new duration:%uL, time:%.3fs",
+//    mp4_debug(PLUGIN_NAME, "[mp4_read_mvhd_atom] mvhd new duration:%uL, time:%.3fs",
 //            duration, (double) duration / timescale);
 
-    if (mvhd->version[0] == 0) {
-
-        mp4_reader_set_32value(mvhd_atom.reader, offsetof(mp4_mvhd_atom, duration), duration);
-
-    } else { // 64-bit duration
-        mp4_reader_set_64value(mvhd_atom.reader, offsetof(mp4_mvhd64_atom, duration), duration);
-    }
-
+    mvhd_layout->set_duration(mvhd_atom.reader, duration);
 
     return 1;
 }
 
 int//读取track
-Mp4Meta::mp4_read_trak_atom(int64_t atom_header_size, int64_t atom_data_size) {
-    int rc;
+Mp4Meta::mp4_read_trak_atom(int64_t atom_header_size, int64_t /* atom_data_size ATS_UNUSED */) {
+    uint32_t cap;
     Mp4Trak *trak;
+    Mp4Trak **vec;
+
+    if (trak_num >= trak_cap) { // trak 个数不限, 占用的内存计入 meta 预算
+        cap = trak_cap ? trak_cap * 2 : MP4_TRAK_VEC_SIZE;
+
+        if (mp4_meta_charge((int64_t) (cap - trak_cap) * sizeof(Mp4Trak *)) < 0) {
+            return -1;
+        }
+
+        // 旧的 trak_vec 留在 arena 里, 事务结束时一起归还
+        vec = (Mp4Trak **) arena->alloc(cap * sizeof(Mp4Trak *));
+        if (trak_num > 0) {
+            memcpy(vec, trak_vec, trak_num * sizeof(Mp4Trak *));
+        }
+
+        trak_vec = vec;
+        trak_cap = cap;
+    }
 
-    if (trak_num >= MP4_MAX_TRAK_NUM - 1) {
+    if (mp4_meta_charge(sizeof(Mp4Trak)) < 0) {
         return -1;
     }
 
-    trak = new Mp4Trak();
+    trak = arena->make<Mp4Trak>();
     trak_vec[trak_num++] = trak;
 
-    trak->atoms[MP4_TRAK_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_TRAK_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_TRAK_ATOM].buffer);
+    trak->atoms[MP4_TRAK_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_TRAK_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_TRAK_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_TRAK_ATOM].buffer, meta_reader, atom_header_size, 0);// box header
+    Mp4IOBufferCopy(trak->atoms[MP4_TRAK_ATOM].buffer, meta_reader, atom_header_size, 0);// box header
     mp4_meta_consume(atom_header_size);
 
-    rc = mp4_read_atom(mp4_trak_atoms, atom_data_size);//读取tkhd + media
-
-    return rc;
+    return 1;
 }
 
 int Mp4Meta::mp4_read_cmov_atom(int64_t /*atom_header_size ATS_UNUSED */, int64_t /* atom_data_size ATS_UNUSED */) {
-    return -1;
+    return mp4_meta_error(MP4_ERROR_CMOV);
 }
 
 int
 Mp4Meta::mp4_read_tkhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
-    int64_t atom_size, need;
+    int64_t atom_size;
     Mp4Trak *trak;
     uint64_t duration, start_time, length_time;
 
@@ -597,39 +894,24 @@ Mp4Meta::mp4_read_tkhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->tkhd_size = atom_size;//track header box size
 
-    trak->atoms[MP4_TKHD_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_TKHD_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_TKHD_ATOM].buffer);
+    trak->atoms[MP4_TKHD_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_TKHD_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_TKHD_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_TKHD_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_TKHD_ATOM].buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     mp4_reader_set_32value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd_atom, size), atom_size);//设置一下tkhd 的总大小
 
-
-    mp4_tkhd_atom *tkhd_atom;
-    mp4_tkhd64_atom tkhd64_atom;
-
-    need = TSIOBufferReaderAvail(trak->atoms[MP4_TKHD_ATOM].reader);
-
-    if (need > (int64_t) sizeof(mp4_tkhd64_atom)) {
-        need = sizeof(mp4_tkhd64_atom);
+    trak->tkhd_layout = Mp4TkhdAtom::layout(trak->atoms[MP4_TKHD_ATOM].reader);
+    if ((size_t) atom_size < trak->tkhd_layout->size) {
+        return -1;
     }
 
-    memset(&tkhd64_atom, 0, sizeof(tkhd64_atom));
-    IOBufferReaderCopy(trak->atoms[MP4_TKHD_ATOM].reader, &tkhd64_atom, need);
-    tkhd_atom = (mp4_tkhd_atom *) &tkhd64_atom;
-
-    if (tkhd_atom->version[0] == 0) {
-        duration = mp4_get_32value(tkhd_atom->duration);
-
-    } else {
-        duration = mp4_get_64value(tkhd64_atom.duration);
-
-    }
+    duration = trak->tkhd_layout->get_duration(trak->atoms[MP4_TKHD_ATOM].reader);
 
     start_time = (uint64_t) this->start * this->timescale / 1000;
     if (duration <= start_time) {
-        TSDebug(PLUGIN_NAME, "[mp4_read_tkhd_atom] tkhd duration is less than start time");
+        mp4_debug(PLUGIN_NAME, "[mp4_read_tkhd_atom] tkhd duration is less than start time");
         return -1;
     }
 
@@ -643,33 +925,27 @@ Mp4Meta::mp4_read_tkhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
         }
     }
 
-//    TSDebug(PLUGIN_NAME, "[mp4_read_tkhd_atom] tkhd new duration:%uL, time:%.3fs", duration,
+//    mp4_debug(PLUGIN_NAME, "[mp4_read_tkhd_atom] tkhd new duration:%uL, time:%.3fs", duration,
 //            (double) duration / this->timescale);
 
-    if (tkhd_atom->version[0] == 0) {
-        mp4_reader_set_32value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd_atom, duration), duration);
-
-    } else {
-        mp4_reader_set_64value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd64_atom, duration), duration);
-
-    }
+    trak->tkhd_layout->set_duration(trak->atoms[MP4_TKHD_ATOM].reader, duration);
 
     return 1;
 }
 
 int
-Mp4Meta::mp4_read_mdia_atom(int64_t atom_header_size, int64_t atom_data_size) {
+Mp4Meta::mp4_read_mdia_atom(int64_t atom_header_size, int64_t /* atom_data_size ATS_UNUSED */) {
     Mp4Trak *trak;
 
     trak = trak_vec[trak_num - 1];
 
-    trak->atoms[MP4_MDIA_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_MDIA_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_MDIA_ATOM].buffer);
+    trak->atoms[MP4_MDIA_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_MDIA_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_MDIA_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_MDIA_ATOM].buffer, meta_reader, atom_header_size, 0);//读取 box header
+    Mp4IOBufferCopy(trak->atoms[MP4_MDIA_ATOM].buffer, meta_reader, atom_header_size, 0);//读取 box header
     mp4_meta_consume(atom_header_size);
 
-    return mp4_read_atom(mp4_mdia_atoms, atom_data_size);
+    return 1;
 }
 
 int
@@ -678,41 +954,33 @@ Mp4Meta::mp4_read_mdhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
     uint64_t duration, start_time, length_time;
     uint32_t ts;
     Mp4Trak *trak;
-    mp4_mdhd_atom *mdhd;
-    mp4_mdhd64_atom mdhd64;
-
-    memset(&mdhd64, 0, sizeof(mdhd64));
-    IOBufferReaderCopy(meta_reader, &mdhd64, sizeof(mp4_mdhd64_atom));
-    mdhd = (mp4_mdhd_atom *) &mdhd64;
-
-    if (mdhd->version[0] == 0) {
-        ts = mp4_get_32value(mdhd->timescale);
-        duration = mp4_get_32value(mdhd->duration);
-
-    } else {
-        ts = mp4_get_32value(mdhd64.timescale);
-        duration = mp4_get_64value(mdhd64.duration);
-    }
 
     atom_size = atom_header_size + atom_data_size;
 
     trak = trak_vec[trak_num - 1];
     trak->mdhd_size = atom_size;
-    //时长 = duration / timescale
-    trak->timescale = ts;
-//    trak->duration = duration;
 
-    trak->atoms[MP4_MDHD_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_MDHD_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_MDHD_ATOM].buffer);
+    trak->atoms[MP4_MDHD_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_MDHD_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_MDHD_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_MDHD_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_MDHD_ATOM].buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     mp4_reader_set_32value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd_atom, size), atom_size);//重新设置大小
 
+    trak->mdhd_layout = Mp4MdhdAtom::layout(trak->atoms[MP4_MDHD_ATOM].reader);
+    if ((size_t) atom_size < trak->mdhd_layout->size) {
+        return -1;
+    }
+
+    //时长 = duration / timescale
+    ts = Mp4MdhdAtom::get_timescale(trak->mdhd_layout, trak->atoms[MP4_MDHD_ATOM].reader);
+    duration = trak->mdhd_layout->get_duration(trak->atoms[MP4_MDHD_ATOM].reader);
+    trak->timescale = ts;
+
     start_time = (uint64_t) this->start * ts / 1000;
     if (duration <= start_time) {
-        TSDebug(PLUGIN_NAME, "[mp4_read_mdhd_atom] mdhd duration is less than start time");
+        mp4_debug(PLUGIN_NAME, "[mp4_read_mdhd_atom] mdhd duration is less than start time");
         return -1;
     }
 
@@ -725,16 +993,11 @@ Mp4Meta::mp4_read_mdhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
             duration = length_time;
         }
     }
-//    TSDebug(PLUGIN_NAME, "[mp4_read_mdhd_atom] mdhd new duration:%uL, time:%.3fs", duration, (double) duration / ts);
+//    mp4_debug(PLUGIN_NAME, "[mp4_read_mdhd_atom] mdhd new duration:%uL, time:%.3fs", duration, (double) duration / ts);
 
     trak->duration = duration;
 
-    if (mdhd->version[0] == 0) {
-        mp4_reader_set_32value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd_atom, duration), duration);
-    } else {
-        mp4_reader_set_64value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd64_atom, duration), duration);
-
-    }
+    trak->mdhd_layout->set_duration(trak->atoms[MP4_MDHD_ATOM].reader, duration);
 
     return 1;
 }
@@ -749,28 +1012,28 @@ Mp4Meta::mp4_read_hdlr_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->hdlr_size = atom_size;
 
-    trak->atoms[MP4_HDLR_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_HDLR_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_HDLR_ATOM].buffer);
+    trak->atoms[MP4_HDLR_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_HDLR_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_HDLR_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_HDLR_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_HDLR_ATOM].buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     return 1;
 }
 
 int
-Mp4Meta::mp4_read_minf_atom(int64_t atom_header_size, int64_t atom_data_size) {
+Mp4Meta::mp4_read_minf_atom(int64_t atom_header_size, int64_t /* atom_data_size ATS_UNUSED */) {
     Mp4Trak *trak;
 
     trak = trak_vec[trak_num - 1];
 
-    trak->atoms[MP4_MINF_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_MINF_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_MINF_ATOM].buffer);
+    trak->atoms[MP4_MINF_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_MINF_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_MINF_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_MINF_ATOM].buffer, meta_reader, atom_header_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_MINF_ATOM].buffer, meta_reader, atom_header_size, 0);
     mp4_meta_consume(atom_header_size);
 
-    return mp4_read_atom(mp4_minf_atoms, atom_data_size);
+    return 1;
 }
 
 int
@@ -783,10 +1046,10 @@ Mp4Meta::mp4_read_vmhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->vmhd_size += atom_size;
 
-    trak->atoms[MP4_VMHD_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_VMHD_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_VMHD_ATOM].buffer);
+    trak->atoms[MP4_VMHD_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_VMHD_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_VMHD_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_VMHD_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_VMHD_ATOM].buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     return 1;
@@ -802,10 +1065,10 @@ Mp4Meta::mp4_read_smhd_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->smhd_size += atom_size;
 
-    trak->atoms[MP4_SMHD_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_SMHD_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_SMHD_ATOM].buffer);
+    trak->atoms[MP4_SMHD_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_SMHD_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_SMHD_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_SMHD_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_SMHD_ATOM].buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     return 1;
@@ -821,28 +1084,28 @@ Mp4Meta::mp4_read_dinf_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->dinf_size += atom_size;
 
-    trak->atoms[MP4_DINF_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_DINF_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_DINF_ATOM].buffer);
+    trak->atoms[MP4_DINF_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_DINF_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_DINF_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_DINF_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_DINF_ATOM].buffer, meta_reader, atom_size, 0);
     mp4_meta_consume(atom_size);
 
     return 1;
 }
 
 int
-Mp4Meta::mp4_read_stbl_atom(int64_t atom_header_size, int64_t atom_data_size) {
+Mp4Meta::mp4_read_stbl_atom(int64_t atom_header_size, int64_t /* atom_data_size ATS_UNUSED */) {
     Mp4Trak *trak;
 
     trak = trak_vec[trak_num - 1];
 
-    trak->atoms[MP4_STBL_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STBL_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STBL_ATOM].buffer);
+    trak->atoms[MP4_STBL_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STBL_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STBL_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_STBL_ATOM].buffer, meta_reader, atom_header_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_STBL_ATOM].buffer, meta_reader, atom_header_size, 0);
     mp4_meta_consume(atom_header_size);
 
-    return mp4_read_atom(mp4_stbl_atoms, atom_data_size);
+    return 1;
 }
 
 int//sample description box
@@ -855,10 +1118,10 @@ Mp4Meta::mp4_read_stsd_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->size += atom_size;
 
-    trak->atoms[MP4_STSD_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STSD_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSD_ATOM].buffer);
+    trak->atoms[MP4_STSD_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSD_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSD_ATOM].buffer);
 
-    TSIOBufferCopy(trak->atoms[MP4_STSD_ATOM].buffer, meta_reader, atom_size, 0);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSD_ATOM].buffer, meta_reader, atom_size, 0);
 
     mp4_meta_consume(atom_size);
 
@@ -898,13 +1161,13 @@ Mp4Meta::mp4_read_stts_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak->stts_pos = 0;
     trak->stts_last = (uint32_t) entries;
 
-    trak->atoms[MP4_STTS_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STTS_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STTS_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STTS_ATOM].buffer, meta_reader, sizeof(mp4_stts_atom), 0);
+    trak->atoms[MP4_STTS_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STTS_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STTS_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STTS_ATOM].buffer, meta_reader, sizeof(mp4_stts_atom), 0);
 
-    trak->atoms[MP4_STTS_DATA].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STTS_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STTS_DATA].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STTS_DATA].buffer, meta_reader, esize, sizeof(mp4_stts_atom));
+    trak->atoms[MP4_STTS_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STTS_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STTS_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STTS_DATA].buffer, meta_reader, esize, sizeof(mp4_stts_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -942,13 +1205,13 @@ Mp4Meta::mp4_read_stss_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak->stss_pos = 0;
     trak->stss_last = entries;
 
-    trak->atoms[MP4_STSS_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STSS_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSS_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STSS_ATOM].buffer, meta_reader, sizeof(mp4_stss_atom), 0);
+    trak->atoms[MP4_STSS_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSS_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSS_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSS_ATOM].buffer, meta_reader, sizeof(mp4_stss_atom), 0);
 
-    trak->atoms[MP4_STSS_DATA].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STSS_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSS_DATA].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STSS_DATA].buffer, meta_reader, esize, sizeof(mp4_stss_atom));
+    trak->atoms[MP4_STSS_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSS_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSS_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSS_DATA].buffer, meta_reader, esize, sizeof(mp4_stss_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -980,13 +1243,13 @@ Mp4Meta::mp4_read_ctts_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak->ctts_pos = 0;
     trak->ctts_last = entries;
 
-    trak->atoms[MP4_CTTS_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_CTTS_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_CTTS_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_CTTS_ATOM].buffer, meta_reader, sizeof(mp4_ctts_atom), 0);
+    trak->atoms[MP4_CTTS_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_CTTS_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_CTTS_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_CTTS_ATOM].buffer, meta_reader, sizeof(mp4_ctts_atom), 0);
 
-    trak->atoms[MP4_CTTS_DATA].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_CTTS_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_CTTS_DATA].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_CTTS_DATA].buffer, meta_reader, esize, sizeof(mp4_ctts_atom));
+    trak->atoms[MP4_CTTS_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_CTTS_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_CTTS_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_CTTS_DATA].buffer, meta_reader, esize, sizeof(mp4_ctts_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -1029,13 +1292,13 @@ Mp4Meta::mp4_read_stsc_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak->stsc_pos = 0;
     trak->stsc_last = entries;
 
-    trak->atoms[MP4_STSC_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STSC_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSC_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STSC_ATOM].buffer, meta_reader, sizeof(mp4_stsc_atom), 0);
+    trak->atoms[MP4_STSC_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSC_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSC_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSC_ATOM].buffer, meta_reader, sizeof(mp4_stsc_atom), 0);
 
-    trak->atoms[MP4_STSC_DATA].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STSC_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSC_DATA].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STSC_DATA].buffer, meta_reader, esize, sizeof(mp4_stsc_atom));
+    trak->atoms[MP4_STSC_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSC_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSC_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSC_DATA].buffer, meta_reader, esize, sizeof(mp4_stsc_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -1051,7 +1314,7 @@ Mp4Meta::mp4_read_stsc_atom(int64_t atom_header_size, int64_t atom_data_size) {
 int
 Mp4Meta::mp4_read_stsz_atom(int64_t atom_header_size, int64_t atom_data_size) {
     int32_t entries, size;
-    int64_t esize, atom_size, copied_size;
+    int64_t esize, copied_size;
     mp4_stsz_atom stsz;
     Mp4Trak *trak;
 
@@ -1067,28 +1330,82 @@ Mp4Meta::mp4_read_stsz_atom(int64_t atom_header_size, int64_t atom_data_size) {
     size = copied_size > 0 ? mp4_get_32value(stsz.uniform_size) : 0;
 
     trak->sample_sizes_entries = entries;
+    trak->sample_size = size;
+    trak->sample_field_size = 32;
 
     trak->stsz_pos = 0;
     trak->stsz_last = entries;
 
-    trak->atoms[MP4_STSZ_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STSZ_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSZ_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STSZ_ATOM].buffer, meta_reader, sizeof(mp4_stsz_atom), 0);
+    trak->atoms[MP4_STSZ_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSZ_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSZ_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSZ_ATOM].buffer, meta_reader, sizeof(mp4_stsz_atom), 0);
 
     if (size == 0) {//全部sample 数目，如果所有的sample有相同的长度，这个字段就是这个值，否则就是0
         if (sizeof(mp4_stsz_atom) - 8 + esize > (size_t) atom_data_size) {
             return -1;
         }
 
-        trak->atoms[MP4_STSZ_DATA].buffer = TSIOBufferCreate();
-        trak->atoms[MP4_STSZ_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSZ_DATA].buffer);
-        TSIOBufferCopy(trak->atoms[MP4_STSZ_DATA].buffer, meta_reader, esize, sizeof(mp4_stsz_atom));
+        trak->atoms[MP4_STSZ_DATA].buffer = Mp4IOBufferCreate();
+        trak->atoms[MP4_STSZ_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSZ_DATA].buffer);
+        Mp4IOBufferCopy(trak->atoms[MP4_STSZ_DATA].buffer, meta_reader, esize, sizeof(mp4_stsz_atom));
+    }
+    // 大小相同时没有表, 裁剪时按 sample 数直接计算字节数, 见 mp4_sample_bytes
+
+    mp4_meta_consume(atom_data_size + atom_header_size);
+
+    return 1;
+}
+
+/**
+ * compact sample size box
+ * size, type, version, flags, reserved(24 bits), field size(8 bits), number of entries
+ * sample 1: 4/8/16 位的 sample size, 4 位时两个 sample 一个字节, 高 4 位在前
+ * ........
+ * 表保持原来的位宽, 不展开成 32 位
+ */
+int
+Mp4Meta::mp4_read_stz2_atom(int64_t atom_header_size, int64_t atom_data_size) {
+    uint32_t entries, field_size;
+    int64_t esize, copied_size;
+    mp4_stz2_atom stz2;
+    Mp4Trak *trak;
+
+    if (sizeof(mp4_stz2_atom) - 8 > (size_t) atom_data_size) {
+        return -1;
+    }
+
+    copied_size = IOBufferReaderCopy(meta_reader, &stz2, sizeof(mp4_stz2_atom));
+    entries = copied_size > 0 ? mp4_get_32value(stz2.entries) : 0;
+    field_size = copied_size > 0 ? stz2.field_size[0] : 0;
+
+    if (field_size != 4 && field_size != 8 && field_size != 16) {
+        mp4_debug(PLUGIN_NAME, "[mp4_read_stz2_atom] invalid field size %u", field_size);
+        return -1;
+    }
+
+    esize = ((int64_t) entries * field_size + 7) / 8;
+
+    if (sizeof(mp4_stz2_atom) - 8 + esize > (size_t) atom_data_size) {
+        return -1;
+    }
+
+    trak = trak_vec[trak_num - 1];
+
+    trak->sample_sizes_entries = entries;
+    trak->sample_size = 0;
+    trak->sample_field_size = field_size;
+
+    trak->stsz_pos = 0;
+    trak->stsz_last = entries;
+
+    // stz2 与 stsz 共用 MP4_STSZ_ATOM/MP4_STSZ_DATA, size 和 entries 字段的位置相同
+    trak->atoms[MP4_STSZ_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSZ_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSZ_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSZ_ATOM].buffer, meta_reader, sizeof(mp4_stz2_atom), 0);
 
-    } else {
-        atom_size = atom_header_size + atom_data_size;
-        trak->size += atom_size;
-        mp4_reader_set_32value(trak->atoms[MP4_STSZ_ATOM].reader, 0, atom_size);
-    }
+    trak->atoms[MP4_STSZ_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STSZ_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSZ_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STSZ_DATA].buffer, meta_reader, esize, sizeof(mp4_stz2_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -1123,14 +1440,14 @@ Mp4Meta::mp4_read_stco_atom(int64_t atom_header_size, int64_t atom_data_size) {
     trak = trak_vec[trak_num - 1];
     trak->chunks = entries;
     // entries = 16391,trak_num=0
-//    TSDebug(PLUGIN_NAME, "[mp4_read_stco_atom] entries = %d,trak_num=%lu", entries, trak_num - 1);
-    trak->atoms[MP4_STCO_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STCO_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STCO_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STCO_ATOM].buffer, meta_reader, sizeof(mp4_stco_atom), 0);
+//    mp4_debug(PLUGIN_NAME, "[mp4_read_stco_atom] entries = %d,trak_num=%lu", entries, trak_num - 1);
+    trak->atoms[MP4_STCO_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STCO_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STCO_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STCO_ATOM].buffer, meta_reader, sizeof(mp4_stco_atom), 0);
 
-    trak->atoms[MP4_STCO_DATA].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_STCO_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STCO_DATA].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_STCO_DATA].buffer, meta_reader, esize, sizeof(mp4_stco_atom));
+    trak->atoms[MP4_STCO_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_STCO_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STCO_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_STCO_DATA].buffer, meta_reader, esize, sizeof(mp4_stco_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -1161,14 +1478,14 @@ Mp4Meta::mp4_read_co64_atom(int64_t atom_header_size, int64_t atom_data_size) {
 
     trak = trak_vec[trak_num - 1];
     trak->chunks = entries;
-//    TSDebug(PLUGIN_NAME, "[mp4_read_co64_atom] entries = %d,trak_num=%lu", entries, trak_num - 1);
-    trak->atoms[MP4_CO64_ATOM].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_CO64_ATOM].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_CO64_ATOM].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_CO64_ATOM].buffer, meta_reader, sizeof(mp4_co64_atom), 0);
+//    mp4_debug(PLUGIN_NAME, "[mp4_read_co64_atom] entries = %d,trak_num=%lu", entries, trak_num - 1);
+    trak->atoms[MP4_CO64_ATOM].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_CO64_ATOM].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_CO64_ATOM].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_CO64_ATOM].buffer, meta_reader, sizeof(mp4_co64_atom), 0);
 
-    trak->atoms[MP4_CO64_DATA].buffer = TSIOBufferCreate();
-    trak->atoms[MP4_CO64_DATA].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_CO64_DATA].buffer);
-    TSIOBufferCopy(trak->atoms[MP4_CO64_DATA].buffer, meta_reader, esize, sizeof(mp4_co64_atom));
+    trak->atoms[MP4_CO64_DATA].buffer = Mp4IOBufferCreate();
+    trak->atoms[MP4_CO64_DATA].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_CO64_DATA].buffer);
+    Mp4IOBufferCopy(trak->atoms[MP4_CO64_DATA].buffer, meta_reader, esize, sizeof(mp4_co64_atom));
 
     mp4_meta_consume(atom_data_size + atom_header_size);
 
@@ -1179,103 +1496,427 @@ Mp4Meta::mp4_read_co64_atom(int64_t atom_header_size, int64_t atom_data_size) {
  * 当读到mdat 的时候说明解析成功了
  */
 int Mp4Meta::mp4_read_mdat_atom(int64_t /* atom_header_size ATS_UNUSED */, int64_t /* atom_data_size ATS_UNUSED */) {
-    mdat_atom.buffer = TSIOBufferCreate();
-    mdat_atom.reader = TSIOBufferReaderAlloc(mdat_atom.buffer);
+    mdat_atom.buffer = Mp4IOBufferCreate();
+    mdat_atom.reader = Mp4IOBufferReaderAlloc(mdat_atom.buffer);
 
     meta_complete = true;
     return 1;
 }
 
+/**
+ * 为 trak 建立 sample 随机访问索引: stts 每个 run 的起始 sample 与累计解码时间,
+ * stsc 每个 run 的起始 sample, ctts 每个 run 的起始 sample, stss 全部关键帧, stsz/stz2 每 64 个 sample 的累计大小.
+ * 表只扫描一次, 之后的 时间->sample, sample->chunk, sample->字节 都是二分查找.
+ */
+int
+Mp4Meta::mp4_build_sample_index(Mp4Trak *trak) {
+    uint32_t i, j, k, n, fs, count, duration, chunk, samples, prev_chunk, prev_samples;
+    uint64_t bytes;
+    u_char buf[MP4_INDEX_READ_ENTRIES * sizeof(mp4_stsc_entry)];
+    Mp4IOBufferReader readerp;
+    Mp4SampleIndex *index;
+
+    index = &trak->index;
+
+    if (trak->atoms[MP4_STTS_DATA].buffer) {
+        n = trak->time_to_sample_entries;
+        if (mp4_meta_charge((int64_t) (n + 1) * (sizeof(uint32_t) + sizeof(uint64_t))) < 0) {
+            return -1;
+        }
+
+        index->stts_entries = n;
+        index->stts_sample = (uint32_t *) mp4_malloc((n + 1) * sizeof(uint32_t));
+        index->stts_time = (uint64_t *) mp4_malloc((n + 1) * sizeof(uint64_t));
+        index->stts_sample[0] = 0;
+        index->stts_time[0] = 0;
+
+        readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STTS_DATA].reader);
+
+        for (i = 0; i < n; i += k) {
+            k = n - i < MP4_INDEX_READ_ENTRIES ? n - i : MP4_INDEX_READ_ENTRIES;
+
+            if (mp4_meta_work(k) < 0) {
+                Mp4IOBufferReaderFree(readerp);
+                return -1;
+            }
+
+            IOBufferReaderCopy(readerp, buf, k * sizeof(mp4_stts_entry));
+            Mp4IOBufferReaderConsume(readerp, k * sizeof(mp4_stts_entry));
+
+            for (j = 0; j < k; j++) {
+                count = mp4_get_32value(buf + j * sizeof(mp4_stts_entry) + offsetof(mp4_stts_entry, count));
+                duration = mp4_get_32value(buf + j * sizeof(mp4_stts_entry) + offsetof(mp4_stts_entry, duration));
+                index->stts_sample[i + j + 1] = index->stts_sample[i + j] + count;
+                index->stts_time[i + j + 1] = index->stts_time[i + j] + (uint64_t) count * duration;
+            }
+        }
+
+        Mp4IOBufferReaderFree(readerp);
+    }
+
+    if (trak->atoms[MP4_STSC_DATA].buffer) {
+        n = trak->sample_to_chunk_entries;
+        if (mp4_meta_charge((int64_t) (n + 1) * sizeof(uint32_t)) < 0) {
+            return -1;
+        }
+
+        index->stsc_entries = n;
+        index->stsc_sample = (uint32_t *) mp4_malloc((n + 1) * sizeof(uint32_t));
+        index->stsc_sample[0] = 0;
+
+        readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
+        prev_chunk = 1;
+        prev_samples = 0;
+
+        for (i = 0; i < n; i += k) {
+            k = n - i < MP4_INDEX_READ_ENTRIES ? n - i : MP4_INDEX_READ_ENTRIES;
+
+            if (mp4_meta_work(k) < 0) {
+                Mp4IOBufferReaderFree(readerp);
+                return -1;
+            }
+
+            IOBufferReaderCopy(readerp, buf, k * sizeof(mp4_stsc_entry));
+            Mp4IOBufferReaderConsume(readerp, k * sizeof(mp4_stsc_entry));
+
+            for (j = 0; j < k; j++) {
+                chunk = mp4_get_32value(buf + j * sizeof(mp4_stsc_entry) + offsetof(mp4_stsc_entry, chunk));
+                samples = mp4_get_32value(buf + j * sizeof(mp4_stsc_entry) + offsetof(mp4_stsc_entry, samples));
+
+                if (chunk < prev_chunk) {
+                    mp4_debug(PLUGIN_NAME, "[mp4_build_sample_index] stsc chunks are not ascending");
+                    Mp4IOBufferReaderFree(readerp);
+                    return -1;
+                }
+
+                if (i + j > 0) {
+                    index->stsc_sample[i + j] = index->stsc_sample[i + j - 1] + (chunk - prev_chunk) * prev_samples;
+                }
+
+                prev_chunk = chunk;
+                prev_samples = samples;
+            }
+        }
+
+        Mp4IOBufferReaderFree(readerp);
+
+        // 最后一个 run 一直延续到最后一个 chunk
+        if (n > 0) {
+            if (trak->chunks + 1 < prev_chunk) {
+                mp4_debug(PLUGIN_NAME, "[mp4_build_sample_index] stsc chunk is out of mp4 stco chunks");
+                return -1;
+            }
+
+            index->stsc_sample[n] = index->stsc_sample[n - 1] + (trak->chunks + 1 - prev_chunk) * prev_samples;
+        }
+    }
+
+    if (trak->atoms[MP4_CTTS_DATA].buffer) {
+        n = trak->composition_offset_entries;
+        if (mp4_meta_charge((int64_t) (n + 1) * sizeof(uint32_t)) < 0) {
+            return -1;
+        }
+
+        index->ctts_entries = n;
+        index->ctts_sample = (uint32_t *) mp4_malloc((n + 1) * sizeof(uint32_t));
+        index->ctts_sample[0] = 0;
+
+        readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_CTTS_DATA].reader);
+
+        for (i = 0; i < n; i += k) {
+            k = n - i < MP4_INDEX_READ_ENTRIES ? n - i : MP4_INDEX_READ_ENTRIES;
+
+            if (mp4_meta_work(k) < 0) {
+                Mp4IOBufferReaderFree(readerp);
+                return -1;
+            }
+
+            IOBufferReaderCopy(readerp, buf, k * sizeof(mp4_ctts_entry));
+            Mp4IOBufferReaderConsume(readerp, k * sizeof(mp4_ctts_entry));
+
+            for (j = 0; j < k; j++) {
+                count = mp4_get_32value(buf + j * sizeof(mp4_ctts_entry) + offsetof(mp4_ctts_entry, count));
+                index->ctts_sample[i + j + 1] = index->ctts_sample[i + j] + count;
+            }
+        }
+
+        Mp4IOBufferReaderFree(readerp);
+    }
+
+    if (trak->atoms[MP4_STSS_DATA].buffer) {
+        n = trak->sync_samples_entries;
+        if (mp4_meta_charge((int64_t) (n + 1) * sizeof(uint32_t)) < 0) {
+            return -1;
+        }
+
+        index->stss_entries = n;
+        index->stss_sample = (uint32_t *) mp4_malloc((n + 1) * sizeof(uint32_t));
+        index->stss_sample[0] = 0;
+
+        readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSS_DATA].reader);
+
+        for (i = 0; i < n; i += k) {
+            k = n - i < MP4_INDEX_READ_ENTRIES ? n - i : MP4_INDEX_READ_ENTRIES;
+
+            if (mp4_meta_work(k) < 0) {
+                Mp4IOBufferReaderFree(readerp);
+                return -1;
+            }
+
+            IOBufferReaderCopy(readerp, buf, k * sizeof(uint32_t));
+            Mp4IOBufferReaderConsume(readerp, k * sizeof(uint32_t));
+
+            for (j = 0; j < k; j++) {
+                index->stss_sample[i + j + 1] = mp4_get_32value(buf + j * sizeof(uint32_t));
+
+                if (index->stss_sample[i + j + 1] <= index->stss_sample[i + j]) {
+                    mp4_debug(PLUGIN_NAME, "[mp4_build_sample_index] stss samples are not ascending");
+                    Mp4IOBufferReaderFree(readerp);
+                    return -1;
+                }
+            }
+        }
+
+        Mp4IOBufferReaderFree(readerp);
+    }
+
+    if (trak->atoms[MP4_STSZ_DATA].buffer) {
+        n = trak->sample_sizes_entries;
+        fs = trak->sample_field_size;
+        if (mp4_meta_charge((int64_t) ((n >> MP4_STSZ_INDEX_SHIFT) + 1) * sizeof(uint64_t)) < 0) {
+            return -1;
+        }
+
+        index->stsz_entries = n;
+        index->stsz_bytes = (uint64_t *) mp4_malloc(((n >> MP4_STSZ_INDEX_SHIFT) + 1) * sizeof(uint64_t));
+        index->stsz_bytes[0] = 0;
+
+        readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSZ_DATA].reader);
+        bytes = 0;
+
+        for (i = 0; i < n; i += k) {
+            k = n - i < MP4_INDEX_READ_ENTRIES ? n - i : MP4_INDEX_READ_ENTRIES;
+
+            if (mp4_meta_work(k) < 0) {
+                Mp4IOBufferReaderFree(readerp);
+                return -1;
+            }
+
+            // i 是 MP4_INDEX_READ_ENTRIES 的整数倍, 4 位 entry 也从字节边界开始
+            IOBufferReaderCopy(readerp, buf, ((int64_t) k * fs + 7) / 8);
+            Mp4IOBufferReaderConsume(readerp, ((int64_t) k * fs + 7) / 8);
+
+            for (j = 0; j < k; j++) {
+                bytes += mp4_get_sample_size(buf, fs, j);
+
+                if (((i + j + 1) & ((1 << MP4_STSZ_INDEX_SHIFT) - 1)) == 0) {
+                    index->stsz_bytes[(i + j + 1) >> MP4_STSZ_INDEX_SHIFT] = bytes;
+                }
+            }
+        }
+
+        Mp4IOBufferReaderFree(readerp);
+    }
+
+    return 0;
+}
+
+/**
+ * 前 sample 个 sample 的总字节数. 大小相同时直接相乘; 否则先查 stsz 块前缀和, 块内最多再读 63 个 size
+ */
+uint64_t
+Mp4Meta::mp4_sample_bytes(Mp4Trak *trak, uint32_t sample) {
+    uint32_t i, block, n, fs;
+    uint64_t bytes;
+    u_char buf[sizeof(uint32_t) << MP4_STSZ_INDEX_SHIFT];
+    Mp4IOBufferReader readerp;
+    Mp4SampleIndex *index;
+
+    index = &trak->index;
+
+    if (trak->sample_size) {
+        if (sample > trak->sample_sizes_entries) {
+            sample = trak->sample_sizes_entries;
+        }
+
+        return (uint64_t) sample * trak->sample_size;
+    }
+
+    if (index->stsz_bytes == nullptr) {
+        return 0;
+    }
+
+    if (sample > index->stsz_entries) {
+        sample = index->stsz_entries;
+    }
+
+    block = sample >> MP4_STSZ_INDEX_SHIFT;
+    bytes = index->stsz_bytes[block];
+    n = sample - (block << MP4_STSZ_INDEX_SHIFT);
+
+    if (n == 0) {
+        return bytes;
+    }
+
+    fs = trak->sample_field_size;
+
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSZ_DATA].reader);
+    Mp4IOBufferReaderConsume(readerp, ((int64_t) block << MP4_STSZ_INDEX_SHIFT) * fs / 8);
+    IOBufferReaderCopy(readerp, buf, ((int64_t) n * fs + 7) / 8);
+    Mp4IOBufferReaderFree(readerp);
+
+    for (i = 0; i < n; i++) {
+        bytes += mp4_get_sample_size(buf, fs, i);
+    }
+
+    return bytes;
+}
+
+/**
+ * 第 sample 个 sample(从 0 开始) 的解码时间, 单位为 trak 的 timescale
+ */
+uint64_t
+Mp4Meta::mp4_sample_time(Mp4Trak *trak, uint32_t sample) {
+    uint32_t entry, count;
+    Mp4SampleIndex *index;
+
+    index = &trak->index;
+
+    if (index->stts_sample == nullptr) {
+        return 0;
+    }
+
+    entry = mp4_index_search32(index->stts_sample, index->stts_entries, sample);
+
+    if (entry >= index->stts_entries) {
+        return index->stts_time[index->stts_entries];
+    }
+
+    count = index->stts_sample[entry + 1] - index->stts_sample[entry];
+
+    return index->stts_time[entry] +
+           (index->stts_time[entry + 1] - index->stts_time[entry]) / count * (sample - index->stts_sample[entry]);
+}
+
+/**
+ * 解码时间 time(trak 的 timescale) 所在的 sample(从 0 开始), 超出时返回 sample 总数
+ */
+uint32_t
+Mp4Meta::mp4_time_sample(Mp4Trak *trak, uint64_t time) {
+    uint32_t entry, count;
+    uint64_t duration;
+    Mp4SampleIndex *index;
+
+    index = &trak->index;
+
+    if (index->stts_sample == nullptr) {
+        return 0;
+    }
+
+    entry = mp4_index_search64(index->stts_time, index->stts_entries, time);
+
+    if (entry >= index->stts_entries) {
+        return index->stts_sample[index->stts_entries];
+    }
+
+    count = index->stts_sample[entry + 1] - index->stts_sample[entry];
+    duration = (index->stts_time[entry + 1] - index->stts_time[entry]) / count;
+
+    return index->stts_sample[entry] + (duration ? (uint32_t) ((time - index->stts_time[entry]) / duration) : 0);
+}
+
 int
 Mp4Meta::mp4_crop_stts_data(Mp4Trak *trak, uint start) {
 
     uint32_t count, duration, rest;
     uint64_t start_time;
-    TSIOBufferReader readerp;
-    uint32_t start_sample, entries, start_sec;
-    uint32_t entry, end;
+    Mp4IOBufferReader readerp;
+    uint32_t start_sample;
+    uint32_t entry;
+    Mp4SampleIndex *index;
+
+    index = &trak->index;
 
     if (start) {
-        start_sec = this->start;
+        if (this->rs_set) {
+            // 已经有 trak 对齐到了关键帧, 从同一时间点开始
+            start_time = (uint64_t) (this->rs * trak->timescale / 1000);
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data] mp4 stts crop start_time:%ui", start_sec);
+        } else {
+            start_time = (uint64_t) this->start * trak->timescale / 1000;
+        }
 
     } else if (this->length) {
-        start_sec = this->length;
-
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data] mp4 stts crop end_time:%ui", start_sec);
+        // 结束时间按请求的绝对时间计算, 不随起点对齐到关键帧而提前
+        start_time = (uint64_t) (this->start + this->length) * trak->timescale / 1000;
 
     } else {
         return 0;
     }
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STTS_DATA].reader);
-    start_time = (uint64_t) start_sec * trak->timescale / 1000;
+    entry = mp4_index_search64(index->stts_time, index->stts_entries, start_time);
 
-    entries = trak->time_to_sample_entries;
-//    TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data] entries:%ui", entries);
+    if (entry >= index->stts_entries) {
+        if (start) {
+            mp4_debug(PLUGIN_NAME, "[mp4_crop_stts_data_start] start time is out mp4 stts samples");
 
-    start_sample = 0;
+            return -1;
 
-    entry = trak->stts_pos;
-    end = trak->stts_last;
+        } else {
+            trak->end_sample = index->stts_sample[index->stts_entries];
 
-    TSIOBufferReaderConsume(readerp, entry * sizeof(mp4_stts_entry));
+//            mp4_debug(PLUGIN_NAME, "[mp4_crop_stts_data_start] end_sample:%ui", trak->end_sample);
 
-    while (entry < end) {//根据时间查找
-        duration = (uint32_t) mp4_reader_get_32value(readerp, offsetof(mp4_stts_entry, duration));
-        count = (uint32_t) mp4_reader_get_32value(readerp, offsetof(mp4_stts_entry, count));
-        //mp4_update_stts_atom duration = 3200, count = 16392
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data_start] time:%uL, count:%uD, duration:%uD",
-//                start_time, count, duration);
-        if (start_time < (uint64_t) count * duration) {
-            start_sample += (uint32_t) (start_time / duration);
-            rest = (uint32_t) (start_time / duration);
-            goto found;
+            return 0;
         }
-
-        start_sample += count;//计算已经丢弃了多少个sample
-        start_time -= (uint64_t) count * duration; //还剩多少时间
-        entries--;
-        entry++;
-        TSIOBufferReaderConsume(readerp, sizeof(mp4_stts_entry)); //丢弃
     }
 
-    TSIOBufferReaderFree(readerp);
-    if (start) {
-        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data_start] start time is out mp4 stts samples");
-
-        return -1;
+    count = index->stts_sample[entry + 1] - index->stts_sample[entry];
+    duration = (uint32_t) ((index->stts_time[entry + 1] - index->stts_time[entry]) / count);
+    start_sample = index->stts_sample[entry] + (uint32_t) ((start_time - index->stts_time[entry]) / duration);
 
-    } else {
-        trak->end_sample = trak->start_sample + start_sample;
+    if (start) {
+        trak->req_sample = this->rs_set ? mp4_time_sample(trak, (uint64_t) this->start * trak->timescale / 1000)
+                                        : start_sample;
+    }
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data_start] end_sample:%ui", trak->end_sample);
+    if (start && index->stss_entries > 0) {
+        // 起点退到前一个关键帧, 否则开头的帧没有参考帧无法解码
+        start_sample = mp4_find_key_sample(start_sample + 1, trak) - 1;
+        entry = mp4_index_search32(index->stts_sample, index->stts_entries, start_sample);
+        count = index->stts_sample[entry + 1] - index->stts_sample[entry];
 
-        return 0;
+        if (!this->rs_set) {
+            this->rs = (double) mp4_sample_time(trak, start_sample) * 1000 / trak->timescale;
+            this->rs_set = true;
+        }
     }
 
-    found:
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STTS_DATA].reader);
+    Mp4IOBufferReaderConsume(readerp, entry * sizeof(mp4_stts_entry));
 
     if (start) {
+        rest = start_sample - index->stts_sample[entry];
         mp4_reader_set_32value(readerp, offsetof(mp4_stts_entry, count), count - rest);
         trak->stts_pos = entry;
-        trak->time_to_sample_entries = entries;
+        trak->time_to_sample_entries = index->stts_entries - entry;
         trak->start_sample = start_sample;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data_start] start_sample:%ui, new count:%uD",
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stts_data_start] start_sample:%ui, new count:%uD",
 //                trak->start_sample, count - rest);
 
     } else {
+        // 第一个 run 的 count 在裁剪 start 时已经减掉了 rest
+        rest = start_sample - (entry == trak->stts_pos ? trak->start_sample : index->stts_sample[entry]);
         mp4_reader_set_32value(readerp, offsetof(mp4_stts_entry, count), rest);
         trak->stts_last = entry + 1;
-        trak->time_to_sample_entries -= entries - 1;
-        trak->end_sample = trak->start_sample + start_sample;
+        trak->time_to_sample_entries = trak->stts_last - trak->stts_pos;
+        trak->end_sample = start_sample;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stts_data_start] end_sample:%ui, new count:%uD",
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stts_data_start] end_sample:%ui, new count:%uD",
 //                trak->end_sample, rest);
     }
-    TSIOBufferReaderFree(readerp);
+    Mp4IOBufferReaderFree(readerp);
     return 0;
 }
 
@@ -1291,7 +1932,6 @@ int
 Mp4Meta::mp4_update_stts_atom(Mp4Trak *trak) {
 
     size_t atom_size;
-    int64_t avail, copy_avail, new_avail;
 
     /*
      * mdia.minf.stbl.stts updating requires trak->timescale
@@ -1299,7 +1939,7 @@ Mp4Meta::mp4_update_stts_atom(Mp4Trak *trak) {
      */
 
     if (trak->atoms[MP4_STTS_DATA].buffer == nullptr) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_stts_atom] no mp4 stts atoms were found");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_stts_atom] no mp4 stts atoms were found");
         return -1;
     }
 
@@ -1315,88 +1955,59 @@ Mp4Meta::mp4_update_stts_atom(Mp4Trak *trak) {
 
     trak->size += atom_size;
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_STTS_DATA].reader, trak->stts_pos * sizeof(mp4_stts_entry));
-
-    new_avail = (trak->stts_last - trak->stts_pos) * sizeof(mp4_stts_entry);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
-    }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_STTS_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_STTS_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_STTS_DATA].reader, avail);
-
-    TSIOBufferCopy(trak->atoms[MP4_STTS_DATA].buffer, copy_reader, new_avail, 0);
-
-
     mp4_reader_set_32value(trak->atoms[MP4_STTS_ATOM].reader, offsetof(mp4_stts_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_STTS_ATOM].reader, offsetof(mp4_stts_atom, entries),
                            trak->time_to_sample_entries);
 
+    MP4_PROBE4(update_stts, txn_id, trak, trak->time_to_sample_entries, atom_size);
+
     return 0;
 }
 
 
 int
 Mp4Meta::mp4_crop_stss_data(Mp4Trak *trak, uint start) {
-    uint32_t sample, start_sample, entry, end;
-    uint32_t entries;
-    TSIOBufferReader readerp;
+    uint32_t start_sample, entry;
 
     /* sync samples starts from 1 */
 
     if (start) {
         start_sample = trak->start_sample + 1;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stss_data] mp4 stss crop start_sample:%uD", start_sample);
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stss_data] mp4 stss crop start_sample:%uD", start_sample);
 
     } else if (this->length) {
         start_sample = trak->end_sample + 1;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stss_data] mp4 stss crop end_sample:%uD", start_sample);
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stss_data] mp4 stss crop end_sample:%uD", start_sample);
 
     } else {
         return 0;
     }
 
-    entries = trak->sync_samples_entries;
-    entry = trak->stss_pos;
-    end = trak->stss_last;
+    // 第一个 >= start_sample 的关键帧
+    entry = mp4_index_search32(trak->index.stss_sample, trak->index.stss_entries, start_sample - 1);
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSS_DATA].reader);
-
-    TSIOBufferReaderConsume(readerp, entry * sizeof(uint32_t));
-
-    while (entry < end) {
-        sample = (uint32_t) mp4_reader_get_32value(readerp, 0);
-
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stss_data] sync:%uD", sample);
-
-        if (sample >= start_sample) {
-            goto found;
-        }
-
-        entries--;
-        entry++;
-        TSIOBufferReaderConsume(readerp, sizeof(uint32_t));
+    if (entry < trak->stss_pos) {
+        entry = trak->stss_pos;
     }
 
-    TSDebug(PLUGIN_NAME, "[mp4_crop_stss_data] sample is out of mp4 stss atom");
+    if (entry > trak->stss_last) {
+        entry = trak->stss_last;
+    }
 
-    found:
+    if (entry == trak->index.stss_entries) {
+        mp4_debug(PLUGIN_NAME, "[mp4_crop_stss_data] sample is out of mp4 stss atom");
+    }
 
     if (start) {
         trak->stss_pos = entry;
-        trak->sync_samples_entries = entries;
 
     } else {
         trak->stss_last = entry;
-        trak->sync_samples_entries -= entries;
     }
-    TSIOBufferReaderFree(readerp);
+
+    trak->sync_samples_entries = trak->stss_last - trak->stss_pos;
     return 0;
 }
 
@@ -1409,9 +2020,6 @@ Mp4Meta::mp4_crop_stss_data(Mp4Trak *trak, uint start) {
 int
 Mp4Meta::mp4_update_stss_atom(Mp4Trak *trak) {
     size_t atom_size;
-    uint32_t sample, start_sample, entry, end;
-    TSIOBufferReader readerp;
-    int64_t avail, copy_avail, new_avail;
 
     /*
      * mdia.minf.stbl.stss updating requires trak->start_sample
@@ -1428,61 +2036,26 @@ Mp4Meta::mp4_update_stss_atom(Mp4Trak *trak) {
     mp4_crop_stss_data(trak, 1);
     mp4_crop_stss_data(trak, 0);
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSS_DATA].reader);
-
-    if (trak->sync_samples_entries) {
-        entry = trak->stss_pos;
-        end = trak->stss_last;
-        TSIOBufferReaderConsume(readerp, entry * sizeof(uint32_t));
-
-        start_sample = trak->start_sample;
-
-        while (entry < end) {
-            sample = (uint32_t) mp4_reader_get_32value(readerp, 0);
-//            TSDebug(PLUGIN_NAME, "[mp4_update_stss_atom] xxx sample:%uD", sample);
-            sample -= start_sample;
-            mp4_reader_set_32value(readerp, 0, sample);
-            TSIOBufferReaderConsume(readerp, sizeof(uint32_t));
-            entry++;
-        }
-
-    } else {
-        TSIOBufferReaderFree(trak->atoms[MP4_STSS_DATA].reader);
-        TSIOBufferDestroy(trak->atoms[MP4_STSS_DATA].buffer);
+    // sample 序号在输出时由 mp4_write_table 减去 start_sample
+    if (trak->sync_samples_entries == 0) {
+        Mp4IOBufferReaderFree(trak->atoms[MP4_STSS_DATA].reader);
+        Mp4IOBufferDestroy(trak->atoms[MP4_STSS_DATA].buffer);
 
         trak->atoms[MP4_STSS_DATA].reader = nullptr;
         trak->atoms[MP4_STSS_DATA].buffer = nullptr;
     }
-    TSIOBufferReaderFree(readerp);
 
     atom_size = sizeof(mp4_stss_atom) + (trak->stss_last - trak->stss_pos) * sizeof(uint32_t);
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stss_atom] sizeof(mp4_stss_atom) =%lu,atom_size=%llu",sizeof(mp4_stss_atom), atom_size);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_stss_atom] sizeof(mp4_stss_atom) =%lu,atom_size=%llu",sizeof(mp4_stss_atom), atom_size);
 
     trak->size += atom_size;
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_STSS_DATA].reader, trak->stss_pos * sizeof(uint32_t));
-
-
-    new_avail = (trak->stss_last - trak->stss_pos) * sizeof(uint32_t);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
-    }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_STSS_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stss_atom] avail=%lld, new_avail=%lld", avail, new_avail);
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_STSS_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_STSS_DATA].reader, avail);
-
-    TSIOBufferCopy(trak->atoms[MP4_STSS_DATA].buffer, copy_reader, new_avail, 0);
-
-
     mp4_reader_set_32value(trak->atoms[MP4_STSS_ATOM].reader, offsetof(mp4_stss_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_STSS_ATOM].reader, offsetof(mp4_stss_atom, entries),
                            trak->sync_samples_entries);
 
+    MP4_PROBE4(update_stss, txn_id, trak, trak->sync_samples_entries, atom_size);
 
     return 0;
 }
@@ -1491,73 +2064,61 @@ Mp4Meta::mp4_update_stss_atom(Mp4Trak *trak) {
 int
 Mp4Meta::mp4_crop_ctts_data(Mp4Trak *trak, uint start) {
     uint32_t count, start_sample, rest;
-    uint32_t entries;
-    uint32_t entry, end;
-    TSIOBufferReader readerp;
+    uint32_t entry;
+    Mp4IOBufferReader readerp;
+    Mp4SampleIndex *index;
 
     /* sync samples starts from 1 */
 
     if (start) {
-        start_sample = trak->start_sample + 1;
+        start_sample = trak->start_sample;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_ctts_data] mp4 ctts crop start_sample:%uD", start_sample);
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_ctts_data] mp4 ctts crop start_sample:%uD", start_sample);
 
     } else if (this->length) {
-        start_sample = trak->end_sample - trak->start_sample + 1;
+        start_sample = trak->end_sample;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_ctts_data] mp4 ctts crop end_sample:%uD", start_sample);
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_ctts_data] mp4 ctts crop end_sample:%uD", start_sample);
 
     } else {
         return 0;
     }
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_CTTS_DATA].reader);
+    index = &trak->index;
+    entry = mp4_index_search32(index->ctts_sample, index->ctts_entries, start_sample);
 
-    entries = trak->composition_offset_entries;
-    entry = trak->ctts_pos;
-    end = trak->ctts_last;
-
-    TSIOBufferReaderConsume(readerp, entry * sizeof(mp4_ctts_entry));
-
-    while (entry < end) {
-        count = (uint32_t) mp4_reader_get_32value(readerp, offsetof(mp4_ctts_entry, count));
-
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_ctts_data] sample:%uD, count:%uD, offset:%uD",
-//                start_sample, count, mp4_reader_get_32value(readerp, offsetof(mp4_ctts_entry, offset)));
-
-        if (start_sample <= count) {
-            rest = start_sample - 1;
-            goto found;
+    if (entry >= index->ctts_entries) {
+        if (start) {
+            trak->ctts_pos = trak->ctts_last;
+            trak->composition_offset_entries = 0;
         }
 
-        start_sample -= count;
-        entries--;
-        entry++;
-        TSIOBufferReaderConsume(readerp, sizeof(mp4_ctts_entry));
+        return 0;
     }
 
-    if (start) {
-        trak->ctts_pos = end;
-        trak->composition_offset_entries = 0;
-    }
+    count = index->ctts_sample[entry + 1] - index->ctts_sample[entry];
 
-    TSIOBufferReaderFree(readerp);
-    return 0;
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_CTTS_DATA].reader);
+    Mp4IOBufferReaderConsume(readerp, entry * sizeof(mp4_ctts_entry));
 
-    found:
+//    mp4_debug(PLUGIN_NAME, "[mp4_crop_ctts_data] sample:%uD, count:%uD, offset:%uD",
+//            start_sample, count, mp4_reader_get_32value(readerp, offsetof(mp4_ctts_entry, offset)));
 
     if (start) {
+        rest = start_sample - index->ctts_sample[entry];
         mp4_reader_set_32value(readerp, offsetof(mp4_ctts_entry, count), count - rest);
         trak->ctts_pos = entry;
-        trak->composition_offset_entries = entries;
+        trak->composition_offset_entries = index->ctts_entries - entry;
 
     } else {
+        // 第一个 run 的 count 在裁剪 start 时已经减掉了 rest
+        rest = start_sample - (entry == trak->ctts_pos ? trak->start_sample : index->ctts_sample[entry]);
         mp4_reader_set_32value(readerp, offsetof(mp4_ctts_entry, count), rest);
         trak->ctts_last = (entry + 1);
-        trak->composition_offset_entries -= entries - 1;
+        trak->composition_offset_entries = trak->ctts_last - trak->ctts_pos;
     }
 
-    TSIOBufferReaderFree(readerp);
+    Mp4IOBufferReaderFree(readerp);
     return 0;
 }
 
@@ -1565,7 +2126,6 @@ int
 Mp4Meta::mp4_update_ctts_atom(Mp4Trak *trak) {
 
     size_t atom_size;
-    int64_t avail, copy_avail, new_avail;
 
     /*
      * mdia.minf.stbl.ctts updating requires trak->start_sample
@@ -1584,15 +2144,15 @@ Mp4Meta::mp4_update_ctts_atom(Mp4Trak *trak) {
 
     if (trak->composition_offset_entries == 0) {
         if (trak->atoms[MP4_CTTS_ATOM].reader) {
-            TSIOBufferReaderFree(trak->atoms[MP4_CTTS_ATOM].reader);
-            TSIOBufferDestroy(trak->atoms[MP4_CTTS_ATOM].buffer);
+            Mp4IOBufferReaderFree(trak->atoms[MP4_CTTS_ATOM].reader);
+            Mp4IOBufferDestroy(trak->atoms[MP4_CTTS_ATOM].buffer);
 
             trak->atoms[MP4_CTTS_ATOM].buffer = nullptr;
             trak->atoms[MP4_CTTS_ATOM].reader = nullptr;
         }
 
-        TSIOBufferReaderFree(trak->atoms[MP4_CTTS_DATA].reader);
-        TSIOBufferDestroy(trak->atoms[MP4_CTTS_DATA].buffer);
+        Mp4IOBufferReaderFree(trak->atoms[MP4_CTTS_DATA].reader);
+        Mp4IOBufferDestroy(trak->atoms[MP4_CTTS_DATA].buffer);
 
         trak->atoms[MP4_CTTS_DATA].reader = nullptr;
         trak->atoms[MP4_CTTS_DATA].buffer = nullptr;
@@ -1601,31 +2161,15 @@ Mp4Meta::mp4_update_ctts_atom(Mp4Trak *trak) {
 
     atom_size = sizeof(mp4_ctts_atom) + (trak->ctts_last - trak->ctts_pos) * sizeof(mp4_ctts_entry);
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_ctts_atom] sizeof(mp4_ctts_atom) =%lu,atom_size=%llu",sizeof(mp4_ctts_atom), atom_size);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_ctts_atom] sizeof(mp4_ctts_atom) =%lu,atom_size=%llu",sizeof(mp4_ctts_atom), atom_size);
 
     trak->size += atom_size;
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_CTTS_DATA].reader, trak->ctts_pos * sizeof(mp4_ctts_entry));
-
-    new_avail = (trak->ctts_last - trak->ctts_pos) * sizeof(mp4_ctts_entry);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
-    }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_CTTS_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_ctts_atom] avail=%lld, new_avail=%lld", avail, new_avail);
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_CTTS_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_CTTS_DATA].reader, avail);
-
-    TSIOBufferCopy(trak->atoms[MP4_CTTS_DATA].buffer, copy_reader, new_avail, 0);
-
-
     mp4_reader_set_32value(trak->atoms[MP4_CTTS_ATOM].reader, offsetof(mp4_ctts_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_CTTS_ATOM].reader, offsetof(mp4_ctts_atom, entries),
                            trak->composition_offset_entries);
 
+    MP4_PROBE4(update_ctts, txn_id, trak, trak->composition_offset_entries, atom_size);
 
     return 0;
 }
@@ -1637,15 +2181,16 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
     uint32_t start_sample, chunk, samples, id, next_chunk, n,
             prev_samples;
     uint32_t entries, target_chunk, chunk_samples;
-    uint32_t entry, end;
+    uint32_t entry, end, target;
     mp4_stsc_entry *first;
-    TSIOBufferReader readerp;
+    Mp4IOBufferReader readerp;
+    Mp4SampleIndex *index;
 
     entries = trak->sample_to_chunk_entries - 1;
     if (start) {
         start_sample = (uint32_t) trak->start_sample;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] mp4 stsc crop start_sample:%uD", start_sample);
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] mp4 stsc crop start_sample:%uD", start_sample);
 
     } else if (this->length) {
         start_sample = (uint32_t) (trak->end_sample - trak->start_sample);
@@ -1653,12 +2198,12 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
 
 
         if (trak->atoms[MP4_STSC_CHUNK_START].buffer != nullptr && entries > 0) {
-            readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSC_CHUNK_START].reader);
+            readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSC_CHUNK_START].reader);
 
-//            TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] trak->stsc_pos:%uD, avail=%lld", trak->stsc_pos, TSIOBufferReaderAvail(readerp));
+//            mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] trak->stsc_pos:%uD, avail=%lld", trak->stsc_pos, Mp4IOBufferReaderAvail(readerp));
             samples = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, samples));
             entries--;
-//            TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] samples:%uD, entries:%uD", samples, entries);
+//            mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] samples:%uD, entries:%uD", samples, entries);
 
             if (samples > start_sample) {
                 samples = start_sample;
@@ -1666,10 +2211,10 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
             }
 
             start_sample -= samples;
-            TSIOBufferReaderFree(readerp);
+            Mp4IOBufferReaderFree(readerp);
         }
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] mp4 stsc crop end_sample:%uD, ext_samples:%uD",
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] mp4 stsc crop end_sample:%uD, ext_samples:%uD",
 //                start_sample, samples);
 
     } else {
@@ -1678,24 +2223,42 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
 
     entry = trak->stsc_pos;
     end = trak->stsc_last;
+    prev_samples = 0;
+
+    // 通过索引直接跳到目标 sample 所在的 run, 不再从第一个 entry 开始累加
+    index = &trak->index;
+    target = mp4_index_search32(index->stsc_sample, index->stsc_entries, start ? trak->start_sample : trak->end_sample);
+    if (target >= index->stsc_entries) {
+        target = index->stsc_entries - 1;
+    }
+
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
+    if (target > entry) {
+        Mp4IOBufferReaderConsume(readerp, (target - 1) * sizeof(mp4_stsc_entry));
+        prev_samples = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, samples));
+        Mp4IOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry));
 
-    TSIOBufferReaderConsume(readerp, entry * sizeof(mp4_stsc_entry));
+        start_sample = (start ? trak->start_sample : trak->end_sample) - index->stsc_sample[target];
+        entries = index->stsc_entries - 1 - target;
+        entry = target;
+
+    } else {
+        Mp4IOBufferReaderConsume(readerp, entry * sizeof(mp4_stsc_entry));
+    }
 
     chunk = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, chunk));
     samples = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, samples));
     id = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, id));
-    TSIOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry));
+    Mp4IOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry));
 
-    prev_samples = 0;
     entry++;
 
     while (entry < end) {
 
         next_chunk = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, chunk));
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] sample:%uD, chunk:%uD, chunks:%uD, "
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] sample:%uD, chunk:%uD, chunks:%uD, "
 //                        "samples:%uD, id:%uD",
 //                start_sample, chunk, next_chunk - chunk, samples, id);
 
@@ -1713,46 +2276,46 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
         id = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, id));
         entries--;
         entry++;
-        TSIOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry));
+        Mp4IOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry));
     }
 
     next_chunk = trak->chunks + 1;
 
-//    TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] sample:%uD, chunk:%uD, chunks:%uD, samples:%uD",
+//    mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] sample:%uD, chunk:%uD, chunks:%uD, samples:%uD",
 //            start_sample, chunk, next_chunk - chunk, samples);
 
     n = (next_chunk - chunk) * samples;
 
     if (start_sample > n) {
-        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] %s time is out mp4 stsc chunks",
+        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] %s time is out mp4 stsc chunks",
                 start ? "start" : "end");
-        TSIOBufferReaderFree(readerp);
+        Mp4IOBufferReaderFree(readerp);
         return -1;
     }
 
     found:
-    TSIOBufferReaderFree(readerp);
+    Mp4IOBufferReaderFree(readerp);
     entries++;
     entry--;
 
     if (samples == 0) {
-        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] zero number of samples");
+        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] zero number of samples");
         return -1;
     }
 
-//    TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] entries:%ui, prev_samples:%ui",
+//    mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] entries:%ui, prev_samples:%ui",
 //            entries, prev_samples);
 
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
 
-    TSIOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry) * entry);
+    Mp4IOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry) * entry);
 
     target_chunk = chunk - 1;
     target_chunk += start_sample / samples;
     chunk_samples = start_sample % samples;
 
-//    TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] target_chunk:%ui, chunk_samples:%ui",
+//    mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] target_chunk:%ui, chunk_samples:%ui",
 //            target_chunk, chunk_samples);
 
     if (start) {
@@ -1766,7 +2329,7 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
 
         samples -= chunk_samples;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] start_chunk:%ui, start_chunk_samples:%ui",
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] start_chunk:%ui, start_chunk_samples:%ui",
 //                trak->start_chunk, trak->start_chunk_samples);
 
     } else {
@@ -1792,7 +2355,7 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
         samples = chunk_samples;
         next_chunk = chunk + 1;
 
-//        TSDebug(PLUGIN_NAME, "[mp4_crop_stsc_data] end_chunk:%ui, end_chunk_samples:%ui",
+//        mp4_debug(PLUGIN_NAME, "[mp4_crop_stsc_data] end_chunk:%ui, end_chunk_samples:%ui",
 //                trak->end_chunk, trak->end_chunk_samples);
     }
 
@@ -1807,9 +2370,9 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
         mp4_set_32value(first->samples, samples);
         mp4_set_32value(first->id, id);
 
-        trak->atoms[MP4_STSC_CHUNK_START].buffer = TSIOBufferSizedCreate(TS_IOBUFFER_SIZE_INDEX_128);
-        trak->atoms[MP4_STSC_CHUNK_START].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSC_CHUNK_START].buffer);
-        TSIOBufferWrite(trak->atoms[MP4_STSC_CHUNK_START].buffer, first, sizeof(mp4_stsc_entry));
+        trak->atoms[MP4_STSC_CHUNK_START].buffer = Mp4IOBufferSizedCreate(MP4_IOBUFFER_SIZE_INDEX_128);
+        trak->atoms[MP4_STSC_CHUNK_START].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSC_CHUNK_START].buffer);
+        Mp4IOBufferWrite(trak->atoms[MP4_STSC_CHUNK_START].buffer, first, sizeof(mp4_stsc_entry));
 
         mp4_reader_set_32value(readerp, offsetof(mp4_stsc_entry, chunk), trak->start_chunk + 2);
 
@@ -1822,14 +2385,14 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
         mp4_set_32value(first->samples, samples);
         mp4_set_32value(first->id, id);
 
-        trak->atoms[MP4_STSC_CHUNK_END].buffer = TSIOBufferSizedCreate(TS_IOBUFFER_SIZE_INDEX_128);
-        trak->atoms[MP4_STSC_CHUNK_END].reader = TSIOBufferReaderAlloc(trak->atoms[MP4_STSC_CHUNK_END].buffer);
-        TSIOBufferWrite(trak->atoms[MP4_STSC_CHUNK_END].buffer, first, sizeof(mp4_stsc_entry));
+        trak->atoms[MP4_STSC_CHUNK_END].buffer = Mp4IOBufferSizedCreate(MP4_IOBUFFER_SIZE_INDEX_128);
+        trak->atoms[MP4_STSC_CHUNK_END].reader = Mp4IOBufferReaderAlloc(trak->atoms[MP4_STSC_CHUNK_END].buffer);
+        Mp4IOBufferWrite(trak->atoms[MP4_STSC_CHUNK_END].buffer, first, sizeof(mp4_stsc_entry));
 
         trak->sample_to_chunk_entries++;
     }
 
-    TSIOBufferReaderFree(readerp);
+    Mp4IOBufferReaderFree(readerp);
     return 0;
 }
 
@@ -1847,10 +2410,6 @@ Mp4Meta::mp4_crop_stsc_data(Mp4Trak *trak, uint start) {
 int
 Mp4Meta::mp4_update_stsc_atom(Mp4Trak *trak) {
     size_t atom_size;
-    uint32_t chunk;
-    uint32_t entry, end;
-    TSIOBufferReader readerp;
-    int64_t avail, copy_avail, new_avail;
 
     /*
      * mdia.minf.stbl.stsc updating requires trak->start_sample
@@ -1859,12 +2418,12 @@ Mp4Meta::mp4_update_stsc_atom(Mp4Trak *trak) {
      */
 
     if (trak->atoms[MP4_STSC_DATA].buffer == nullptr) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_stsc_atom] no mp4 stsc atoms were found");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_stsc_atom] no mp4 stsc atoms were found");
         return -1;
     }
 
     if (trak->sample_to_chunk_entries == 0) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_stsc_atom] zero number of entries in stsc atom");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_stsc_atom] zero number of entries in stsc atom");
         return -1;
     }
 
@@ -1876,55 +2435,19 @@ Mp4Meta::mp4_update_stsc_atom(Mp4Trak *trak) {
         return -1;
     }
 
-    entry = trak->stsc_pos;
-    end = trak->stsc_last;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsc_atom] entry=%u,end=%u", entry, end);
-
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
-
-    TSIOBufferReaderConsume(readerp, entry * sizeof(mp4_stsc_entry));
-
-    while (entry < end) {
-        chunk = mp4_reader_get_32value(readerp, offsetof(mp4_stsc_entry, chunk));
-//        TSDebug(PLUGIN_NAME, "[mp4_update_stsc_atom] chunk =%u", chunk);
-        chunk -= trak->start_chunk;
-        mp4_reader_set_32value(readerp, offsetof(mp4_stsc_entry, chunk), chunk);
-        entry++;
-        TSIOBufferReaderConsume(readerp, sizeof(mp4_stsc_entry));
-    }
-    TSIOBufferReaderFree(readerp);
-
+    // chunk 序号在输出时由 mp4_write_table 减去 start_chunk
 
     atom_size = sizeof(mp4_stsc_atom) + trak->sample_to_chunk_entries * sizeof(mp4_stsc_entry);
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsc_atom] sizeof(mp4_stsc_atom) =%lu,atom_size=%llu",sizeof(mp4_stsc_atom), atom_size);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_stsc_atom] sizeof(mp4_stsc_atom) =%lu,atom_size=%llu",sizeof(mp4_stsc_atom), atom_size);
 
     trak->size += atom_size;
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_STSC_DATA].reader, trak->stsc_pos * sizeof(mp4_stsc_entry));
-
-
-    new_avail = (trak->stsc_last - trak->stsc_pos) * sizeof(mp4_stsc_entry);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
-    }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_STSC_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsc_atom] avail=%lld, new_avail=%lld", avail, new_avail);
-
-
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_STSC_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_STSC_DATA].reader, avail);
-    TSIOBufferCopy(trak->atoms[MP4_STSC_DATA].buffer, copy_reader, new_avail, 0);
-
-
     mp4_reader_set_32value(trak->atoms[MP4_STSC_ATOM].reader, offsetof(mp4_stsc_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_STSC_ATOM].reader, offsetof(mp4_stsc_atom, entries),
                            trak->sample_to_chunk_entries);
 
-    TSIOBufferReaderFree(readerp);
+    MP4_PROBE4(update_stsc, txn_id, trak, trak->sample_to_chunk_entries, atom_size);
 
     return 0;
 }
@@ -1933,9 +2456,7 @@ int
 Mp4Meta::mp4_update_stsz_atom(Mp4Trak *trak) {
 
     size_t atom_size;
-    uint32_t entries, pass, i, end_pass;
-    TSIOBufferReader readerp;
-    int64_t avail, copy_avail, new_avail;
+    uint32_t entries;
 
     /*
      * mdia.minf.stbl.stsz updating requires trak->start_sample
@@ -1943,75 +2464,58 @@ Mp4Meta::mp4_update_stsz_atom(Mp4Trak *trak) {
      * atom which may reside after mdia.minf
      */
 
-    if (trak->atoms[MP4_STSZ_DATA].buffer == nullptr) {
+    if (trak->atoms[MP4_STSZ_DATA].buffer == nullptr && trak->sample_size == 0) {
         return 0;
     }
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSZ_DATA].reader);
-
     entries = trak->sample_sizes_entries;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] entries=%lu",entries);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_stsz_atom] entries=%lu",entries);
     if (trak->start_sample > entries) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] start time is out mp4 stsz samples");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_stsz_atom] start time is out mp4 stsz samples");
         return -1;
     }
 
     entries = entries - trak->start_sample;
 
-    pass = trak->start_sample * sizeof(uint32_t);
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] start_sample=%ld,pass=%lu", trak->start_sample, pass);
-    TSIOBufferReaderConsume(readerp, pass - sizeof(uint32_t) * (trak->start_chunk_samples));
-
-    for (i = 0; i < trak->start_chunk_samples; i++) {
-        trak->start_chunk_samples_size += mp4_reader_get_32value(readerp, 0);
-        TSIOBufferReaderConsume(readerp, sizeof(uint32_t));
-    }
+    trak->start_chunk_samples_size += mp4_sample_bytes(trak, trak->start_sample) -
+                                      mp4_sample_bytes(trak, trak->start_sample - trak->start_chunk_samples);
 
     if (this->length) {
         if (trak->end_sample - trak->start_sample > entries) {
-            TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] end time is out mp4 stsz samples");
-            TSIOBufferReaderFree(readerp);
+            mp4_debug(PLUGIN_NAME, "[mp4_update_stsz_atom] end time is out mp4 stsz samples");
             return -1;
         }
 
         entries = trak->end_sample - trak->start_sample;
-        end_pass = entries * sizeof(uint32_t);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] end entries=%lu end_pass=%lu",entries, end_pass);
-        TSIOBufferReaderConsume(readerp, end_pass - sizeof(uint32_t) * (trak->end_chunk_samples));
-
-        for (i = 0; i < trak->end_chunk_samples; i++) {
-            trak->end_chunk_samples_size += mp4_reader_get_32value(readerp, 0);
-            TSIOBufferReaderConsume(readerp, sizeof(uint32_t));
-        }
+//        mp4_debug(PLUGIN_NAME, "[mp4_update_stsz_atom] end entries=%lu",entries);
+        trak->end_chunk_samples_size += mp4_sample_bytes(trak, trak->end_sample) -
+                                        mp4_sample_bytes(trak, trak->end_sample - trak->end_chunk_samples);
     }
 
-    atom_size = sizeof(mp4_stsz_atom) + entries * sizeof(uint32_t);
+    atom_size = sizeof(mp4_stsz_atom);
+    if (trak->sample_size == 0) {
+        atom_size += ((uint64_t) entries * trak->sample_field_size + 7) / 8;
+    }
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] sizeof(mp4_stsz_atom) =%lu,atom_size=%llu",sizeof(mp4_stsz_atom), atom_size);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_stsz_atom] sizeof(mp4_stsz_atom) =%lu,atom_size=%llu",sizeof(mp4_stsz_atom), atom_size);
 
     trak->size += atom_size;
 
-
     mp4_reader_set_32value(trak->atoms[MP4_STSZ_ATOM].reader, offsetof(mp4_stsz_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_STSZ_ATOM].reader, offsetof(mp4_stsz_atom, entries), entries);
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_STSZ_DATA].reader, pass);
+    MP4_PROBE4(update_stsz, txn_id, trak, entries, atom_size);
 
+    trak->stsz_pos = trak->start_sample;
+    trak->stsz_last = trak->start_sample + entries;
 
-    new_avail = entries * sizeof(uint32_t);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
+    trak->out_bytes = mp4_sample_bytes(trak, trak->stsz_last) - mp4_sample_bytes(trak, trak->stsz_pos);
+    if (trak->req_sample > trak->stsz_pos) {
+        trak->seek_bytes = mp4_sample_bytes(trak, trak->req_sample < trak->stsz_last ? trak->req_sample
+                                                                                      : trak->stsz_last) -
+                           mp4_sample_bytes(trak, trak->stsz_pos);
     }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_STSZ_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stsz_atom] avail=%lld, new_avail=%lld", avail, new_avail);
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_STSZ_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_STSZ_DATA].reader, avail);
-    TSIOBufferCopy(trak->atoms[MP4_STSZ_DATA].buffer, copy_reader, new_avail, 0);
 
-    TSIOBufferReaderFree(readerp);
 
     return 0;
 }
@@ -2021,8 +2525,7 @@ Mp4Meta::mp4_update_co64_atom(Mp4Trak *trak) {
     size_t atom_size;
     uint64_t entries;
     uint64_t pass, end_pass;
-    TSIOBufferReader readerp;
-    int64_t avail, copy_avail, new_avail;
+    Mp4IOBufferReader readerp;
 
     /*
      * mdia.minf.stbl.co64 updating requires trak->start_chunk
@@ -2031,46 +2534,46 @@ Mp4Meta::mp4_update_co64_atom(Mp4Trak *trak) {
      */
 
     if (trak->atoms[MP4_CO64_DATA].buffer == nullptr) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] no mp4 co64 atoms were found in ");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_co64_atom] no mp4 co64 atoms were found in ");
         return -1;
     }
 
     if (trak->start_chunk > trak->chunks) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] start time is out mp4 co64 chunks");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_co64_atom] start time is out mp4 co64 chunks");
         return -1;
     }
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_CO64_DATA].reader);
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_CO64_DATA].reader);
 
 
     pass = trak->start_chunk * sizeof(uint64_t);
 
-    TSIOBufferReaderConsume(readerp, pass);
+    Mp4IOBufferReaderConsume(readerp, pass);
 
     trak->start_offset = mp4_reader_get_64value(readerp, 0);
     trak->start_offset += trak->start_chunk_samples_size;
     mp4_reader_set_64value(readerp, 0, trak->start_offset);
 
     entries = 0;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] start chunk offset:%lld", trak->start_offset);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_co64_atom] start chunk offset:%lld", trak->start_offset);
 
     if (this->length) {
 
         if (trak->end_chunk > trak->chunks) {
-            TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] end time is out mp4 co64 chunks");
-            TSIOBufferReaderFree(readerp);
+            mp4_debug(PLUGIN_NAME, "[mp4_update_co64_atom] end time is out mp4 co64 chunks");
+            Mp4IOBufferReaderFree(readerp);
             return -1;
         }
 
         entries = trak->end_chunk - trak->start_chunk;
-        end_pass = entries * sizeof(uint64_t);
+        end_pass = (entries > 0 ? (entries - 1) : entries) * sizeof(uint64_t); // end_chunk 是最后一个 chunk 的下一个
         if (entries) {
-            TSIOBufferReaderConsume(readerp, end_pass);
+            Mp4IOBufferReaderConsume(readerp, end_pass);
 
             trak->end_offset = mp4_reader_get_64value(readerp, 0);
             trak->end_offset += trak->end_chunk_samples_size;
 
-//            TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] end chunk offset:%lld", trak->end_offset);
+//            mp4_debug(PLUGIN_NAME, "[mp4_update_co64_atom] end chunk offset:%lld", trak->end_offset);
         }
 
     } else {
@@ -2085,29 +2588,19 @@ Mp4Meta::mp4_update_co64_atom(Mp4Trak *trak) {
 
     atom_size = sizeof(mp4_co64_atom) + entries * sizeof(uint64_t);
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] sizeof(mp4_co64_atom) =%lu,atom_size=%llu",sizeof(mp4_co64_atom), atom_size);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_co64_atom] sizeof(mp4_co64_atom) =%lu,atom_size=%llu",sizeof(mp4_co64_atom), atom_size);
 
     trak->size += atom_size;
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_CO64_DATA].reader, pass);
-
-    new_avail = entries * sizeof(uint64_t);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
-    }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_CO64_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_co64_atom] avail=%lld, new_avail=%lld", avail, new_avail);
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_CO64_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_CO64_DATA].reader, avail);
-    TSIOBufferCopy(trak->atoms[MP4_CO64_DATA].buffer, copy_reader, new_avail, 0);
-
     mp4_reader_set_32value(trak->atoms[MP4_CO64_ATOM].reader, offsetof(mp4_co64_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_CO64_ATOM].reader, offsetof(mp4_co64_atom, entries), entries);
 
-    TSIOBufferReaderFree(readerp);
+    MP4_PROBE4(update_co64, txn_id, trak, entries, atom_size);
+
+    trak->chunk_pos = trak->start_chunk;
+    trak->chunk_last = trak->start_chunk + entries;
+
+    Mp4IOBufferReaderFree(readerp);
     return 0;
 }
 
@@ -2116,8 +2609,7 @@ Mp4Meta::mp4_update_stco_atom(Mp4Trak *trak) {
     size_t atom_size;
     uint32_t entries;
     uint64_t pass, end_pass;
-    TSIOBufferReader readerp;
-    int64_t avail, copy_avail, new_avail;
+    Mp4IOBufferReader readerp;
 
     /*
      * mdia.minf.stbl.stco updating requires trak->start_chunk
@@ -2126,20 +2618,20 @@ Mp4Meta::mp4_update_stco_atom(Mp4Trak *trak) {
      */
 
     if (trak->atoms[MP4_STCO_DATA].buffer == nullptr) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] no mp4 stco atoms were found in ");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_stco_atom] no mp4 stco atoms were found in ");
         return -1;
     }
 
     if (trak->start_chunk > trak->chunks) {
-        TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] start time is out mp4 stco chunks");
+        mp4_debug(PLUGIN_NAME, "[mp4_update_stco_atom] start time is out mp4 stco chunks");
         return -1;
     }
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STCO_DATA].reader);
+    readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STCO_DATA].reader);
     pass = trak->start_chunk * sizeof(uint32_t);
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] start_chunk=%lu, end_chunk=%lu,chunk=%lu, pass=%llu", trak->start_chunk,
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_stco_atom] start_chunk=%lu, end_chunk=%lu,chunk=%lu, pass=%llu", trak->start_chunk,
 //            trak->end_chunk, trak->chunks, pass);
-    TSIOBufferReaderConsume(readerp, pass);
+    Mp4IOBufferReaderConsume(readerp, pass);
 
     trak->start_offset = mp4_reader_get_32value(readerp, 0);
     trak->start_offset += trak->start_chunk_samples_size;
@@ -2150,16 +2642,16 @@ Mp4Meta::mp4_update_stco_atom(Mp4Trak *trak) {
     if (this->length) {
 
         if (trak->end_chunk > trak->chunks) {
-            TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] end time is out mp4 stco chunks");
-            TSIOBufferReaderFree(readerp);
+            mp4_debug(PLUGIN_NAME, "[mp4_update_stco_atom] end time is out mp4 stco chunks");
+            Mp4IOBufferReaderFree(readerp);
             return -1;
         }
 
         entries = trak->end_chunk - trak->start_chunk;
         end_pass = (entries > 0 ?(entries - 1):entries) * sizeof(uint32_t);
         if (entries) {
-            TSIOBufferReaderConsume(readerp, end_pass);
-//            TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] end_pass=%llu, entries=%llu", end_pass, entries);
+            Mp4IOBufferReaderConsume(readerp, end_pass);
+//            mp4_debug(PLUGIN_NAME, "[mp4_update_stco_atom] end_pass=%llu, entries=%llu", end_pass, entries);
             trak->end_offset = mp4_reader_get_32value(readerp, 0);
             trak->end_offset += trak->end_chunk_samples_size;
 
@@ -2177,29 +2669,19 @@ Mp4Meta::mp4_update_stco_atom(Mp4Trak *trak) {
 
     atom_size = sizeof(mp4_stco_atom) + entries * sizeof(uint32_t);
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] sizeof(mp4_stco_atom) =%lu,atom_size=%llu",sizeof(mp4_stco_atom), atom_size);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_stco_atom] sizeof(mp4_stco_atom) =%lu,atom_size=%llu",sizeof(mp4_stco_atom), atom_size);
 
     trak->size += atom_size;
 
-    TSIOBufferReaderConsume(trak->atoms[MP4_STCO_DATA].reader, pass);
-
-    new_avail = entries * sizeof(uint32_t);
-    copy_avail = TSIOBufferReaderAvail(copy_reader);
-    if (copy_avail > 0) {
-        TSIOBufferReaderConsume(copy_reader, copy_avail);
-    }
-    avail = TSIOBufferReaderAvail(trak->atoms[MP4_STCO_DATA].reader);
-    if (new_avail > avail)
-        new_avail = avail;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_stco_atom] avail=%lld, new_avail=%lld", avail, new_avail);
-    TSIOBufferCopy(copy_buffer, trak->atoms[MP4_STCO_DATA].reader, new_avail, 0);
-    TSIOBufferReaderConsume(trak->atoms[MP4_STCO_DATA].reader, avail);
-    TSIOBufferCopy(trak->atoms[MP4_STCO_DATA].buffer, copy_reader, new_avail, 0);
-
     mp4_reader_set_32value(trak->atoms[MP4_STCO_ATOM].reader, offsetof(mp4_stco_atom, size), atom_size);
     mp4_reader_set_32value(trak->atoms[MP4_STCO_ATOM].reader, offsetof(mp4_stco_atom, entries), entries);
 
-    TSIOBufferReaderFree(readerp);
+    MP4_PROBE4(update_stco, txn_id, trak, entries, atom_size);
+
+    trak->chunk_pos = trak->start_chunk;
+    trak->chunk_last = trak->start_chunk + entries;
+
+    Mp4IOBufferReaderFree(readerp);
 
     return 0;
 }
@@ -2237,44 +2719,324 @@ Mp4Meta::mp4_update_trak_atom(Mp4Trak *trak) {
     return 0;
 }
 
-int
-Mp4Meta::mp4_adjust_co64_atom(Mp4Trak *trak, off_t adjustment) {
-    int64_t pos, avail, offset;
-    TSIOBufferReader readerp;
+/**
+ * 继续生成新的 meta, 至少向 out_handle 写入 size 字节(剩余不足时写完为止).
+ * 返回写入的字节数, 0 表示已经全部写完, -1 表示出错
+ */
+int64_t
+Mp4Meta::mp4_write_meta(int64_t size) {
+    int64_t written, n;
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_CO64_DATA].reader);
-    avail = TSIOBufferReaderAvail(readerp);
+    written = 0;
 
-    for (pos = 0; pos < avail; pos += sizeof(uint64_t)) {
-        offset = mp4_reader_get_64value(readerp, 0);
-        offset += adjustment;
-        mp4_reader_set_64value(readerp, 0, offset);
-        TSIOBufferReaderConsume(readerp, sizeof(uint64_t));
+    while (written < size && write_stage != MP4_WRITE_DONE) {
+        n = mp4_write_step();
+        if (n < 0) {
+            return -1;
+        }
+
+        written += n;
     }
 
-    TSIOBufferReaderFree(readerp);
+    return written;
+}
 
-    return 0;
+/**
+ * 输出下一个 atom, sample 表每次最多输出 MP4_INDEX_READ_ENTRIES 个 entry
+ */
+int64_t
+Mp4Meta::mp4_write_step() {
+    int64_t n;
+    u_char moov_header[sizeof(mp4_atom_header)];
+    Mp4Trak *trak;
+    Mp4TableSlice slice;
+
+    n = 0;
+
+    switch (write_stage) {
+        case MP4_WRITE_HEADER:
+            if (ftyp_atom.buffer) {// 不用修改直接copy
+                n += IOBufferWriteReader(out_handle.buffer, ftyp_atom.reader);
+            }
+
+            // moov header, 原文件是 64 位 size 时也统一写成 32 位
+            mp4_set_32value(moov_header, this->moov_size);
+            mp4_set_atom_name(moov_header, 'm', 'o', 'o', 'v');
+            n += Mp4IOBufferWrite(out_handle.buffer, moov_header, sizeof(moov_header));
+
+            if (mvhd_atom.buffer) {// mvhd
+                n += IOBufferWriteReader(out_handle.buffer, mvhd_atom.reader);
+            }
+
+            write_stage = MP4_WRITE_TRAK;
+            write_trak = 0;
+            write_atom = 0;
+            break;
+
+        case MP4_WRITE_TRAK:
+            if (write_trak >= trak_num) {
+                write_stage = MP4_WRITE_MDAT;
+                break;
+            }
+
+            trak = trak_vec[write_trak];
+
+            if (write_atom > MP4_LAST_ATOM) {
+                write_trak++;
+                write_atom = 0;
+                break;
+            }
+
+            if (trak->atoms[write_atom].buffer == nullptr) {
+                write_atom++;
+                break;
+            }
+
+            // 输出过的 atom 不会再用到, 立即释放, 输出阶段只保留还没输出的部分
+            if (!mp4_table_slice(trak, write_atom, &slice)) {
+                n = IOBufferWriteReader(out_handle.buffer, trak->atoms[write_atom].reader);
+                trak->atoms[write_atom].clear();
+                write_atom++;
+                break;
+            }
+
+            if (write_reader == nullptr) {
+                // write_reader 成为唯一的 reader, 表随着输出逐块释放
+                write_reader = Mp4IOBufferReaderClone(trak->atoms[write_atom].reader);
+                Mp4IOBufferReaderFree(trak->atoms[write_atom].reader);
+                trak->atoms[write_atom].reader = nullptr;
+
+                Mp4IOBufferReaderConsume(write_reader, (int64_t) slice.pos * slice.entry_size);
+                write_entry = slice.pos;
+            }
+
+            if (write_entry < slice.last) {
+                n = mp4_write_table(write_reader, &slice,
+                                    slice.last - write_entry < MP4_INDEX_READ_ENTRIES ? slice.last - write_entry
+                                                                                      : MP4_INDEX_READ_ENTRIES);
+                if (n < 0) {
+                    mp4_debug(PLUGIN_NAME, "[mp4_write_step] atom %u is shorter than its entries", write_atom);
+                    return -1;
+                }
+
+                write_entry += n / slice.entry_size;
+            }
+
+            if (write_entry >= slice.last) {
+                Mp4IOBufferReaderFree(write_reader);
+                write_reader = nullptr;
+                trak->atoms[write_atom].clear();
+                write_atom++;
+            }
+            break;
+
+        case MP4_WRITE_MDAT:
+            n = Mp4IOBufferWrite(out_handle.buffer, mdat_atom_header, mdat_header_size);
+            write_stage = MP4_WRITE_DONE;
+            break;
+
+        default:
+            break;
+    }
+
+    return n;
 }
 
-int
-Mp4Meta::mp4_adjust_stco_atom(Mp4Trak *trak, int32_t adjustment) {
-    int64_t pos, avail, offset;
-    TSIOBufferReader readerp;
+/**
+ * atom id 是需要裁剪的 sample 表时, 给出要保留的 entry 范围 [pos, last), 以及输出时
+ * 要改写的值: stss 的 sample 序号, stsc 的 chunk 序号, stco/co64 的 chunk 偏移
+ */
+bool
+Mp4Meta::mp4_table_slice(Mp4Trak *trak, uint32_t id, Mp4TableSlice *slice) {
+    slice->value_offset = 0;
+    slice->value_size = 0;
+    slice->delta = 0;
+    slice->shift = 0;
+
+    switch (id) {
+        case MP4_STTS_DATA:
+            slice->entry_size = sizeof(mp4_stts_entry);
+            slice->pos = trak->stts_pos;
+            slice->last = trak->stts_last;
+            break;
+
+        case MP4_STSS_DATA:
+            slice->entry_size = sizeof(uint32_t);
+            slice->pos = trak->stss_pos;
+            slice->last = trak->stss_last;
+            slice->value_size = sizeof(uint32_t);
+            slice->delta = -(int64_t) trak->start_sample;
+            break;
+
+        case MP4_CTTS_DATA:
+            slice->entry_size = sizeof(mp4_ctts_entry);
+            slice->pos = trak->ctts_pos;
+            slice->last = trak->ctts_last;
+            break;
+
+        case MP4_STSC_DATA:
+            slice->entry_size = sizeof(mp4_stsc_entry);
+            slice->pos = trak->stsc_pos;
+            slice->last = trak->stsc_last;
+            slice->value_offset = offsetof(mp4_stsc_entry, chunk);
+            slice->value_size = sizeof(uint32_t);
+            slice->delta = -(int64_t) trak->start_chunk;
+            break;
+
+        case MP4_STSZ_DATA:
+            if (trak->sample_field_size == 4) { // 按字节输出, 一个字节两个 sample
+                slice->entry_size = 1;
+                slice->pos = trak->stsz_pos >> 1;
+                slice->last = slice->pos + (trak->stsz_last - trak->stsz_pos + 1) / 2;
+                slice->shift = trak->stsz_pos & 1 ? 4 : 0;
+
+            } else {
+                slice->entry_size = trak->sample_field_size / 8;
+                slice->pos = trak->stsz_pos;
+                slice->last = trak->stsz_last;
+            }
+            break;
+
+        case MP4_STCO_DATA:
+            slice->entry_size = sizeof(uint32_t);
+            slice->pos = trak->chunk_pos;
+            slice->last = trak->chunk_last;
+            slice->value_size = sizeof(uint32_t);
+            slice->delta = adjustment;
+            break;
+
+        case MP4_CO64_DATA:
+            slice->entry_size = sizeof(uint64_t);
+            slice->pos = trak->chunk_pos;
+            slice->last = trak->chunk_last;
+            slice->value_size = sizeof(uint64_t);
+            slice->delta = adjustment;
+            break;
 
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STCO_DATA].reader);
-    avail = TSIOBufferReaderAvail(readerp);
-//    TSDebug(PLUGIN_NAME, "[mp4_adjust_stco_atom] avail=%ld", avail);
-    for (pos = 0; pos < avail; pos += sizeof(uint32_t)) {
-        offset = mp4_reader_get_32value(readerp, 0);
-        offset += adjustment;
-        mp4_reader_set_32value(readerp, 0, offset);
-        TSIOBufferReaderConsume(readerp, sizeof(uint32_t));
+        default:
+            return false;
     }
 
-    TSIOBufferReaderFree(readerp);
+    return true;
+}
 
-    return 0;
+/**
+ * 裁剪完之后每个 sample 表只留下要输出的 [pos, last), 换成只含这部分的新 buffer, 原来的表立即释放.
+ * 从裁剪完到 moov 输出完这段时间里, 表占用的内存与输出的 entry 数成正比, 与原文件的长度无关
+ */
+void
+Mp4Meta::mp4_trim_tables(Mp4Trak *trak) {
+    uint32_t id, rebase;
+    int64_t size;
+    Mp4IOBuffer buffer;
+    Mp4TableSlice slice;
+
+    for (id = 0; id <= MP4_LAST_ATOM; id++) {
+        if (trak->atoms[id].buffer == nullptr || !mp4_table_slice(trak, id, &slice)) {
+            continue;
+        }
+
+        size = (int64_t) (slice.last - slice.pos) * slice.entry_size;
+        if (slice.pos == 0 && size + (slice.shift ? 1 : 0) >= trak->atoms[id].bytes()) {
+            continue;
+        }
+
+        // 半字节移位时多留一个字节, 见 mp4_write_table
+        buffer = Mp4IOBufferCreate();
+        Mp4IOBufferCopy(buffer, trak->atoms[id].reader, size + (slice.shift ? 1 : 0),
+                        (int64_t) slice.pos * slice.entry_size);
+
+        trak->atoms[id].clear();
+        trak->atoms[id].buffer = buffer;
+        trak->atoms[id].reader = Mp4IOBufferReaderAlloc(buffer);
+
+        // 新 buffer 从 slice.pos 开始, 范围整体前移. 4 位的 stz2 按字节截取, 一个字节两个 sample
+        rebase = slice.pos;
+
+        switch (id) {
+            case MP4_STTS_DATA:
+                trak->stts_pos -= rebase;
+                trak->stts_last -= rebase;
+                break;
+
+            case MP4_STSS_DATA:
+                trak->stss_pos -= rebase;
+                trak->stss_last -= rebase;
+                break;
+
+            case MP4_CTTS_DATA:
+                trak->ctts_pos -= rebase;
+                trak->ctts_last -= rebase;
+                break;
+
+            case MP4_STSC_DATA:
+                trak->stsc_pos -= rebase;
+                trak->stsc_last -= rebase;
+                break;
+
+            case MP4_STSZ_DATA:
+                if (trak->sample_field_size == 4) {
+                    rebase *= 2;
+                }
+
+                trak->stsz_pos -= rebase;
+                trak->stsz_last -= rebase;
+                break;
+
+            default: // stco, co64
+                trak->chunk_pos -= rebase;
+                trak->chunk_last -= rebase;
+                break;
+        }
+    }
+}
+
+/**
+ * 从 readerp 读出 entries 个 entry, 改写后写入 out_handle, 返回写入的字节数
+ */
+int64_t
+Mp4Meta::mp4_write_table(Mp4IOBufferReader readerp, Mp4TableSlice *slice, uint32_t entries) {
+    uint32_t j;
+    int64_t n, size;
+    u_char *p;
+    u_char buf[MP4_INDEX_READ_ENTRIES * sizeof(mp4_stsc_entry) + 1];
+
+    size = entries * slice->entry_size;
+
+    // 半字节移位时多读一个字节, 表末尾没有时补 0
+    n = IOBufferReaderCopy(readerp, buf, size + (slice->shift ? 1 : 0));
+
+    if (n < size) {
+        Mp4IOBufferReaderConsume(readerp, n);
+        return -1;
+    }
+
+    Mp4IOBufferReaderConsume(readerp, size);
+
+    if (slice->shift) {
+        if (n == size) {
+            buf[size] = 0;
+        }
+
+        for (j = 0; j < size; j++) {
+            buf[j] = (u_char) ((buf[j] << slice->shift) | (buf[j + 1] >> (8 - slice->shift)));
+        }
+    }
+
+    if (slice->value_size == sizeof(uint32_t)) {
+        for (j = 0; j < entries; j++) {
+            p = buf + j * slice->entry_size + slice->value_offset;
+            mp4_set_32value(p, (uint32_t) (mp4_get_32value(p) + slice->delta));
+        }
+
+    } else if (slice->value_size == sizeof(uint64_t)) {
+        for (j = 0; j < entries; j++) {
+            p = buf + j * slice->entry_size + slice->value_offset;
+            mp4_set_64value(p, (uint64_t) (mp4_get_64value(p) + slice->delta));
+        }
+    }
+
+    return Mp4IOBufferWrite(out_handle.buffer, buf, size);
 }
 
 int64_t
@@ -2287,9 +3049,9 @@ Mp4Meta::mp4_update_mdat_atom(int64_t start_offset, int64_t end_offset) {
     atom_data_size = end_offset > start_offset ? end_offset - start_offset : this->cl - start_offset;//剩余的都是mdat
     this->start_pos = start_offset;
     this->end_pos = end_offset;
-//    TSDebug(PLUGIN_NAME, "[mp4_update_mdat_atom] this->start_pos= %ld, atom_data_size=%ld", this->start_pos,
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_mdat_atom] this->start_pos= %ld, atom_data_size=%ld", this->start_pos,
 //            atom_data_size);
-//    TSDebug(PLUGIN_NAME, "[mp4_update_mdat_atom] this->end_pos= %ld", this->end_pos);
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_mdat_atom] this->end_pos= %ld", this->end_pos);
     atom_header = mdat_atom_header;
 
     if (atom_data_size > 0xffffffff) {
@@ -2305,19 +3067,39 @@ Mp4Meta::mp4_update_mdat_atom(int64_t start_offset, int64_t end_offset) {
     this->content_length += atom_header_size + atom_data_size;
 //    this->content_length += atom_header_size + 1024*1024*1;
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_mdat_atom] atom_header_size=%ld content_length=%ld",
+//    mp4_debug(PLUGIN_NAME, "[mp4_update_mdat_atom] atom_header_size=%ld content_length=%ld",
 //            atom_header_size, this->content_length);
     mp4_set_32value(atom_header, atom_size);
     mp4_set_atom_name(atom_header, 'm', 'd', 'a', 't');
 
-    mdat_atom.buffer = TSIOBufferSizedCreate(TS_IOBUFFER_SIZE_INDEX_128);
-    mdat_atom.reader = TSIOBufferReaderAlloc(mdat_atom.buffer);
-
-    TSIOBufferWrite(mdat_atom.buffer, atom_header, atom_header_size);
+    MP4_PROBE4(update_mdat, txn_id, start_offset, end_offset, atom_data_size);
 
     return atom_header_size;
 }
 
+/**
+ * 统计裁剪的代价. 输出的 mdat 为所有 trak 输出 sample 所在的 [start_offset, end_offset),
+ * 其中起点对齐到关键帧多出的 sample 计入 gop, 不属于任何 trak 输出 sample 的字节计入 interleave
+ */
+void
+Mp4Meta::mp4_seek_cost(int64_t start_offset, int64_t end_offset) {
+    uint32_t i;
+    int64_t used;
+
+    seek_mdat_bytes = end_offset > start_offset ? end_offset - start_offset : this->cl - start_offset;
+    seek_gop_bytes = 0;
+    used = 0;
+
+    for (i = 0; i < trak_num; i++) {
+        seek_gop_bytes += trak_vec[i]->seek_bytes;
+        used += trak_vec[i]->out_bytes;
+    }
+
+    seek_interleave_bytes = seek_mdat_bytes > used ? seek_mdat_bytes - used : 0;
+
+    MP4_PROBE4(seek_cost, txn_id, seek_gop_bytes, seek_interleave_bytes, seek_mdat_bytes);
+}
+
 /**
  * Sync Sample Box
  * size, type, version flags, number of entries
@@ -2326,231 +3108,101 @@ Mp4Meta::mp4_update_mdat_atom(int64_t start_offset, int64_t end_offset) {
  */
 uint32_t
 Mp4Meta::mp4_find_key_sample(uint32_t start_sample, Mp4Trak *trak) {
-    uint32_t i;
-    uint32_t sample, prev_sample, entries;
-    TSIOBufferReader readerp;
+    uint32_t entry;
 
-    if (trak->atoms[MP4_STSS_DATA].buffer == nullptr) {
+    if (trak->index.stss_entries == 0) {
         return start_sample;
     }
 
-    prev_sample = 1;
-    entries = trak->sync_samples_entries;
-    //mp4_find_key_sample sync_samples_entries=75
-//    TSDebug(PLUGIN_NAME, "mp4_find_key_sample sync_samples_entries=%u", entries);
-    readerp = TSIOBufferReaderClone(trak->atoms[MP4_STSS_DATA].reader);
-
-    for (i = 0; i < entries; i++) {
-        sample = (uint32_t) mp4_reader_get_32value(readerp, 0);
-        //mp4_find_key_sample sample=1
-        // .....
-        //mp4_find_key_sample sample=251
-//        TSDebug(PLUGIN_NAME, "mp4_find_key_sample sample=%u", sample);
-        if (sample > start_sample) {
-            goto found;
-        }
+    // start_sample 之前(含)的最后一个关键帧, sample 从 1 开始
+    entry = mp4_index_search32(trak->index.stss_sample, trak->index.stss_entries, start_sample);
 
-        prev_sample = sample;
-        TSIOBufferReaderConsume(readerp, sizeof(uint32_t));
+    if (entry == 0) {
+        return 1;
     }
 
-    found:
-
-    TSIOBufferReaderFree(readerp);
-    return prev_sample;
+    return trak->index.stss_sample[entry];
 }
 
+/**
+ * mvhd 的时长取所有 trak 裁剪后时长的最大值, 单位为 mvhd 的 timescale
+ */
 void
 Mp4Meta::mp4_update_mvhd_duration() {
-    int64_t need;
-    uint64_t duration, cut, end_cut;
-    mp4_mvhd_atom *mvhd;
-    mp4_mvhd64_atom mvhd64;
-
-    need = TSIOBufferReaderAvail(mvhd_atom.reader);
-
-    if (need > (int64_t) sizeof(mp4_mvhd64_atom)) {
-        need = sizeof(mp4_mvhd64_atom);
-    }
-
-    memset(&mvhd64, 0, sizeof(mvhd64));
-    IOBufferReaderCopy(mvhd_atom.reader, &mvhd64, need);
-    mvhd = (mp4_mvhd_atom *) &mvhd64;
-
-    if (this->rs > 0) {
-        cut = (uint64_t) (this->rs * this->timescale / 1000);
+    uint32_t i;
+    uint64_t duration, trak_duration;
+    Mp4Trak *trak;
 
-    } else {
-        cut = this->start * this->timescale / 1000;
+    if (mvhd_atom.buffer == nullptr) {
+        return;
     }
 
-    end_cut = 0;
-    if (this->end > 0) {
-        if (this->end_rs > 0) {
-            end_cut = (uint64_t) (this->end_rs * this->timescale / 1000);
-
-        } else {
-            end_cut = this->end * this->timescale / 1000;
-        }
-    }
-//    TSDebug(PLUGIN_NAME, "[mp4_update_mvhd_duration] end_cut=%llu, cut=%llu, this->timescale=%llu", end_cut, cut,
-//            this->timescale);
-    if (mvhd->version[0] == 0) {
-        duration = mp4_get_32value(mvhd->duration);
-        if (this->end > 0 && end_cut > 0 && end_cut > cut) {
-            duration = end_cut - cut;
-        } else {
-            duration -= cut;
+    duration = 0;
+    for (i = 0; i < trak_num; i++) {
+        trak = trak_vec[i];
+        if (trak->timescale == 0) {
+            continue;
         }
 
-        mp4_reader_set_32value(mvhd_atom.reader, offsetof(mp4_mvhd_atom, duration), (uint32_t) duration);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_mvhd_duration] timescale=%llu",
-//                mp4_reader_get_32value(mvhd_atom.reader, offsetof(mp4_mvhd_atom, timescale)));
-
-    } else { // 64-bit duration
-        duration = mp4_get_64value(mvhd64.duration);
-        if (this->end > 0 && end_cut > 0 && end_cut > cut) {
-            duration = end_cut - cut;
-        } else {
-            duration -= cut;
+        trak_duration = (uint64_t) trak->duration * this->timescale / trak->timescale;
+        if (duration < trak_duration) {
+            duration = trak_duration;
         }
-        mp4_reader_set_64value(mvhd_atom.reader, offsetof(mp4_mvhd64_atom, duration), duration);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_mvhd_duration] timescale=%llu",
-//                mp4_reader_get_64value(mvhd_atom.reader, offsetof(mp4_mvhd64_atom, timescale)));
     }
 
-//    TSDebug(PLUGIN_NAME, "[mp4_update_mvhd_duration] duration=%llu, timescale=", duration);
+    mvhd_layout->set_duration(mvhd_atom.reader, duration);
 }
 
+/**
+ * tkhd 的时长使用 mvhd 的 timescale
+ */
 void
 Mp4Meta::mp4_update_tkhd_duration(Mp4Trak *trak) {
-    int64_t need, cut, end_cut;
-    mp4_tkhd_atom *tkhd_atom;
-    mp4_tkhd64_atom tkhd64_atom;
-    int64_t duration;
-
-    need = TSIOBufferReaderAvail(trak->atoms[MP4_TKHD_ATOM].reader);
-
-    if (need > (int64_t) sizeof(mp4_tkhd64_atom)) {
-        need = sizeof(mp4_tkhd64_atom);
-    }
-
-    memset(&tkhd64_atom, 0, sizeof(tkhd64_atom));
-    IOBufferReaderCopy(trak->atoms[MP4_TKHD_ATOM].reader, &tkhd64_atom, need);
-    tkhd_atom = (mp4_tkhd_atom *) &tkhd64_atom;
+    uint64_t duration;
 
-    if (this->rs > 0) {
-        cut = (uint64_t) (this->rs * this->timescale / 1000);
-
-    } else {
-        cut = this->start * this->timescale / 1000;
+    if (trak->atoms[MP4_TKHD_ATOM].buffer == nullptr || trak->timescale == 0) {
+        return;
     }
-    end_cut = 0;
-    if (this->end > 0) {
-        if (this->end_rs > 0) {
-            end_cut = (uint64_t) (this->end_rs * this->timescale / 1000);
-        } else {
-            end_cut = this->end * this->timescale / 1000;
-        }
-    }
-//    TSDebug(PLUGIN_NAME, "[mp4_update_tkhd_duration] end_cut=%llu, cut=%llu, this->timescale=%llu", end_cut, cut,
-//            this->timescale);
-    if (tkhd_atom->version[0] == 0) {
-        duration = mp4_get_32value(tkhd_atom->duration);
-        if (this->end > 0 && end_cut > 0 && end_cut > cut) {
-            duration = end_cut - cut;
-        } else {
-            duration -= cut;
-        }
-
-        mp4_reader_set_32value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd_atom, duration), duration);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_tkhd_duration] duration=%llu",
-//                mp4_reader_get_32value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd_atom, duration)));
-
-    } else {
-        duration = mp4_get_64value(tkhd64_atom.duration);
-        if (this->end > 0 && end_cut > 0 && end_cut > cut) {
-            duration = end_cut - cut;
-        } else {
-            duration -= cut;
-        }
-        mp4_reader_set_64value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd64_atom, duration), duration);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_tkhd_duration] duration=%llu",
-//                mp4_reader_get_64value(trak->atoms[MP4_TKHD_ATOM].reader, offsetof(mp4_tkhd64_atom, duration)));
 
-    }
+    duration = (uint64_t) trak->duration * this->timescale / trak->timescale;
+    trak->tkhd_layout->set_duration(trak->atoms[MP4_TKHD_ATOM].reader, duration);
 }
 
+/**
+ * 按裁剪后第一个和最后一个 sample 的解码时间重新计算 trak 时长,
+ * 起点对齐到关键帧后比请求的时长要长一些
+ */
 void
 Mp4Meta::mp4_update_mdhd_duration(Mp4Trak *trak) {
-    int64_t duration, need, cut, end_cut;
-    mp4_mdhd_atom *mdhd;
-    mp4_mdhd64_atom mdhd64;
-
-    memset(&mdhd64, 0, sizeof(mp4_mdhd64_atom));
+    uint32_t end_sample;
 
-    need = TSIOBufferReaderAvail(trak->atoms[MP4_MDHD_ATOM].reader);
-
-    if (need > (int64_t) sizeof(mp4_mdhd64_atom)) {
-        need = sizeof(mp4_mdhd64_atom);
+    if (trak->index.stts_sample == nullptr) {
+        return;
     }
 
-    IOBufferReaderCopy(trak->atoms[MP4_MDHD_ATOM].reader, &mdhd64, need);
-    mdhd = (mp4_mdhd_atom *) &mdhd64;
-
-    if (this->rs > 0) {
-        cut = (int64_t) (this->rs * trak->timescale / 1000);
-    } else {
-        cut = this->start * trak->timescale / 1000;
-    }
+    end_sample = this->length ? trak->end_sample : trak->index.stts_sample[trak->index.stts_entries];
+    trak->duration = mp4_sample_time(trak, end_sample) - mp4_sample_time(trak, trak->start_sample);
 
-    end_cut = 0;
-    if (this->end > 0) {
-        if (this->end_rs > 0) {
-            end_cut = (int64_t) (this->end_rs * trak->timescale / 1000);
-        } else {
-            end_cut = this->end * trak->timescale / 1000;
-        }
+    if (trak->atoms[MP4_MDHD_ATOM].buffer == nullptr) {
+        return;
     }
-//    TSDebug(PLUGIN_NAME, "[mp4_update_mdhd_duration] end_cut=%llu, cut=%llu, trak->timescale=%llu", end_cut, cut,
-//            trak->timescale);
-    if (mdhd->version[0] == 0) {
-        duration = mp4_get_32value(mdhd->duration);
-        if (this->end > 0 && end_cut > 0 && end_cut > cut) {
-            duration = end_cut - cut;
-        } else {
-            duration -= cut;
-        }
-        mp4_reader_set_32value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd_atom, duration), duration);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_mdhd_duration] duration=%llu",
-//                mp4_reader_get_32value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd_atom, duration)));
-    } else {
-        duration = mp4_get_64value(mdhd64.duration);
-        if (this->end > 0 && end_cut > 0 && end_cut > cut) {
-            duration = end_cut - cut;
-        } else {
-            duration -= cut;
-        }
-        mp4_reader_set_64value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd64_atom, duration), duration);
-//        TSDebug(PLUGIN_NAME, "[mp4_update_mdhd_duration] duration=%llu",
-//                mp4_reader_get_64value(trak->atoms[MP4_MDHD_ATOM].reader, offsetof(mp4_mdhd64_atom, duration)));
 
-    }
+    trak->mdhd_layout->set_duration(trak->atoms[MP4_MDHD_ATOM].reader, trak->duration);
 }
 
-static void
-mp4_reader_set_32value(TSIOBufferReader readerp, int64_t offset, uint32_t n) {
+void
+mp4_reader_set_32value(Mp4IOBufferReader readerp, int64_t offset, uint32_t n) {
     int pos;
     int64_t avail, left;
-    TSIOBufferBlock blk;
+    Mp4IOBufferBlock blk;
     const char *start;
     u_char *ptr;
 
     pos = 0;
-    blk = TSIOBufferReaderStart(readerp);
+    blk = Mp4IOBufferReaderStart(readerp);
 
     while (blk) {
-        start = TSIOBufferBlockReadStart(blk, readerp, &avail);
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
 
         if (avail <= offset) {
             offset -= avail;
@@ -2572,23 +3224,23 @@ mp4_reader_set_32value(TSIOBufferReader readerp, int64_t offset, uint32_t n) {
             offset = 0;
         }
 
-        blk = TSIOBufferBlockNext(blk);
+        blk = Mp4IOBufferBlockNext(blk);
     }
 }
 
-static void
-mp4_reader_set_64value(TSIOBufferReader readerp, int64_t offset, uint64_t n) {
+void
+mp4_reader_set_64value(Mp4IOBufferReader readerp, int64_t offset, uint64_t n) {
     int pos;
     int64_t avail, left;
-    TSIOBufferBlock blk;
+    Mp4IOBufferBlock blk;
     const char *start;
     u_char *ptr;
 
     pos = 0;
-    blk = TSIOBufferReaderStart(readerp);
+    blk = Mp4IOBufferReaderStart(readerp);
 
     while (blk) {
-        start = TSIOBufferBlockReadStart(blk, readerp, &avail);
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
 
         if (avail <= offset) {
             offset -= avail;
@@ -2603,31 +3255,31 @@ mp4_reader_set_64value(TSIOBufferReader readerp, int64_t offset, uint64_t n) {
                 left--;
             }
 
-            if (pos >= 4) {
+            if (pos >= 8) {
                 return;
             }
 
             offset = 0;
         }
 
-        blk = TSIOBufferBlockNext(blk);
+        blk = Mp4IOBufferBlockNext(blk);
     }
 }
 
-static uint32_t
-mp4_reader_get_32value(TSIOBufferReader readerp, int64_t offset) {
+uint32_t
+mp4_reader_get_32value(Mp4IOBufferReader readerp, int64_t offset) {
     int pos;
     int64_t avail, left;
-    TSIOBufferBlock blk;
+    Mp4IOBufferBlock blk;
     const char *start;
     const u_char *ptr;
     u_char res[4];
 
     pos = 0;
-    blk = TSIOBufferReaderStart(readerp);
+    blk = Mp4IOBufferReaderStart(readerp);
 
     while (blk) {
-        start = TSIOBufferBlockReadStart(blk, readerp, &avail);
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
 
         if (avail <= offset) {
             offset -= avail;
@@ -2649,26 +3301,26 @@ mp4_reader_get_32value(TSIOBufferReader readerp, int64_t offset) {
             offset = 0;
         }
 
-        blk = TSIOBufferBlockNext(blk);
+        blk = Mp4IOBufferBlockNext(blk);
     }
 
     return -1;
 }
 
-static uint64_t
-mp4_reader_get_64value(TSIOBufferReader readerp, int64_t offset) {
+uint64_t
+mp4_reader_get_64value(Mp4IOBufferReader readerp, int64_t offset) {
     int pos;
     int64_t avail, left;
-    TSIOBufferBlock blk;
+    Mp4IOBufferBlock blk;
     const char *start;
     u_char *ptr;
     u_char res[8];
 
     pos = 0;
-    blk = TSIOBufferReaderStart(readerp);
+    blk = Mp4IOBufferReaderStart(readerp);
 
     while (blk) {
-        start = TSIOBufferBlockReadStart(blk, readerp, &avail);
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
 
         if (avail <= offset) {
             offset -= avail;
@@ -2690,23 +3342,23 @@ mp4_reader_get_64value(TSIOBufferReader readerp, int64_t offset) {
             offset = 0;
         }
 
-        blk = TSIOBufferBlockNext(blk);
+        blk = Mp4IOBufferBlockNext(blk);
     }
 
     return -1;
 }
 
-static int64_t
-IOBufferReaderCopy(TSIOBufferReader readerp, void *buf, int64_t length) {
+int64_t
+IOBufferReaderCopy(Mp4IOBufferReader readerp, void *buf, int64_t length) {
     int64_t avail, need, n;
     const char *start;
-    TSIOBufferBlock blk;
+    Mp4IOBufferBlock blk;
 
     n = 0;
-    blk = TSIOBufferReaderStart(readerp);
+    blk = Mp4IOBufferReaderStart(readerp);
 
     while (blk) {
-        start = TSIOBufferBlockReadStart(blk, readerp, &avail);
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
         need = length < avail ? length : avail;
 
         if (need > 0) {
@@ -2719,8 +3371,114 @@ IOBufferReaderCopy(TSIOBufferReader readerp, void *buf, int64_t length) {
             break;
         }
 
-        blk = TSIOBufferBlockNext(blk);
+        blk = Mp4IOBufferBlockNext(blk);
+    }
+
+    return n;
+}
+
+/*
+ * 把 readerp 中的全部数据拷贝写入 bufp, 不共享 readerp 的 block, 返回写入的字节数
+ */
+static int64_t
+IOBufferWriteReader(Mp4IOBuffer bufp, Mp4IOBufferReader readerp) {
+    int64_t avail, n;
+    const char *start;
+    Mp4IOBufferBlock blk;
+
+    n = 0;
+    blk = Mp4IOBufferReaderStart(readerp);
+
+    while (blk) {
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
+
+        if (avail > 0) {
+            n += Mp4IOBufferWrite(bufp, start, avail);
+        }
+
+        blk = Mp4IOBufferBlockNext(blk);
     }
 
     return n;
-}
\ No newline at end of file
+}
+
+/*
+ * 能放下 size 字节的最小 block, 超过 2M 时用多个 2M 的 block
+ */
+static Mp4IOBufferSizeIndex
+mp4_buffer_size_index(int64_t size) {
+    int index;
+
+    index = MP4_IOBUFFER_SIZE_INDEX_128;
+
+    while (index < MP4_IOBUFFER_SIZE_INDEX_2M && ((int64_t) 128 << index) < size) {
+        index++;
+    }
+
+    return (Mp4IOBufferSizeIndex) index;
+}
+
+/*
+ * v 为 n + 1 个单调不减的值, 返回最后一个 v[i] <= key 的 i, key 超出范围时返回 n
+ */
+static uint32_t
+mp4_index_search32(const uint32_t *v, uint32_t n, uint32_t key) {
+    uint32_t lo, hi, mid;
+
+    lo = 0;
+    hi = n + 1;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (v[mid] <= key) {
+            lo = mid;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static uint32_t
+mp4_index_search64(const uint64_t *v, uint32_t n, uint64_t key) {
+    uint32_t lo, hi, mid;
+
+    lo = 0;
+    hi = n + 1;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (v[mid] <= key) {
+            lo = mid;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * stsz/stz2 表中第 i 个 sample 的大小, buf 从字节边界开始
+ */
+static uint32_t
+mp4_get_sample_size(const u_char *buf, uint32_t field_size, uint32_t i) {
+    switch (field_size) {
+        case 4:
+            return (i & 1) ? buf[i >> 1] & 0x0f : buf[i >> 1] >> 4;
+
+        case 8:
+            return buf[i];
+
+        case 16:
+            return ((uint32_t) buf[i * 2] << 8) + buf[i * 2 + 1];
+
+        default:
+            return mp4_get_32value(buf + i * sizeof(uint32_t));
+    }
+}
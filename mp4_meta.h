@@ -24,12 +24,21 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <atomic>
 
-#include <ts/ts.h>
+#include "mp4_buffer.h"
 
-#define MP4_MAX_TRAK_NUM 6
-#define MP4_MAX_BUFFER_SIZE (10 * 1024 * 1024)
+#include "mp4_arena.h"
+#include "mp4_probes.h"
+
+#define MP4_TRAK_VEC_SIZE 4 // trak_vec 的初始容量, 不够时翻倍
+#define MP4_META_BUDGET (32 * 1024 * 1024) // 默认每个请求解析 meta 可用的内存, 可由 remap 参数 --meta-budget 修改
+#define MP4_WORK_BUDGET (4 * 1024 * 1024) // 默认每个请求最多处理的表 entry 数, 可由 remap 参数 --work-budget 修改
 #define MP4_MIN_BUFFER_SIZE 1024
+#define MP4_MAX_ATOM_DEPTH 8
+#define MP4_STSZ_INDEX_SHIFT 6 // stsz 每 64 个 sample 记录一次累计大小
+#define MP4_INDEX_READ_ENTRIES 512 // 建索引时每次从 IOBuffer 拷贝的 entry 数
+#define MP4_META_WRITE_SIZE (64 * 1024) // 输出的新 meta 每次最多生成这么多字节
 
 //#define DEBUG_TAG "ts_mp4"
 const char PLUGIN_NAME[] = "ts_mp4";
@@ -64,6 +73,13 @@ const char PLUGIN_NAME[] = "ts_mp4";
   ((u_char *)(p))[6] = (u_char)((n) >> 8);            \
   ((u_char *)(p))[7] = (u_char)(n)
 
+// box 类型按大端转成 32 位整数, 编译期求值, 分发时整数比较代替 memcmp
+constexpr uint32_t
+mp4_fourcc(const char (&name)[5]) {
+    return ((uint32_t) (u_char) name[0] << 24) | ((uint32_t) (u_char) name[1] << 16) |
+           ((uint32_t) (u_char) name[2] << 8) | (uint32_t) (u_char) name[3];
+}
+
 typedef enum {
     //track box trak  “trak”也是一个container box，存放视频音频流的容器。其子box包含了该track的媒体数据引用和描述（hint track除外）
             MP4_TRAK_ATOM = 0,
@@ -250,6 +266,38 @@ typedef enum {
     MP4_LAST_ATOM = MP4_CO64_DATA
 } TSMp4AtomID;
 
+// 新 meta 的输出进度
+typedef enum {
+    MP4_WRITE_HEADER = 0, // ftyp, moov header, mvhd
+    MP4_WRITE_TRAK,
+    MP4_WRITE_MDAT,
+    MP4_WRITE_DONE
+} TSMp4WriteStage;
+
+// 解析或裁剪失败的原因, 只记录第一个
+typedef enum {
+    MP4_ERROR_NONE = 0,
+    MP4_ERROR_MALFORMED,       // box 或 sample 表不合法, 时间超出范围等
+    MP4_ERROR_META_BUDGET,     // moov 太大, 超出 meta budget
+    MP4_ERROR_WORK_BUDGET,     // 表 entry 太多, 超出 work budget
+    MP4_ERROR_CMOV,            // 压缩的 moov
+    MP4_ERROR_MOOV_AFTER_MDAT  // mdat 在 moov 之前
+} TSMp4ParseError;
+
+const char *mp4_parse_error_name(TSMp4ParseError err);
+
+// 按偏移读写 reader 中的大端整数, 可以跨 block. offset 从 reader 的当前位置算起
+void mp4_reader_set_32value(Mp4IOBufferReader readerp, int64_t offset, uint32_t n);
+
+void mp4_reader_set_64value(Mp4IOBufferReader readerp, int64_t offset, uint64_t n);
+
+uint32_t mp4_reader_get_32value(Mp4IOBufferReader readerp, int64_t offset);
+
+uint64_t mp4_reader_get_64value(Mp4IOBufferReader readerp, int64_t offset);
+
+// 从 reader 的当前位置拷贝最多 length 字节到 buf, 不消费, 返回拷贝的字节数
+int64_t IOBufferReaderCopy(Mp4IOBufferReader readerp, void *buf, int64_t length);
+
 typedef struct {
     u_char size[4];
     u_char name[4];
@@ -443,6 +491,16 @@ typedef struct {
     u_char entries[4];
 } mp4_stsz_atom;//Sample Size Box  “stsz” 定义了每个sample的大小，包含了媒体中全部sample的数目和一张给出每个sample大小的表。
 
+typedef struct {
+    u_char size[4];
+    u_char name[4];
+    u_char version[1];
+    u_char flags[3];
+    u_char reserved[3];
+    u_char field_size[1]; // 每个 entry 的位数: 4, 8 或 16
+    u_char entries[4];
+} mp4_stz2_atom;//Compact Sample Size Box, 与 stsz 头部大小相同, entry 按 field_size 紧凑存放
+
 typedef struct {
     u_char size[4];
     u_char name[4];
@@ -459,34 +517,158 @@ typedef struct {
     u_char entries[4];
 } mp4_co64_atom;
 
+/*
+ * mvhd/tkhd/mdhd 某一个 version 布局的时长读写函数, 读 box 时按 version 选定一次
+ */
+typedef struct {
+    size_t size;
+    uint64_t (*get_duration)(Mp4IOBufferReader readerp);
+    void (*set_duration)(Mp4IOBufferReader readerp, uint64_t duration);
+} Mp4HeaderLayout;
+
 class Mp4Meta;
 
+// 一张 sample 表要输出的部分, 以及每个 entry 中要改写的值
+typedef struct {
+    size_t entry_size;
+    uint32_t pos;
+    uint32_t last;
+    size_t value_offset;
+    size_t value_size; // 0, 4 或 8
+    int64_t delta;
+    uint32_t shift;    // stz2 4 位 entry 从奇数 sample 开始时, 输出整体左移半个字节
+} Mp4TableSlice;
+
 typedef int (Mp4Meta::*Mp4AtomHandler)(int64_t atom_header_size, int64_t atom_data_size);
 
-typedef struct {
-    const char *name;
+typedef struct mp4_atom_handler {
+    uint32_t type; // mp4_fourcc("moov"), 0 表示表的结尾
     Mp4AtomHandler handler;
+    struct mp4_atom_handler *children; // 非空表示容器 box, 读完 header 后继续解析子 box
 } mp4_atom_handler;
 
+// 正在解析的容器 box
+typedef struct {
+    mp4_atom_handler *atom;
+    int64_t left; // 容器内还没解析的字节数
+} Mp4AtomFrame;
+
 class BufferHandle {
 public:
     BufferHandle() : buffer(NULL), reader(NULL) {};
 
     ~BufferHandle() {
+        clear();
+    }
+
+    void clear() {
         if (reader) {
-            TSIOBufferReaderFree(reader);
+            Mp4IOBufferReaderFree(reader);
             reader = NULL;
         }
 
         if (buffer) {
-            TSIOBufferDestroy(buffer);
+            Mp4IOBufferDestroy(buffer);
             buffer = NULL;
         }
     }
 
+    int64_t bytes() {
+        return reader ? Mp4IOBufferReaderAvail(reader) : 0;
+    }
+
 public:
-    TSIOBuffer buffer;
-    TSIOBufferReader reader;
+    Mp4IOBuffer buffer;
+    Mp4IOBufferReader reader;
+};
+
+/*
+ * 一个 trak 的 sample 表随机访问索引, moov 读完后建立一次.
+ * 每个数组都有 entries + 1 项, 最后一项存总数, 第 i 段覆盖 [x[i], x[i + 1])
+ */
+class Mp4SampleIndex {
+public:
+    Mp4SampleIndex()
+            : stts_entries(0),
+              stts_sample(nullptr),
+              stts_time(nullptr),
+              stsc_entries(0),
+              stsc_sample(nullptr),
+              ctts_entries(0),
+              ctts_sample(nullptr),
+              stss_entries(0),
+              stss_sample(nullptr),
+              stsz_entries(0),
+              stsz_bytes(nullptr) {}
+
+    ~Mp4SampleIndex() {
+        clear();
+    }
+
+    // 裁剪完成后索引就不再需要了
+    void clear() {
+        if (stts_sample)
+            mp4_free(stts_sample);
+
+        if (stts_time)
+            mp4_free(stts_time);
+
+        if (stsc_sample)
+            mp4_free(stsc_sample);
+
+        if (ctts_sample)
+            mp4_free(ctts_sample);
+
+        if (stss_sample)
+            mp4_free(stss_sample);
+
+        if (stsz_bytes)
+            mp4_free(stsz_bytes);
+
+        stts_sample = stsc_sample = ctts_sample = stss_sample = nullptr;
+        stts_time = stsz_bytes = nullptr;
+        stts_entries = stsc_entries = ctts_entries = stss_entries = stsz_entries = 0;
+    }
+
+    // 索引占用的内存, 与建索引时计入 meta 预算的大小相同
+    int64_t bytes() {
+        int64_t n;
+
+        n = 0;
+        if (stts_sample)
+            n += (int64_t) (stts_entries + 1) * (sizeof(uint32_t) + sizeof(uint64_t));
+
+        if (stsc_sample)
+            n += (int64_t) (stsc_entries + 1) * sizeof(uint32_t);
+
+        if (ctts_sample)
+            n += (int64_t) (ctts_entries + 1) * sizeof(uint32_t);
+
+        if (stss_sample)
+            n += (int64_t) (stss_entries + 1) * sizeof(uint32_t);
+
+        if (stsz_bytes)
+            n += (int64_t) ((stsz_entries >> MP4_STSZ_INDEX_SHIFT) + 1) * sizeof(uint64_t);
+
+        return n;
+    }
+
+public:
+    uint32_t stts_entries;
+    uint32_t *stts_sample;  // 每个 stts entry 的第一个 sample
+    uint64_t *stts_time;    // 每个 stts entry 第一个 sample 的解码时间
+
+    uint32_t stsc_entries;
+    uint32_t *stsc_sample;  // 每个 stsc entry 的第一个 sample
+
+    uint32_t ctts_entries;
+    uint32_t *ctts_sample;  // 每个 ctts entry 的第一个 sample
+
+    uint32_t stss_entries;
+    uint32_t *stss_sample;  // 首项为 0, 之后按表中顺序存关键帧 sample (从 1 开始)
+
+    uint32_t stsz_entries;
+    uint64_t *stsz_bytes;   // sample (k << MP4_STSZ_INDEX_SHIFT) 之前的字节数
 };
 
 class Mp4Trak {
@@ -526,7 +708,16 @@ public:
               stsc_pos(0),
               stsc_last(0),
               stsz_pos(0),
-              stsz_last(0)
+              stsz_last(0),
+              sample_size(0),
+              sample_field_size(32),
+              chunk_pos(0),
+              chunk_last(0),
+              req_sample(0),
+              seek_bytes(0),
+              out_bytes(0),
+              tkhd_layout(nullptr),
+              mdhd_layout(nullptr)
     {
         memset(&stsc_chunk_entry, 0, sizeof(mp4_stsc_entry));
     }
@@ -578,15 +769,29 @@ public:
 
     uint32_t stsz_pos;
     uint32_t stsz_last;
+    uint32_t sample_size;       // stsz 中所有 sample 相同时的大小, 此时没有 size 表
+    uint32_t sample_field_size; // 每个 size entry 的位数, stsz 为 32, stz2 为 4/8/16
+
+    uint32_t chunk_pos;  // stco, co64
+    uint32_t chunk_last;
+
+    uint32_t req_sample;  // 请求的 start 所在的 sample, 对齐到关键帧之前
+    uint64_t seek_bytes;  // [start_sample, req_sample) 的字节数, 即关键帧间隔导致多输出的部分
+    uint64_t out_bytes;   // 输出的 sample 的字节数
+
+    const Mp4HeaderLayout *tkhd_layout;
+    const Mp4HeaderLayout *mdhd_layout;
 
     BufferHandle atoms[MP4_LAST_ATOM + 1];
 
     mp4_stsc_entry stsc_chunk_entry;
+
+    Mp4SampleIndex index;
 };
 
 class Mp4Meta {
 public:
-    Mp4Meta()
+    Mp4Meta(Mp4Arena *a)
             : start(0),
               end(0),
               length(0),
@@ -596,60 +801,99 @@ public:
               meta_avail(0),
               wait_next(0),
               need_size(0),
+              arena(a),
+              trak_vec(nullptr),
+              trak_cap(0),
+              mvhd_layout(nullptr),
               rs(0),
               end_rs(0),
               rate(0),
               ftyp_size(0),
               moov_size(0),
+              src_moov_size(0),
+              seek_gop_bytes(0),
+              seek_interleave_bytes(0),
+              seek_mdat_bytes(0),
               start_pos(0),
               end_pos(0),
               timescale(0),
               trak_num(0),
               passed(0),
-              meta_complete(false) {
-        memset(trak_vec, 0, sizeof(trak_vec));
-        meta_buffer = TSIOBufferCreate();
-        meta_reader = TSIOBufferReaderAlloc(meta_buffer);
-        copy_buffer = TSIOBufferCreate();
-        copy_reader = TSIOBufferReaderAlloc(copy_buffer);
+              read_depth(0),
+              meta_budget(MP4_META_BUDGET),
+              meta_used(0),
+              work_budget(MP4_WORK_BUDGET),
+              work_done(0),
+              mdat_header_size(0),
+              meta_size(0),
+              adjustment(0),
+              write_stage(MP4_WRITE_HEADER),
+              write_trak(0),
+              write_atom(0),
+              write_entry(0),
+              write_reader(nullptr),
+              meta_complete(false),
+              rs_set(false),
+              parse_error(MP4_ERROR_NONE),
+              txn_id(0) {
+        meta_buffer = Mp4IOBufferCreate();
+        meta_reader = Mp4IOBufferReaderAlloc(meta_buffer);
     }
 
     ~Mp4Meta() {
         uint32_t i;
 
+        if (write_reader) {
+            Mp4IOBufferReaderFree(write_reader);
+            write_reader = nullptr;
+        }
+
+        // trak 和 trak_vec 的内存属于 arena, 这里只析构
         for (i = 0; i < trak_num; i++)
-            delete trak_vec[i];
+            trak_vec[i]->~Mp4Trak();
 
         if (meta_reader) {
-            TSIOBufferReaderFree(meta_reader);
+            Mp4IOBufferReaderFree(meta_reader);
             meta_reader = NULL;
         }
 
         if (meta_buffer) {
-            TSIOBufferDestroy(meta_buffer);
+            Mp4IOBufferDestroy(meta_buffer);
             meta_buffer = NULL;
         }
-
-        if (copy_reader) {
-            TSIOBufferReaderFree(copy_reader);
-            copy_reader = NULL;
-        }
-
-        if (copy_buffer) {
-            TSIOBufferDestroy(copy_buffer);
-            copy_buffer = NULL;
-        }
     }
 
     int parse_meta(bool body_complete);
 
+    int parse_meta_atoms(bool body_complete);
+
+    int64_t mp4_table_entries();
+
+    int64_t mp4_meta_bytes();
+
     int post_process_meta();
 
+    int mp4_start_meta(Mp4Trak **lead);
+
+    Mp4Trak *mp4_lead_trak();
+
+    int mp4_process_trak(Mp4Trak *trak);
+
+    int mp4_finish_meta();
+
     void mp4_meta_consume(int64_t size);
 
+    int mp4_meta_charge(int64_t size);
+
+    int mp4_meta_error(TSMp4ParseError err);
+
+    int mp4_meta_work(int64_t entries);
+
     int mp4_atom_next(int64_t atom_size, bool wait = false);
 
-    int mp4_read_atom(mp4_atom_handler *atom, int64_t size);
+    int mp4_read_atom();
+
+    int mp4_push_atom(mp4_atom_handler *atom, int64_t size);
 
     int parse_root_atoms();
 
@@ -695,6 +939,8 @@ public:
 
     int mp4_read_stsz_atom(int64_t header_size, int64_t data_size);
 
+    int mp4_read_stz2_atom(int64_t header_size, int64_t data_size);
+
     int mp4_read_stco_atom(int64_t header_size, int64_t data_size);
 
     int mp4_read_co64_atom(int64_t header_size, int64_t data_size);
@@ -723,9 +969,15 @@ public:
 
     int64_t mp4_update_mdat_atom(int64_t start_offset, int64_t end_offset);
 
-    int mp4_adjust_co64_atom(Mp4Trak *trak, off_t adjustment);
+    int64_t mp4_write_meta(int64_t size);
+
+    int64_t mp4_write_step();
+
+    bool mp4_table_slice(Mp4Trak *trak, uint32_t id, Mp4TableSlice *slice);
+
+    void mp4_trim_tables(Mp4Trak *trak);
 
-    int mp4_adjust_stco_atom(Mp4Trak *trak, int32_t adjustment);
+    int64_t mp4_write_table(Mp4IOBufferReader readerp, Mp4TableSlice *slice, uint32_t entries);
 
     uint32_t mp4_find_key_sample(uint32_t start_sample, Mp4Trak *trak);
 
@@ -743,6 +995,18 @@ public:
 
     int mp4_crop_ctts_data(Mp4Trak *trak, uint start);
 
+    int mp4_build_sample_index(Mp4Trak *trak);
+
+    uint64_t mp4_sample_bytes(Mp4Trak *trak, uint32_t sample);
+
+    uint64_t mp4_sample_time(Mp4Trak *trak, uint32_t sample);
+
+    uint32_t mp4_time_sample(Mp4Trak *trak, uint64_t time);
+
+    void mp4_seek_cost(int64_t start_offset, int64_t end_offset);
+
+    int mp4_crop_trak(Mp4Trak *trak);
+
 public:
     int64_t start;          // requested start time, measured in milliseconds.
     int64_t end;
@@ -751,11 +1015,9 @@ public:
     int64_t content_length; // the size of the new mp4 file
     int64_t meta_atom_size;
 
-    TSIOBuffer meta_buffer; // meta data to be parsed
-    TSIOBufferReader meta_reader;
+    Mp4IOBuffer meta_buffer; // meta data to be parsed
+    Mp4IOBufferReader meta_reader;
 
-    TSIOBuffer copy_buffer;
-    TSIOBufferReader copy_reader;
 
     int64_t meta_avail;
     int64_t wait_next;
@@ -769,22 +1031,52 @@ public:
     BufferHandle mdat_data;
     BufferHandle out_handle;
 
-    Mp4Trak *trak_vec[MP4_MAX_TRAK_NUM];
+    Mp4Arena *arena; // 事务的 arena, trak 从这里分配
+    Mp4Trak **trak_vec;
+    uint32_t trak_cap; // trak_vec 的容量
+    const Mp4HeaderLayout *mvhd_layout;
 
-    double rs; //丢弃了多少时间
+    double rs; //丢弃了多少时间, 即对齐到关键帧之后真正的起始时间(ms)
     double end_rs;
     double rate;
 
     int64_t ftyp_size;
     int64_t moov_size;
+    int64_t src_moov_size; // 原文件 moov 的大小
+
+    // 裁剪的代价: 输出的 mdat 中, 关键帧间隔导致请求时间之前多输出的字节, 以及不属于任何 trak 输出 sample 的字节(交错)
+    int64_t seek_gop_bytes;
+    int64_t seek_interleave_bytes;
+    int64_t seek_mdat_bytes; // 输出的 mdat 数据长度
     int64_t start_pos; // start position of the new mp4 file  新文件的起始位置
     int64_t end_pos; // end position of the new mp4 file
     uint32_t timescale;
     uint32_t trak_num;
     int64_t passed; //已经消费了多少字节
 
+    Mp4AtomFrame read_stack[MP4_MAX_ATOM_DEPTH]; // moov > trak > mdia > minf > stbl
+    uint32_t read_depth;
+
+    int64_t meta_budget; // 解析和裁剪 meta 最多可以占用的内存
+    std::atomic<int64_t> meta_used;   // 已经保留的 sample 表, 索引等占用的内存
+    int64_t work_budget; // 建索引时最多处理的表 entry 数
+    std::atomic<int64_t> work_done;
+
     u_char mdat_atom_header[16];
+    int64_t mdat_header_size;
+    int64_t meta_size;      // 新的 ftyp + moov + mdat header 的大小
+    off_t adjustment;       // chunk 偏移的调整量
+
+    TSMp4WriteStage write_stage;
+    uint32_t write_trak;
+    uint32_t write_atom;
+    uint32_t write_entry;
+    Mp4IOBufferReader write_reader; // 正在输出的 sample 表
+
     bool meta_complete;
+    bool rs_set; // rs 已由带关键帧的 trak 确定
+    std::atomic<TSMp4ParseError> parse_error; // 放弃裁剪的原因, 并行裁剪时多个线程都可能设置
+    uint64_t txn_id; // 事务 id, 只用作探针参数
 };
 
 #endif
\ No newline at end of file
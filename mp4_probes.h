@@ -0,0 +1,50 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef _MP4_PROBES_H
+#define _MP4_PROBES_H
+
+/*
+ * USDT 静态探针, provider 为 ts_mp4. 没有 attach 时只是一条 nop, 不需要打开 TSDebug,
+ * 线上可以直接用 bpftrace / perf 观察:
+ *   bpftrace -e 'usdt:/path/ts_mp4.so:ts_mp4:parse_end { @[arg1] = count(); }'
+ * 系统没有 <sys/sdt.h> (systemtap-sdt-dev) 或定义了 TS_MP4_NO_PROBES 时探针为空.
+ */
+#if !defined(TS_MP4_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TS_MP4_HAS_PROBES 1
+#endif
+#endif
+
+#ifdef TS_MP4_HAS_PROBES
+
+#define MP4_PROBE1(name, a1) DTRACE_PROBE1(ts_mp4, name, a1)
+#define MP4_PROBE2(name, a1, a2) DTRACE_PROBE2(ts_mp4, name, a1, a2)
+#define MP4_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(ts_mp4, name, a1, a2, a3)
+#define MP4_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(ts_mp4, name, a1, a2, a3, a4)
+
+#else
+
+#define MP4_PROBE1(name, a1)
+#define MP4_PROBE2(name, a1, a2)
+#define MP4_PROBE3(name, a1, a2, a3)
+#define MP4_PROBE4(name, a1, a2, a3, a4)
+
+#endif
+
+#endif
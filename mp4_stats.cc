@@ -0,0 +1,305 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp4_stats.h"
+
+static const char *mp4_stat_names[MP4_STAT_MAX] = {
+        "plugin.ts_mp4.work_budget_exceeded",
+        "plugin.ts_mp4.transforms",
+        "plugin.ts_mp4.transforms.cache_hit",
+        "plugin.ts_mp4.transforms.cache_miss",
+        "plugin.ts_mp4.transforms.active",
+        "plugin.ts_mp4.parse.success",
+        "plugin.ts_mp4.parse.failure.malformed",
+        "plugin.ts_mp4.parse.failure.moov_too_big",
+        "plugin.ts_mp4.parse.failure.cmov",
+        "plugin.ts_mp4.parse.failure.moov_after_mdat",
+        "plugin.ts_mp4.raw_passthrough",
+        "plugin.ts_mp4.range_206",
+        "plugin.ts_mp4.bytes_saved",
+        "plugin.ts_mp4.memory.current_bytes",
+        "plugin.ts_mp4.memory.peak_bytes",
+        "plugin.ts_mp4.memory.peak_count",
+        "plugin.ts_mp4.memory.peak_le_256k",
+        "plugin.ts_mp4.memory.peak_le_1m",
+        "plugin.ts_mp4.memory.peak_le_4m",
+        "plugin.ts_mp4.memory.peak_le_16m",
+        "plugin.ts_mp4.memory.peak_le_64m",
+        "plugin.ts_mp4.memory.peak_gt_64m",
+        "plugin.ts_mp4.seek.gop_bytes",
+        "plugin.ts_mp4.seek.interleave_bytes",
+        "plugin.ts_mp4.seek.mdat_bytes",
+};
+
+static int mp4_stat_ids[MP4_STAT_MAX];
+
+// MP4_STAT_MEM_PEAK_256K 开始每个区间的上限
+static const int64_t mp4_mem_peak_bounds[] = {256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024,
+                                              64 * 1024 * 1024};
+
+static const char *mp4_phase_names[MP4_PHASE_MAX] = {"wait_moov", "parse", "crop", "first_byte"};
+
+// 最后一个是累计耗时
+static const char *mp4_latency_names[MP4_LATENCY_BUCKETS + 1] = {"le_1ms", "le_10ms", "le_100ms", "le_1s", "gt_1s",
+                                                                  "total_us"};
+
+static const TSHRTime mp4_latency_bounds[MP4_LATENCY_BUCKETS - 1] = {1000000, 10000000, 100000000, 1000000000};
+
+static int mp4_latency_ids[MP4_PHASE_MAX][MP4_LATENCY_BUCKETS + 1];
+
+static TSMutex mp4_mem_top_mutex;
+static int64_t mp4_mem_top[MP4_MEM_TOP_NUM]; // 这个周期内最大的内存峰值, 不排序
+static TSHRTime mp4_mem_top_start;           // 这个周期的开始时间
+
+// 一个文件在一个周期内累计的裁剪代价
+typedef struct {
+    uint64_t hash;
+    int64_t requests;
+    int64_t gop_bytes;
+    int64_t interleave_bytes;
+    int64_t mdat_bytes;
+    int url_len;
+    char url[MP4_SEEK_URL_LEN];
+} Mp4SeekObject;
+
+// 两张表轮流使用, 请求累加到 mp4_seek_active 这张, 另一张由 mp4_stat_seek_flush 在锁外输出
+static TSMutex mp4_seek_mutex;
+static int mp4_seek_active;
+static Mp4SeekObject mp4_seek_objects[2][MP4_SEEK_OBJECT_NUM];
+
+static int
+mp4_stat_create(const char *name) {
+    int id;
+
+    if (TSStatFindName(name, &id) == TS_ERROR) {
+        id = TSStatCreate(name, TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+    }
+
+    return id;
+}
+
+void
+mp4_stats_init() {
+    int i, j;
+    char name[128];
+
+    for (i = 0; i < MP4_STAT_MAX; i++) {
+        mp4_stat_ids[i] = mp4_stat_create(mp4_stat_names[i]);
+    }
+
+    for (i = 0; i < MP4_PHASE_MAX; i++) {
+        for (j = 0; j <= MP4_LATENCY_BUCKETS; j++) {
+            snprintf(name, sizeof(name), "plugin.ts_mp4.latency.%s.%s", mp4_phase_names[i], mp4_latency_names[j]);
+            mp4_latency_ids[i][j] = mp4_stat_create(name);
+        }
+    }
+
+    if (mp4_mem_top_mutex == nullptr) {
+        mp4_mem_top_mutex = TSMutexCreate();
+    }
+
+    if (mp4_seek_mutex == nullptr) {
+        mp4_seek_mutex = TSMutexCreate();
+    }
+}
+
+void
+mp4_stat_increment(TSMp4StatID id, int64_t n) {
+    if (mp4_stat_ids[id] >= 0) {
+        TSStatIntIncrement(mp4_stat_ids[id], n);
+    }
+}
+
+void
+mp4_stat_decrement(TSMp4StatID id, int64_t n) {
+    if (mp4_stat_ids[id] >= 0) {
+        TSStatIntDecrement(mp4_stat_ids[id], n);
+    }
+}
+
+/*
+ * 记录一个请求的内存峰值. 返回 true 表示进入了这个周期的前 MP4_MEM_TOP_NUM 名, 由调用者写日志.
+ * 每 MP4_MEM_TOP_PERIOD 秒清空一次, 否则早先的几个大峰值会让之后的请求再也进不了前几名
+ */
+bool
+mp4_stat_memory_peak(int64_t peak) {
+    int i, k, min;
+    bool top;
+    TSHRTime now;
+
+    mp4_stat_increment(MP4_STAT_MEM_PEAK_BYTES, peak);
+    mp4_stat_increment(MP4_STAT_MEM_PEAK_COUNT, 1);
+
+    for (i = 0; i < (int) (sizeof(mp4_mem_peak_bounds) / sizeof(mp4_mem_peak_bounds[0])); i++) {
+        if (peak <= mp4_mem_peak_bounds[i]) {
+            break;
+        }
+    }
+
+    mp4_stat_increment((TSMp4StatID) (MP4_STAT_MEM_PEAK_256K + i), 1);
+
+    now = TShrtime();
+
+    TSMutexLock(mp4_mem_top_mutex);
+
+    if (now - mp4_mem_top_start >= (TSHRTime) MP4_MEM_TOP_PERIOD * 1000000000) {
+        memset(mp4_mem_top, 0, sizeof(mp4_mem_top));
+        mp4_mem_top_start = now;
+    }
+
+    min = 0;
+    for (k = 1; k < MP4_MEM_TOP_NUM; k++) {
+        if (mp4_mem_top[k] < mp4_mem_top[min]) {
+            min = k;
+        }
+    }
+
+    top = peak > mp4_mem_top[min];
+    if (top) {
+        mp4_mem_top[min] = peak;
+    }
+
+    TSMutexUnlock(mp4_mem_top_mutex);
+
+    return top;
+}
+
+/*
+ * 记录一个阶段的耗时(ns)
+ */
+void
+mp4_stat_latency(TSMp4Phase phase, TSHRTime elapsed) {
+    int i;
+
+    for (i = 0; i < MP4_LATENCY_BUCKETS - 1; i++) {
+        if (elapsed <= mp4_latency_bounds[i]) {
+            break;
+        }
+    }
+
+    if (mp4_latency_ids[phase][i] >= 0) {
+        TSStatIntIncrement(mp4_latency_ids[phase][i], 1);
+    }
+
+    if (mp4_latency_ids[phase][MP4_LATENCY_BUCKETS] >= 0) {
+        TSStatIntIncrement(mp4_latency_ids[phase][MP4_LATENCY_BUCKETS], elapsed / 1000);
+    }
+}
+
+/*
+ * 把一个请求的裁剪代价累加到 url 对应的文件. 表里的文件在周期内不会单独删除, 空的位置都在末尾
+ */
+void
+mp4_stat_seek_object(const char *url, int len, int64_t gop, int64_t interleave, int64_t mdat) {
+    int i, min;
+    uint64_t hash;
+    Mp4SeekObject *table, *obj;
+
+    if (len > MP4_SEEK_URL_LEN) {
+        len = MP4_SEEK_URL_LEN;
+    }
+
+    hash = 14695981039346656037ULL; // FNV-1a
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (u_char) url[i]) * 1099511628211ULL;
+    }
+
+    TSMutexLock(mp4_seek_mutex);
+
+    table = mp4_seek_objects[mp4_seek_active];
+    obj = nullptr;
+    min = 0;
+
+    for (i = 0; i < MP4_SEEK_OBJECT_NUM; i++) {
+        if (table[i].requests == 0) {
+            obj = &table[i];
+            break;
+        }
+
+        if (table[i].hash == hash && table[i].url_len == len && memcmp(table[i].url, url, len) == 0) {
+            obj = &table[i];
+            break;
+        }
+
+        if (table[i].gop_bytes + table[i].interleave_bytes < table[min].gop_bytes + table[min].interleave_bytes) {
+            min = i;
+        }
+    }
+
+    if (obj == nullptr && gop + interleave > table[min].gop_bytes + table[min].interleave_bytes) {
+        obj = &table[min]; // 表满了, 替换累计代价最小的文件
+        obj->requests = 0;
+    }
+
+    if (obj != nullptr) {
+        if (obj->requests == 0) {
+            memset(obj, 0, sizeof(Mp4SeekObject));
+            obj->hash = hash;
+            obj->url_len = len;
+            memcpy(obj->url, url, len);
+        }
+
+        obj->requests++;
+        obj->gop_bytes += gop;
+        obj->interleave_bytes += interleave;
+        obj->mdat_bytes += mdat;
+    }
+
+    TSMutexUnlock(mp4_seek_mutex);
+}
+
+static int
+mp4_seek_object_cmp(const void *a, const void *b) {
+    const Mp4SeekObject *x = (const Mp4SeekObject *) a;
+    const Mp4SeekObject *y = (const Mp4SeekObject *) b;
+    int64_t cx = x->gop_bytes + x->interleave_bytes;
+    int64_t cy = y->gop_bytes + y->interleave_bytes;
+
+    return cx < cy ? 1 : (cx > cy ? -1 : 0);
+}
+
+/*
+ * 切换到另一张表, 把这个周期累计的文件按代价从大到小写入日志并清空
+ */
+void
+mp4_stat_seek_flush(TSTextLogObject log) {
+    int i, n;
+    Mp4SeekObject *table;
+
+    TSMutexLock(mp4_seek_mutex);
+    table = mp4_seek_objects[mp4_seek_active];
+    mp4_seek_active ^= 1;
+    TSMutexUnlock(mp4_seek_mutex);
+
+    for (n = 0; n < MP4_SEEK_OBJECT_NUM && table[n].requests > 0; n++) {
+    }
+
+    qsort(table, n, sizeof(Mp4SeekObject), mp4_seek_object_cmp);
+
+    for (i = 0; i < n; i++) {
+        TSTextLogObjectWrite(log, "requests=%" PRId64 " gop_bytes=%" PRId64 " interleave_bytes=%" PRId64
+                                  " mdat_bytes=%" PRId64 " url=%.*s",
+                             table[i].requests, table[i].gop_bytes, table[i].interleave_bytes, table[i].mdat_bytes,
+                             table[i].url_len, table[i].url);
+    }
+
+    memset(table, 0, n * sizeof(Mp4SeekObject));
+}
@@ -0,0 +1,83 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef _MP4_STATS_H
+#define _MP4_STATS_H
+
+#include <inttypes.h>
+
+#include <ts/ts.h>
+
+#define MP4_MEM_TOP_NUM 16 // 记录内存峰值最大的请求个数, 新进入的请求写入 diags.log
+#define MP4_MEM_TOP_PERIOD 3600 // 秒, 每个周期重新统计内存峰值的前 MP4_MEM_TOP_NUM 名
+#define MP4_LATENCY_BUCKETS 5 // 每个阶段耗时的区间: <=1ms, <=10ms, <=100ms, <=1s, >1s
+#define MP4_SEEK_OBJECT_NUM 256 // 每个周期按文件累计裁剪代价的文件数, 满了之后替换代价最小的
+#define MP4_SEEK_URL_LEN 256
+
+typedef enum {
+    MP4_STAT_WORK_EXCEEDED = 0, // 超出 work budget, 按原文件输出的请求数
+    MP4_STAT_TRANSFORMS,        // 加了 transform 的请求数
+    MP4_STAT_TRANSFORMS_CACHE_HIT,
+    MP4_STAT_TRANSFORMS_CACHE_MISS,
+    MP4_STAT_TRANSFORMS_ACTIVE, // 进行中的 transform
+    MP4_STAT_PARSE_SUCCESS,
+    MP4_STAT_PARSE_MALFORMED,   // 解析失败, 按原因分别计数
+    MP4_STAT_PARSE_META_BUDGET,
+    MP4_STAT_PARSE_CMOV,
+    MP4_STAT_PARSE_MOOV_AFTER_MDAT,
+    MP4_STAT_RAW_PASSTHROUGH,   // 解析失败后按原文件输出
+    MP4_STAT_RANGE_206,
+    MP4_STAT_BYTES_SAVED,       // 源站 Content-Length 与实际输出长度之差的累加
+    MP4_STAT_MEM_CURRENT,       // 所有进行中的请求当前占用的内存
+    MP4_STAT_MEM_PEAK_BYTES,    // 每个请求内存峰值的累加, 除以 count 得到平均值
+    MP4_STAT_MEM_PEAK_COUNT,
+    MP4_STAT_MEM_PEAK_256K,     // 内存峰值的分布, 每个区间一个计数
+    MP4_STAT_MEM_PEAK_1M,
+    MP4_STAT_MEM_PEAK_4M,
+    MP4_STAT_MEM_PEAK_16M,
+    MP4_STAT_MEM_PEAK_64M,
+    MP4_STAT_MEM_PEAK_INF,
+    MP4_STAT_SEEK_GOP_BYTES,        // 起点对齐到关键帧, 在请求时间之前多输出的字节
+    MP4_STAT_SEEK_INTERLEAVE_BYTES, // 输出的 mdat 中不属于任何 trak 输出 sample 的字节
+    MP4_STAT_SEEK_MDAT_BYTES,       // 裁剪后 mdat 的字节
+    MP4_STAT_MAX
+} TSMp4StatID;
+
+// 请求处理的各个阶段, 每个阶段有一组耗时区间的计数和累计耗时(us)
+typedef enum {
+    MP4_PHASE_WAIT_MOOV = 0, // 收到第一个字节到 moov 读完, 主要是源站或缓存的速度
+    MP4_PHASE_PARSE,         // parse_meta_atoms 的累计 CPU 时间
+    MP4_PHASE_CROP,          // 裁剪(post_process_meta), 包括在 task 线程队列里等待和并行裁剪
+    MP4_PHASE_FIRST_BYTE,    // 收到第一个字节到输出第一个字节
+    MP4_PHASE_MAX
+} TSMp4Phase;
+
+void mp4_stats_init();
+
+void mp4_stat_increment(TSMp4StatID id, int64_t n);
+
+void mp4_stat_decrement(TSMp4StatID id, int64_t n);
+
+bool mp4_stat_memory_peak(int64_t peak);
+
+void mp4_stat_latency(TSMp4Phase phase, TSHRTime elapsed);
+
+void mp4_stat_seek_object(const char *url, int len, int64_t gop, int64_t interleave, int64_t mdat);
+
+void mp4_stat_seek_flush(TSTextLogObject log);
+
+#endif
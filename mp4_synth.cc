@@ -0,0 +1,296 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#include <algorithm>
+
+#include "mp4_synth.h"
+
+static void
+mp4_synth_write_sizes(Mp4SynthWriter *w, const Mp4SynthTrak *t) {
+    uint32_t i;
+
+    if (t->field_size == 32) {
+        w->begin_full("stsz", 0);
+        if (t->uniform) {
+            w->put32(t->sizes[0]);
+            w->put32(t->samples);
+
+        } else {
+            w->put32(0);
+            w->put32(t->samples);
+            for (i = 0; i < t->samples; i++) {
+                w->put32(t->sizes[i]);
+            }
+        }
+        w->end();
+        return;
+    }
+
+    w->begin_full("stz2", 0);
+    w->put32(t->field_size); // reserved(24 bits), field size(8 bits)
+    w->put32(t->samples);
+
+    for (i = 0; i < t->samples; i++) {
+        if (t->field_size == 4) {
+            if (i & 1) {
+                w->data.back() |= (u_char) t->sizes[i];
+
+            } else {
+                w->put8(t->sizes[i] << 4);
+            }
+
+        } else if (t->field_size == 8) {
+            w->put8(t->sizes[i]);
+
+        } else {
+            w->put16(t->sizes[i]);
+        }
+    }
+    w->end();
+}
+
+static void
+mp4_synth_write_trak(Mp4SynthWriter *w, const Mp4SynthTrak *t, bool co64) {
+    uint32_t i, c, n, runs, prev;
+    uint64_t duration;
+    size_t pos;
+
+    duration = (uint64_t) t->samples * t->delta;
+
+    w->begin("trak");
+
+    w->begin_full("tkhd", 0);
+    w->put32(0);
+    w->put32(0);
+    w->put32(t->id);
+    w->put32(0);
+    w->put32((uint32_t) (duration * 1000 / t->timescale));
+    w->zero(60);
+    w->end();
+
+    w->begin("mdia");
+
+    w->begin_full("mdhd", 0);
+    w->put32(0);
+    w->put32(0);
+    w->put32(t->timescale);
+    w->put32((uint32_t) duration);
+    w->put32(0x55c40000);
+    w->end();
+
+    w->begin_full("hdlr", 0);
+    w->put32(0);
+    w->put_name(t->video ? "vide" : "soun");
+    w->zero(14);
+    w->end();
+
+    w->begin("minf");
+
+    if (t->video) {
+        w->begin_full("vmhd", 1);
+        w->zero(8);
+        w->end();
+
+    } else {
+        w->begin_full("smhd", 0);
+        w->zero(4);
+        w->end();
+    }
+
+    w->begin("dinf");
+    w->begin_full("dref", 0);
+    w->put32(1);
+    w->begin_full("url ", 1);
+    w->end();
+    w->end();
+    w->end();
+
+    w->begin("stbl");
+
+    w->begin_full("stsd", 0);
+    w->put32(0);
+    w->end();
+
+    w->begin_full("stts", 0);
+    w->put32(1);
+    w->put32(t->samples);
+    w->put32(t->delta);
+    w->end();
+
+    if (t->gop) {
+        w->begin_full("stss", 0);
+        w->put32((t->samples + t->gop - 1) / t->gop);
+        for (i = 0; i < t->samples; i += t->gop) {
+            w->put32(i + 1);
+        }
+        w->end();
+    }
+
+    // 相同的连续 composition offset 合并成一个 run
+    if (!t->ctts.empty()) {
+        w->begin_full("ctts", 0);
+        pos = w->data.size();
+        w->put32(0);
+        runs = 0;
+        prev = 0;
+        for (i = 0, n = 0; i < t->samples; i++) {
+            if (n > 0 && t->ctts[i] != prev) {
+                w->put32(n);
+                w->put32(prev);
+                runs++;
+                n = 0;
+            }
+
+            prev = t->ctts[i];
+            n++;
+        }
+        w->put32(n);
+        w->put32(prev);
+        mp4_set_32value(&w->data[pos], runs + 1);
+        w->end();
+    }
+
+    w->begin_full("stsc", 0);
+    pos = w->data.size();
+    w->put32(0);
+    runs = 0;
+    for (c = 0, prev = 0; c < t->chunk_first.size(); c++) {
+        n = (c + 1 < t->chunk_first.size() ? t->chunk_first[c + 1] : t->samples) - t->chunk_first[c];
+        if (n != prev) {
+            w->put32(c + 1);
+            w->put32(n);
+            w->put32(1);
+            runs++;
+            prev = n;
+        }
+    }
+    mp4_set_32value(&w->data[pos], runs);
+    w->end();
+
+    mp4_synth_write_sizes(w, t);
+
+    w->begin_full(co64 ? "co64" : "stco", 0);
+    w->put32(t->chunk_offset.size());
+    for (c = 0; c < t->chunk_offset.size(); c++) {
+        if (co64) {
+            w->put64(t->chunk_offset[c]);
+
+        } else {
+            w->put32((uint32_t) t->chunk_offset[c]);
+        }
+    }
+    w->end();
+
+    w->end(); // stbl
+    w->end(); // minf
+    w->end(); // mdia
+    w->end(); // trak
+}
+
+uint64_t
+mp4_synth_generate(std::vector<Mp4SynthTrak> *traks, uint32_t duration, bool co64, std::vector<u_char> *out,
+                   int64_t *moov_size) {
+    int pass;
+    uint32_t i, c, j;
+    uint64_t mdat_size, data_start;
+    size_t ftyp_size;
+    Mp4SynthWriter w;
+    std::vector<std::pair<double, std::pair<uint32_t, uint32_t>>> order;
+
+    for (i = 0; i < traks->size(); i++) {
+        Mp4SynthTrak &t = (*traks)[i];
+
+        t.chunk_first.clear();
+        for (j = 0, c = 0; j < t.samples; j += t.chunk_samples(c), c++) {
+            t.chunk_first.push_back(j);
+            order.push_back(std::make_pair((double) j * t.delta / t.timescale, std::make_pair(i, c)));
+        }
+
+        t.chunk_offset.resize(t.chunk_first.size());
+        t.sample_offset.resize(t.samples);
+    }
+
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<double, std::pair<uint32_t, uint32_t>> &a,
+                        const std::pair<double, std::pair<uint32_t, uint32_t>> &b) { return a.first < b.first; });
+
+    // 先按 mdat 数据从 0 开始排好 chunk, moov 大小确定后再整体加上 mdat 数据的起点
+    mdat_size = 0;
+    for (auto &o : order) {
+        Mp4SynthTrak &t = (*traks)[o.second.first];
+        c = o.second.second;
+
+        t.chunk_offset[c] = mdat_size;
+        for (j = t.chunk_first[c]; j < t.samples && j < t.chunk_first[c] + t.chunk_samples(c); j++) {
+            t.sample_offset[j] = mdat_size;
+            mdat_size += t.size(j);
+        }
+    }
+
+    ftyp_size = 0;
+    for (pass = 0; pass < 2; pass++) {
+        w.data.clear();
+
+        w.begin("ftyp");
+        w.put_name("isom");
+        w.put32(512);
+        w.data.insert(w.data.end(), "isomiso2mp41", "isomiso2mp41" + 12);
+        w.end();
+
+        ftyp_size = w.data.size();
+        w.begin("moov");
+
+        w.begin_full("mvhd", 0);
+        w.put32(0);
+        w.put32(0);
+        w.put32(1000);
+        w.put32(duration * 1000);
+        w.put32(0x10000);
+        w.put32(0x01000000);
+        w.zero(8 + 36 + 24);
+        w.put32(traks->size() + 1);
+        w.end();
+
+        for (i = 0; i < traks->size(); i++) {
+            mp4_synth_write_trak(&w, &(*traks)[i], co64);
+        }
+
+        w.end();
+
+        if (pass == 0) {
+            // chunk 偏移的宽度不随数值变化, 第二遍的 moov 大小和第一遍相同
+            data_start = w.data.size() + sizeof(mp4_atom_header);
+            for (auto &t : *traks) {
+                for (auto &off : t.chunk_offset) {
+                    off += data_start;
+                }
+
+                for (auto &off : t.sample_offset) {
+                    off += data_start;
+                }
+            }
+        }
+    }
+
+    *moov_size = w.data.size() - ftyp_size;
+
+    w.put32(mdat_size + sizeof(mp4_atom_header));
+    w.put_name("mdat");
+
+    out->swap(w.data);
+    return mdat_size;
+}
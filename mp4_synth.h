@@ -0,0 +1,132 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef _MP4_SYNTH_H
+#define _MP4_SYNTH_H
+
+/*
+ * 生成 mp4 语料, 供 mp4perf 和 mp4test 使用, 只在独立编译时存在.
+ * 调用方决定每个 trak 的 sample 大小, 关键帧间隔, ctts 和 stsz/stz2,
+ * 这里负责 chunk 的交错布局和 ftyp + moov + mdat header 的写出.
+ */
+
+#include <vector>
+
+#include "mp4_meta.h"
+
+/*
+ * 按 box 嵌套写出 mp4, begin/end 成对调用, end 时回填 size
+ */
+class Mp4SynthWriter {
+public:
+    void begin(const char *name) {
+        stack.push_back(data.size());
+        put32(0);
+        put_name(name);
+    }
+
+    void begin_full(const char *name, uint32_t version_flags) {
+        begin(name);
+        put32(version_flags);
+    }
+
+    void end() {
+        mp4_set_32value(&data[stack.back()], data.size() - stack.back());
+        stack.pop_back();
+    }
+
+    void put_name(const char *name) {
+        data.insert(data.end(), name, name + 4);
+    }
+
+    void put8(uint32_t n) {
+        data.push_back((u_char) n);
+    }
+
+    void put16(uint32_t n) {
+        put8(n >> 8);
+        put8(n);
+    }
+
+    void put32(uint32_t n) {
+        u_char buf[4];
+
+        mp4_set_32value(buf, n);
+        data.insert(data.end(), buf, buf + 4);
+    }
+
+    void put64(uint64_t n) {
+        put32((uint32_t) (n >> 32));
+        put32((uint32_t) n);
+    }
+
+    void zero(size_t n) {
+        data.insert(data.end(), n, 0);
+    }
+
+public:
+    std::vector<u_char> data;
+    std::vector<size_t> stack;
+};
+
+/*
+ * 一个 trak 的 sample 和 chunk 布局, chunk 按开始时间和其他 trak 交错存放.
+ * 视频 12800/512(25fps), chunk 5~7 个 sample; 音频 44100/1024, chunk 开头 10 个之后 20 个 sample
+ */
+class Mp4SynthTrak {
+public:
+    Mp4SynthTrak(uint32_t i, bool v, uint32_t n, uint32_t g)
+            : id(i), video(v), timescale(v ? 12800 : 44100), delta(v ? 512 : 1024), samples(n), gop(g),
+              field_size(32), uniform(false) {}
+
+    uint32_t chunk_samples(uint32_t c) const {
+        return video ? 5 + c % 3 : (c < 3 ? 10 : 20);
+    }
+
+    bool key(uint32_t i) const {
+        return gop && i % gop == 0;
+    }
+
+    uint32_t size(uint32_t i) const {
+        return uniform ? sizes[0] : sizes[i];
+    }
+
+public:
+    uint32_t id;
+    bool video;
+    uint32_t timescale;
+    uint32_t delta;
+    uint32_t samples;
+    uint32_t gop;        // 每 gop 个 sample 一个关键帧, 0 表示没有 stss
+    uint32_t field_size; // sample size 的位数: 32 为 stsz, 4/8/16 为 stz2
+    bool uniform;        // 所有 sample 大小都是 sizes[0], stsz 没有表
+    std::vector<uint32_t> sizes;
+    std::vector<uint32_t> ctts;        // 每个 sample 的 composition offset, 为空时不写 ctts
+    std::vector<uint32_t> chunk_first; // 每个 chunk 的第一个 sample
+    std::vector<uint64_t> chunk_offset;
+    std::vector<uint64_t> sample_offset;
+};
+
+/*
+ * 按 traks 的 sizes 排好 chunk, 写出 ftyp + moov + mdat header 到 out, duration 为秒.
+ * 填好每个 trak 的 chunk_offset 和 sample_offset(文件中的绝对位置), 返回 mdat 数据的大小,
+ * moov 的大小放在 moov_size
+ */
+uint64_t mp4_synth_generate(std::vector<Mp4SynthTrak> *traks, uint32_t duration, bool co64, std::vector<u_char> *out,
+                            int64_t *moov_size);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+/*
+ * mp4bench: sample 表热点函数的微基准(Google Benchmark), 修改这些函数前后各跑一次对比:
+ *   mp4bench --benchmark_filter=reader_get --benchmark_repetitions=5
+ * 每个基准的两个参数: 表的 entry 数, 以及 buffer 的 block 大小(mp4_mem_block_size),
+ * 4K/32K/2M 对应 TSIOBuffer 中常见的碎片程度.
+ */
+
+#include <time.h>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "mp4_meta.h"
+
+#define MP4BENCH_TIMESCALE 1000
+#define MP4BENCH_STRIDE 7919 // 随机读写时 entry 序号的步长, 和 entry 数互质
+
+/*
+ * 只有一个 trak 的 meta, 各张表都有 entries 个 entry, 通过和解析时相同的 mp4_read_*_atom 读入:
+ *   stts: count 1~4, duration 40/41
+ *   stss: sample 1, 3, 5, ...
+ *   stsc: 每个 entry 一个 chunk, chunk 内 1~4 个 sample, 和 stts 的 sample 数相同
+ *   stsz: 所有 sample 大小相同, 没有表
+ *   stco 或 co64: 每个 chunk 一个偏移
+ */
+class Mp4BenchMeta {
+public:
+    Mp4BenchMeta(uint32_t n, bool co64) : entries(n), samples(0), duration(0) {
+        uint32_t i;
+        uint64_t offset;
+        std::vector<u_char> atom;
+
+        arena = Mp4Arena::create();
+        mm = arena->make<Mp4Meta>(arena);
+        mm->meta_budget = INT64_MAX;
+        mm->work_budget = INT64_MAX;
+
+        for (i = 0; i < entries; i++) {
+            samples += 1 + i % 4;
+            duration += (uint64_t) (1 + i % 4) * (40 + i % 2);
+        }
+
+        begin(&atom, "trak");
+        read(&atom, &Mp4Meta::mp4_read_trak_atom, 0);
+
+        trak = mm->trak_vec[0];
+        trak->timescale = MP4BENCH_TIMESCALE;
+
+        begin(&atom, "stts");
+        put32(&atom, 0);
+        put32(&atom, entries);
+        for (i = 0; i < entries; i++) {
+            put32(&atom, 1 + i % 4);
+            put32(&atom, 40 + i % 2);
+        }
+        read(&atom, &Mp4Meta::mp4_read_stts_atom);
+
+        begin(&atom, "stss");
+        put32(&atom, 0);
+        put32(&atom, entries);
+        for (i = 0; i < entries; i++) {
+            put32(&atom, 1 + i * 2);
+        }
+        read(&atom, &Mp4Meta::mp4_read_stss_atom);
+
+        begin(&atom, "stsc");
+        put32(&atom, 0);
+        put32(&atom, entries);
+        for (i = 0; i < entries; i++) {
+            stsc_entry(&atom, i);
+        }
+        read(&atom, &Mp4Meta::mp4_read_stsc_atom);
+
+        begin(&atom, "stsz");
+        put32(&atom, 0);
+        put32(&atom, 1000);
+        put32(&atom, samples);
+        read(&atom, &Mp4Meta::mp4_read_stsz_atom);
+
+        begin(&atom, co64 ? "co64" : "stco");
+        put32(&atom, 0);
+        put32(&atom, entries);
+        for (i = 0, offset = 4096; i < entries; i++) {
+            if (co64) {
+                put32(&atom, (uint32_t) (offset >> 32));
+            }
+
+            put32(&atom, (uint32_t) offset);
+            offset += (uint64_t) (1 + i % 4) * 1000;
+        }
+        read(&atom, co64 ? &Mp4Meta::mp4_read_co64_atom : &Mp4Meta::mp4_read_stco_atom);
+
+        if (mm->mp4_build_sample_index(trak) != 0) {
+            abort();
+        }
+
+        mm->out_handle.buffer = Mp4IOBufferCreate();
+        mm->out_handle.reader = Mp4IOBufferReaderAlloc(mm->out_handle.buffer);
+    }
+
+    ~Mp4BenchMeta() {
+        mm->~Mp4Meta();
+        Mp4Arena::destroy(arena);
+    }
+
+    // stsc 第 i 个 entry 的原始内容, 裁剪 stsc 之后用来恢复
+    static void stsc_entry(std::vector<u_char> *atom, uint32_t i) {
+        put32(atom, i + 1);
+        put32(atom, 1 + i % 4);
+        put32(atom, 1);
+    }
+
+    static void put32(std::vector<u_char> *atom, uint32_t n) {
+        u_char buf[4];
+
+        mp4_set_32value(buf, n);
+        atom->insert(atom->end(), buf, buf + 4);
+    }
+
+private:
+    static void begin(std::vector<u_char> *atom, const char *name) {
+        atom->clear();
+        put32(atom, 0);
+        atom->insert(atom->end(), name, name + 4);
+    }
+
+    // 把 atom 交给对应的 mp4_read_*_atom, 和解析时一样从 meta_reader 读取
+    void read(std::vector<u_char> *atom, Mp4AtomHandler handler, int64_t data_size = -1) {
+        mp4_set_32value(atom->data(), atom->size());
+        Mp4IOBufferWrite(mm->meta_buffer, atom->data(), atom->size());
+        mm->meta_avail = Mp4IOBufferReaderAvail(mm->meta_reader);
+        mm->cl += atom->size();
+
+        if ((mm->*handler)(sizeof(mp4_atom_header),
+                           data_size < 0 ? atom->size() - sizeof(mp4_atom_header) : data_size) != 1) {
+            abort();
+        }
+    }
+
+public:
+    Mp4Arena *arena;
+    Mp4Meta *mm;
+    Mp4Trak *trak;
+    uint32_t entries;
+    uint32_t samples;  // 所有 sample 的个数
+    uint64_t duration; // 总时长(ms)
+};
+
+static int64_t
+mp4bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * 按 slice 输出整张表, 和 mp4_write_step 一样每次 MP4_INDEX_READ_ENTRIES 个 entry, 输出的数据随即丢弃
+ */
+static void
+mp4bench_write_table(Mp4BenchMeta *bm, uint32_t id, Mp4TableSlice *slice) {
+    uint32_t e, k;
+    int64_t n;
+    Mp4IOBufferReader readerp;
+
+    readerp = Mp4IOBufferReaderClone(bm->trak->atoms[id].reader);
+    Mp4IOBufferReaderConsume(readerp, (int64_t) slice->pos * slice->entry_size);
+
+    for (e = slice->pos; e < slice->last; e += k) {
+        k = slice->last - e < MP4_INDEX_READ_ENTRIES ? slice->last - e : MP4_INDEX_READ_ENTRIES;
+        n = bm->mm->mp4_write_table(readerp, slice, k);
+        if (n < 0) {
+            abort();
+        }
+
+        Mp4IOBufferReaderConsume(bm->mm->out_handle.reader, n);
+    }
+
+    Mp4IOBufferReaderFree(readerp);
+}
+
+static void
+BM_reader_get_32value(benchmark::State &state) {
+    uint32_t k;
+    Mp4IOBufferReader readerp;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    readerp = bm.trak->atoms[MP4_STCO_DATA].reader;
+    k = 0;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(mp4_reader_get_32value(readerp, (int64_t) k * sizeof(uint32_t)));
+        k = (k + MP4BENCH_STRIDE) % bm.entries;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void
+BM_reader_set_32value(benchmark::State &state) {
+    uint32_t k;
+    Mp4IOBufferReader readerp;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    readerp = bm.trak->atoms[MP4_STCO_DATA].reader;
+    k = 0;
+
+    for (auto _ : state) {
+        mp4_reader_set_32value(readerp, (int64_t) k * sizeof(uint32_t), k);
+        k = (k + MP4BENCH_STRIDE) % bm.entries;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+/*
+ * 和 mp4_build_sample_index 一样, 每次拷贝 MP4_INDEX_READ_ENTRIES 个 stsc entry, 读完整张表
+ */
+static void
+BM_reader_copy(benchmark::State &state) {
+    int64_t n, total;
+    u_char buf[MP4_INDEX_READ_ENTRIES * sizeof(mp4_stsc_entry)];
+    Mp4IOBufferReader readerp;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    total = 0;
+
+    for (auto _ : state) {
+        readerp = Mp4IOBufferReaderClone(bm.trak->atoms[MP4_STSC_DATA].reader);
+
+        while ((n = IOBufferReaderCopy(readerp, buf, sizeof(buf))) > 0) {
+            benchmark::DoNotOptimize(buf);
+            Mp4IOBufferReaderConsume(readerp, n);
+            total += n;
+        }
+
+        Mp4IOBufferReaderFree(readerp);
+    }
+
+    state.SetBytesProcessed(total);
+}
+
+// chunk 偏移加上 adjustment
+static void
+BM_adjust_stco(benchmark::State &state) {
+    Mp4TableSlice slice;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    bm.trak->chunk_pos = 0;
+    bm.trak->chunk_last = bm.entries;
+    bm.mm->adjustment = -4096;
+    bm.mm->mp4_table_slice(bm.trak, MP4_STCO_DATA, &slice);
+
+    for (auto _ : state) {
+        mp4bench_write_table(&bm, MP4_STCO_DATA, &slice);
+    }
+
+    state.SetItemsProcessed(state.iterations() * bm.entries);
+}
+
+static void
+BM_adjust_co64(benchmark::State &state) {
+    Mp4TableSlice slice;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), true);
+    bm.trak->chunk_pos = 0;
+    bm.trak->chunk_last = bm.entries;
+    bm.mm->adjustment = -4096;
+    bm.mm->mp4_table_slice(bm.trak, MP4_CO64_DATA, &slice);
+
+    for (auto _ : state) {
+        mp4bench_write_table(&bm, MP4_CO64_DATA, &slice);
+    }
+
+    state.SetItemsProcessed(state.iterations() * bm.entries);
+}
+
+// 关键帧的 sample 序号减去 start_sample
+static void
+BM_renumber_stss(benchmark::State &state) {
+    Mp4TableSlice slice;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    bm.trak->start_sample = 1;
+    bm.mm->mp4_table_slice(bm.trak, MP4_STSS_DATA, &slice);
+
+    for (auto _ : state) {
+        mp4bench_write_table(&bm, MP4_STSS_DATA, &slice);
+    }
+
+    state.SetItemsProcessed(state.iterations() * bm.entries);
+}
+
+/*
+ * 从中点开始裁剪 1/4 的时长: 查找 start/end 所在的 run, 退到关键帧, 改写边界 entry.
+ * 改写的值只由索引决定, 重复执行结果相同
+ */
+static void
+BM_crop_stts(benchmark::State &state) {
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    bm.mm->start = bm.duration / 2;
+    bm.mm->length = bm.duration / 4;
+
+    for (auto _ : state) {
+        bm.mm->rs_set = false;
+        if (bm.mm->mp4_crop_stts_data(bm.trak, 1) != 0 || bm.mm->mp4_crop_stts_data(bm.trak, 0) != 0) {
+            abort();
+        }
+    }
+}
+
+/*
+ * 裁剪 stsc 会改写边界 entry 并生成新的首尾 entry, 每次裁剪之后(不计时)恢复原来的表
+ */
+static void
+BM_crop_stsc(benchmark::State &state) {
+    uint32_t i, e[3];
+    int64_t t0;
+    std::vector<u_char> entry;
+    Mp4IOBufferReader readerp;
+    Mp4Trak *trak;
+
+    mp4_mem_block_size = state.range(1);
+    Mp4BenchMeta bm(state.range(0), false);
+    bm.mm->start = bm.duration / 2;
+    bm.mm->length = bm.duration / 4;
+    if (bm.mm->mp4_crop_stts_data(bm.trak, 1) != 0 || bm.mm->mp4_crop_stts_data(bm.trak, 0) != 0) {
+        abort();
+    }
+
+    trak = bm.trak;
+
+    for (auto _ : state) {
+        t0 = mp4bench_now();
+        if (bm.mm->mp4_crop_stsc_data(trak, 1) != 0 || bm.mm->mp4_crop_stsc_data(trak, 0) != 0) {
+            abort();
+        }
+        state.SetIterationTime((mp4bench_now() - t0) / 1e9);
+
+        e[0] = trak->stsc_pos;
+        e[1] = trak->stsc_last - 1;
+        e[2] = trak->stsc_last;
+
+        for (i = 0; i < 3; i++) {
+            if (e[i] >= bm.entries) {
+                continue;
+            }
+
+            entry.clear();
+            Mp4BenchMeta::stsc_entry(&entry, e[i]);
+
+            readerp = Mp4IOBufferReaderClone(trak->atoms[MP4_STSC_DATA].reader);
+            Mp4IOBufferReaderConsume(readerp, (int64_t) e[i] * sizeof(mp4_stsc_entry));
+            mp4_reader_set_32value(readerp, offsetof(mp4_stsc_entry, chunk), mp4_get_32value(&entry[0]));
+            mp4_reader_set_32value(readerp, offsetof(mp4_stsc_entry, samples), mp4_get_32value(&entry[4]));
+            mp4_reader_set_32value(readerp, offsetof(mp4_stsc_entry, id), mp4_get_32value(&entry[8]));
+            Mp4IOBufferReaderFree(readerp);
+        }
+
+        trak->atoms[MP4_STSC_CHUNK_START].clear();
+        trak->atoms[MP4_STSC_CHUNK_END].clear();
+        trak->stsc_pos = 0;
+        trak->stsc_last = bm.entries;
+        trak->sample_to_chunk_entries = bm.entries;
+    }
+}
+
+// entry 数 x block 大小
+#define MP4BENCH_ARGS ArgsProduct({{1 << 10, 1 << 15, 1 << 20}, {4 << 10, 32 << 10, 2 << 20}})
+
+BENCHMARK(BM_reader_get_32value)->MP4BENCH_ARGS;
+BENCHMARK(BM_reader_set_32value)->MP4BENCH_ARGS;
+BENCHMARK(BM_reader_copy)->MP4BENCH_ARGS;
+BENCHMARK(BM_adjust_stco)->MP4BENCH_ARGS;
+BENCHMARK(BM_adjust_co64)->MP4BENCH_ARGS;
+BENCHMARK(BM_renumber_stss)->MP4BENCH_ARGS;
+BENCHMARK(BM_crop_stts)->MP4BENCH_ARGS;
+BENCHMARK(BM_crop_stsc)->MP4BENCH_ARGS->UseManualTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,457 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+/*
+ * mp4clip: 对本地文件执行和插件相同的解析, 裁剪, 生成 meta 的流程.
+ *   mp4clip in.mp4 --start 120 --end 180 -o out.mp4
+ * 用于预先生成热门片段, 脱离 ATS 复现问题, 以及作为 perf record 的目标.
+ *   --stats     输出 moov, 表, 内存, 裁剪代价和各阶段耗时
+ *   --repeat N  重复执行 N 次(只有第一次写输出文件), 输出各阶段耗时的 min/avg/max
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mp4_meta.h"
+
+#define MP4CLIP_READ_SIZE (64 * 1024) // 和插件一样按块喂给 parse_meta
+#define MP4CLIP_COPY_SIZE (1024 * 1024)
+
+typedef enum {
+    MP4CLIP_PHASE_PARSE = 0, // 读文件并解析到 moov 结束
+    MP4CLIP_PHASE_CROP,      // post_process_meta
+    MP4CLIP_PHASE_META,      // 生成新的 meta
+    MP4CLIP_PHASE_BODY,      // 拷贝 mdat 数据
+    MP4CLIP_PHASE_MAX
+} Mp4ClipPhase;
+
+static const char *mp4clip_phase_names[MP4CLIP_PHASE_MAX] = {"parse", "crop", "meta", "body"};
+
+typedef struct {
+    double start;
+    double end;
+    int64_t meta_budget;
+    int64_t work_budget;
+    const char *input;
+    const char *output;
+    bool stats;
+    int repeat;
+} Mp4ClipOptions;
+
+typedef struct {
+    int64_t phase_ns[MP4CLIP_PHASE_MAX];
+    int64_t out_bytes;
+} Mp4ClipResult;
+
+static int64_t
+mp4clip_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+mp4clip_parse_size(const char *str, int64_t *size) {
+    int64_t n;
+    char *ptr;
+
+    n = strtoll(str, &ptr, 10);
+
+    switch (*ptr) {
+        case 'k':
+        case 'K':
+            n <<= 10;
+            ptr++;
+            break;
+
+        case 'm':
+        case 'M':
+            n <<= 20;
+            ptr++;
+            break;
+
+        case 'g':
+        case 'G':
+            n <<= 30;
+            ptr++;
+            break;
+
+        default:
+            break;
+    }
+
+    if (*ptr != '\0' || n <= 0) {
+        return false;
+    }
+
+    *size = n;
+    return true;
+}
+
+static int
+mp4clip_write(int fd, const char *buf, int64_t length) {
+    ssize_t n;
+
+    while (length > 0) {
+        n = write(fd, buf, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * 把 reader 中的数据全部写到 fd(fd < 0 时丢弃), 返回写出的字节数, -1 表示出错
+ */
+static int64_t
+mp4clip_drain(Mp4IOBufferReader readerp, int fd) {
+    int64_t avail, total;
+    const char *start;
+    Mp4IOBufferBlock blk;
+
+    total = 0;
+    blk = Mp4IOBufferReaderStart(readerp);
+
+    while (blk) {
+        start = Mp4IOBufferBlockReadStart(blk, readerp, &avail);
+        if (avail > 0 && fd >= 0 && mp4clip_write(fd, start, avail) != 0) {
+            return -1;
+        }
+
+        total += avail;
+        blk = Mp4IOBufferBlockNext(blk);
+    }
+
+    Mp4IOBufferReaderConsume(readerp, total);
+    return total;
+}
+
+/*
+ * 拷贝输入文件 [start, end) 的数据到 fd
+ */
+static int64_t
+mp4clip_copy_body(int in, int out, int64_t start, int64_t end) {
+    int64_t total;
+    ssize_t n;
+    char *buf;
+
+    buf = (char *) malloc(MP4CLIP_COPY_SIZE);
+    total = 0;
+
+    while (start + total < end) {
+        n = pread(in, buf, end - start - total < MP4CLIP_COPY_SIZE ? end - start - total : MP4CLIP_COPY_SIZE,
+                  start + total);
+        if (n <= 0 || mp4clip_write(out, buf, n) != 0) {
+            free(buf);
+            return -1;
+        }
+
+        total += n;
+    }
+
+    free(buf);
+    return total;
+}
+
+static void
+mp4clip_print_stats(const Mp4ClipOptions *opts, Mp4Meta *mm, const Mp4ClipResult *res) {
+    uint32_t i;
+    Mp4Trak *trak;
+
+    printf("input=%s start=%.3f end=%.3f cl=%" PRId64 "\n", opts->input, opts->start, opts->end, mm->cl);
+    printf("moov=%" PRId64 " traks=%u table_entries=%" PRId64 " meta_bytes=%" PRId64 "\n", mm->src_moov_size,
+           mm->trak_num, mm->mp4_table_entries(), mm->mp4_meta_bytes());
+
+    // 和慢请求日志一样: stts/stss/ctts/stsc/stsz/stco 的 entry 数
+    for (i = 0; i < mm->trak_num; i++) {
+        trak = mm->trak_vec[i];
+        printf("trak[%u] entries=%u/%u/%u/%u/%u/%u start_sample=%u end_sample=%u seek_bytes=%" PRIu64
+               " out_bytes=%" PRIu64 "\n", i, trak->time_to_sample_entries, trak->sync_samples_entries,
+               trak->composition_offset_entries, trak->sample_to_chunk_entries, trak->sample_sizes_entries,
+               trak->chunks, trak->start_sample, trak->end_sample, trak->seek_bytes, trak->out_bytes);
+    }
+
+    printf("meta_size=%" PRId64 " start_pos=%" PRId64 " end_pos=%" PRId64 " content_length=%" PRId64 "\n",
+           mm->meta_size, mm->start_pos, mm->end_pos, mm->content_length);
+    printf("gop_bytes=%" PRId64 " interleave_bytes=%" PRId64 " mdat_bytes=%" PRId64 "\n", mm->seek_gop_bytes,
+           mm->seek_interleave_bytes, mm->seek_mdat_bytes);
+
+    for (i = 0; i < MP4CLIP_PHASE_MAX; i++) {
+        printf("%s_us=%" PRId64 "%s", mp4clip_phase_names[i], res->phase_ns[i] / 1000,
+               i + 1 < MP4CLIP_PHASE_MAX ? " " : "\n");
+    }
+
+    printf("out=%" PRId64 "\n", res->out_bytes);
+}
+
+/*
+ * 执行一次完整的流程. out < 0 时只生成 meta, 不拷贝 body
+ *  -1: error
+ *   0: success
+ */
+static int
+mp4clip_run(const Mp4ClipOptions *opts, int in, int64_t cl, int out, Mp4ClipResult *res) {
+    int ret;
+    int64_t pos, n, meta, end;
+    int64_t t0, t1;
+    char *buf;
+    Mp4Arena *arena;
+    Mp4Meta *mm;
+
+    memset(res, 0, sizeof(Mp4ClipResult));
+
+    arena = Mp4Arena::create();
+    mm = arena->make<Mp4Meta>(arena);
+
+    mm->start = opts->start * 1000;
+    mm->end = opts->end * 1000;
+    if (mm->end > 0 && mm->end > mm->start) {
+        mm->length = mm->end - mm->start;
+    }
+    mm->cl = cl;
+    mm->meta_budget = opts->meta_budget;
+    mm->work_budget = opts->work_budget;
+
+    buf = (char *) malloc(MP4CLIP_READ_SIZE);
+    ret = 0;
+    pos = 0;
+
+    // 和插件一样边读边解析, 读到 moov 结束为止
+    t0 = mp4clip_now();
+    while (ret == 0 && pos < cl) {
+        n = pread(in, buf, MP4CLIP_READ_SIZE, pos);
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+
+        Mp4IOBufferWrite(mm->meta_buffer, buf, n);
+        pos += n;
+        ret = mm->parse_meta_atoms(pos >= cl);
+    }
+    t1 = mp4clip_now();
+    res->phase_ns[MP4CLIP_PHASE_PARSE] = t1 - t0;
+
+    free(buf);
+
+    if (ret > 0) {
+        ret = mm->post_process_meta() == 0 ? 1 : -1;
+        t0 = t1;
+        t1 = mp4clip_now();
+        res->phase_ns[MP4CLIP_PHASE_CROP] = t1 - t0;
+    }
+
+    if (ret <= 0) {
+        fprintf(stderr, "mp4clip: %s: can't clip, %s\n", opts->input,
+                mp4_parse_error_name(mm->parse_error == MP4_ERROR_NONE ? MP4_ERROR_MALFORMED : mm->parse_error.load()));
+        goto failed;
+    }
+
+    t0 = t1;
+    do {
+        meta = mm->mp4_write_meta(MP4_META_WRITE_SIZE);
+        if (meta < 0 || (n = mp4clip_drain(mm->out_handle.reader, out)) < 0) {
+            fprintf(stderr, "mp4clip: failed to write meta: %s\n", meta < 0 ? "mp4_write_meta" : strerror(errno));
+            goto failed;
+        }
+
+        res->out_bytes += n;
+    } while (meta > 0);
+    t1 = mp4clip_now();
+    res->phase_ns[MP4CLIP_PHASE_META] = t1 - t0;
+
+    if (out >= 0) {
+        end = mm->end_pos > 0 ? mm->end_pos : cl;
+        t0 = t1;
+        if ((n = mp4clip_copy_body(in, out, mm->start_pos, end)) < 0) {
+            fprintf(stderr, "mp4clip: failed to copy body: %s\n", strerror(errno));
+            goto failed;
+        }
+        res->phase_ns[MP4CLIP_PHASE_BODY] = mp4clip_now() - t0;
+        res->out_bytes += n;
+    }
+
+    if (opts->stats) {
+        mp4clip_print_stats(opts, mm, res);
+    }
+
+    mm->~Mp4Meta();
+    Mp4Arena::destroy(arena);
+    return 0;
+
+failed:
+    mm->~Mp4Meta();
+    Mp4Arena::destroy(arena);
+    return -1;
+}
+
+static void
+mp4clip_usage() {
+    fprintf(stderr, "usage: mp4clip <in.mp4> [--start <sec>] [--end <sec>] [-o <out.mp4>] [--stats] [--repeat <n>]\n"
+                    "               [--meta-budget <bytes>[K|M|G]] [--work-budget <entries>[K|M|G]] [--debug]\n");
+}
+
+int
+main(int argc, char **argv) {
+    int c, i, k, in, out;
+    int64_t cl, sum, min, max;
+    Mp4ClipOptions opts;
+    Mp4ClipResult res, *runs;
+
+    static struct option long_options[] = {{"start", required_argument, nullptr, 's'},
+                                           {"end", required_argument, nullptr, 'e'},
+                                           {"output", required_argument, nullptr, 'o'},
+                                           {"stats", no_argument, nullptr, 'S'},
+                                           {"repeat", required_argument, nullptr, 'r'},
+                                           {"meta-budget", required_argument, nullptr, 'M'},
+                                           {"work-budget", required_argument, nullptr, 'W'},
+                                           {"debug", no_argument, nullptr, 'd'},
+                                           {"help", no_argument, nullptr, 'h'},
+                                           {nullptr, 0, nullptr, 0}};
+
+    memset(&opts, 0, sizeof(opts));
+    opts.meta_budget = MP4_META_BUDGET;
+    opts.work_budget = MP4_WORK_BUDGET;
+    opts.repeat = 1;
+
+    while ((c = getopt_long(argc, argv, "s:e:o:r:h", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 's':
+                opts.start = atof(optarg);
+                break;
+
+            case 'e':
+                opts.end = atof(optarg);
+                break;
+
+            case 'o':
+                opts.output = optarg;
+                break;
+
+            case 'S':
+                opts.stats = true;
+                break;
+
+            case 'r':
+                opts.repeat = atoi(optarg);
+                break;
+
+            case 'M':
+                if (!mp4clip_parse_size(optarg, &opts.meta_budget)) {
+                    fprintf(stderr, "mp4clip: invalid --meta-budget %s\n", optarg);
+                    return 2;
+                }
+                break;
+
+            case 'W':
+                if (!mp4clip_parse_size(optarg, &opts.work_budget)) {
+                    fprintf(stderr, "mp4clip: invalid --work-budget %s\n", optarg);
+                    return 2;
+                }
+                break;
+
+            case 'd':
+                mp4_debug_enabled = true;
+                break;
+
+            default:
+                mp4clip_usage();
+                return 2;
+        }
+    }
+
+    if (optind != argc - 1 || opts.repeat <= 0 || opts.start < 0 || opts.end < 0 ||
+        (opts.end > 0 && opts.end <= opts.start)) {
+        mp4clip_usage();
+        return 2;
+    }
+
+    opts.input = argv[optind];
+
+    in = open(opts.input, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "mp4clip: %s: %s\n", opts.input, strerror(errno));
+        return 1;
+    }
+
+    cl = lseek(in, 0, SEEK_END);
+
+    out = -1;
+    if (opts.output) {
+        out = open(opts.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "mp4clip: %s: %s\n", opts.output, strerror(errno));
+            close(in);
+            return 1;
+        }
+    }
+
+    runs = (Mp4ClipResult *) calloc(opts.repeat, sizeof(Mp4ClipResult));
+
+    for (i = 0; i < opts.repeat; i++) {
+        if (mp4clip_run(&opts, in, cl, i == 0 ? out : -1, &runs[i]) != 0) {
+            free(runs);
+            close(in);
+            if (out >= 0) {
+                close(out);
+                unlink(opts.output);
+            }
+            return 1;
+        }
+
+        opts.stats = false; // 只输出第一次的详细信息
+    }
+
+    if (opts.repeat > 1) {
+        printf("repeat=%d\n", opts.repeat);
+
+        // body 只在第一次拷贝, 不计入
+        for (k = 0; k < MP4CLIP_PHASE_BODY; k++) {
+            sum = 0;
+            min = max = runs[0].phase_ns[k];
+
+            for (i = 0; i < opts.repeat; i++) {
+                res = runs[i];
+                sum += res.phase_ns[k];
+                min = res.phase_ns[k] < min ? res.phase_ns[k] : min;
+                max = res.phase_ns[k] > max ? res.phase_ns[k] : max;
+            }
+
+            printf("%s_us min=%" PRId64 " avg=%" PRId64 " max=%" PRId64 "\n", mp4clip_phase_names[k], min / 1000,
+                   sum / opts.repeat / 1000, max / 1000);
+        }
+    }
+
+    free(runs);
+    close(in);
+    if (out >= 0) {
+        close(out);
+    }
+
+    return 0;
+}
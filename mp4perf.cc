@@ -0,0 +1,264 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+/*
+ * mp4perf: 在生成的 mp4 语料上测 meta 路径的端到端吞吐, 每个请求包括
+ * parse_meta(true)(解析 moov, 建索引, 裁剪)和 mp4_write_meta(生成新的 meta).
+ * 语料覆盖 时长(1min~6h) x trak 个数 x stco/co64 x stsz 相同/不同大小 x 起点, 每种配置输出
+ * p50/p99 延迟, 单核每秒请求数和每秒处理的 moov MB 数:
+ *   mp4perf
+ *   mp4perf --filter 3600s --iterations 500
+ * 只生成 moov, mdat 的数据不生成, cl 按 mdat 的实际大小计算.
+ */
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "mp4_synth.h"
+
+#define MP4PERF_ITERATIONS 100
+#define MP4PERF_GOP 50 // 视频每 50 个 sample(2s)一个关键帧
+
+typedef struct {
+    int duration;  // 秒
+    int traks;     // 1 个视频, 其余为音频
+    bool co64;
+    bool uniform;  // stsz 中所有 sample 大小相同
+    double seek;   // 起点在时长中的位置
+} Mp4PerfConfig;
+
+static const int mp4perf_durations[] = {60, 600, 3600, 6 * 3600};
+static const int mp4perf_traks[] = {1, 2, 4};
+static const double mp4perf_seeks[] = {0.1, 0.5, 0.9};
+static const uint32_t mp4perf_ctts[] = {0, 1024, 512, 0};
+
+static int64_t
+mp4perf_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+mp4perf_config_name(const Mp4PerfConfig *conf, char *buf, size_t size) {
+    snprintf(buf, size, "%ds/%dtrak/%s/%s/seek%.1f", conf->duration, conf->traks, conf->co64 ? "co64" : "stco",
+             conf->uniform ? "uniform" : "var", conf->seek);
+}
+
+/*
+ * 生成 ftyp + moov + mdat header, 返回整个文件(含 mdat 数据)的大小, moov 的大小放在 moov_size
+ */
+static int64_t
+mp4perf_generate(const Mp4PerfConfig *conf, std::vector<u_char> *out, int64_t *moov_size) {
+    int i;
+    uint32_t j, seed;
+    uint64_t mdat_size;
+    std::vector<Mp4SynthTrak> traks;
+
+    for (i = 0; i < conf->traks; i++) {
+        traks.push_back(i == 0 ? Mp4SynthTrak(1, true, conf->duration * 25, MP4PERF_GOP)
+                               : Mp4SynthTrak(i + 1, false, (uint32_t) ((int64_t) conf->duration * 44100 / 1024), 0));
+    }
+
+    // sample 大小: 视频关键帧 16K~24K, 其余 2K~4K, 音频 200~400; 6 小时 4 个 trak 的 mdat 也不超过 4G
+    seed = 1;
+    for (i = 0; i < conf->traks; i++) {
+        Mp4SynthTrak &t = traks[i];
+
+        if (conf->uniform) {
+            t.uniform = true;
+            t.sizes.push_back(t.video ? 3000 : 300);
+
+        } else {
+            t.sizes.resize(t.samples);
+            for (j = 0; j < t.samples; j++) {
+                seed = seed * 1103515245 + 12345;
+                t.sizes[j] = t.key(j) ? 16384 + (seed >> 8) % 8192
+                                      : (t.video ? 2048 + (seed >> 8) % 2048 : 200 + (seed >> 8) % 200);
+            }
+        }
+
+        // B 帧的 composition offset
+        if (t.video) {
+            t.ctts.resize(t.samples);
+            for (j = 0; j < t.samples; j++) {
+                t.ctts[j] = j % 7 ? mp4perf_ctts[j % 4] : 2048;
+            }
+        }
+    }
+
+    mdat_size = mp4_synth_generate(&traks, conf->duration, conf->co64, out, moov_size);
+    return out->size() + mdat_size;
+}
+
+/*
+ * 执行一次请求, 返回耗时(ns), -1 表示失败
+ */
+static int64_t
+mp4perf_request(const Mp4PerfConfig *conf, const std::vector<u_char> &file, int64_t cl, TSMp4ParseError *err) {
+    int ret;
+    int64_t t0, t1;
+    int64_t n = 0;
+    Mp4Arena *arena;
+    Mp4Meta *mm;
+
+    arena = Mp4Arena::create();
+    mm = arena->make<Mp4Meta>(arena);
+
+    mm->start = (int64_t) (conf->seek * conf->duration * 1000);
+    mm->cl = cl;
+    mm->meta_budget = INT64_MAX;
+    mm->work_budget = INT64_MAX;
+
+    // moov 在插件里也是先到达 meta_buffer 再解析, 写入不计时
+    Mp4IOBufferWrite(mm->meta_buffer, file.data(), file.size());
+
+    t0 = mp4perf_now();
+    ret = mm->parse_meta(true);
+
+    while (ret > 0 && (n = mm->mp4_write_meta(MP4_META_WRITE_SIZE)) > 0) {
+        Mp4IOBufferReaderConsume(mm->out_handle.reader, n);
+    }
+    t1 = mp4perf_now();
+
+    if (ret <= 0 || n < 0) {
+        *err = mm->parse_error == MP4_ERROR_NONE ? MP4_ERROR_MALFORMED : mm->parse_error.load();
+    }
+
+    mm->~Mp4Meta();
+    Mp4Arena::destroy(arena);
+
+    return ret > 0 && n == 0 ? t1 - t0 : -1;
+}
+
+static void
+mp4perf_usage() {
+    fprintf(stderr, "usage: mp4perf [--iterations <n>] [--filter <substring>] [--block-size <bytes>] [--debug]\n");
+}
+
+int
+main(int argc, char **argv) {
+    int c, iterations;
+    size_t i, d, t, k, s, m;
+    int64_t cl, moov, ns, sum;
+    double mean;
+    char name[64];
+    const char *filter;
+    Mp4PerfConfig conf;
+    TSMp4ParseError err;
+    std::vector<u_char> file;
+    std::vector<int64_t> samples;
+
+    static struct option long_options[] = {{"iterations", required_argument, nullptr, 'n'},
+                                           {"filter", required_argument, nullptr, 'f'},
+                                           {"block-size", required_argument, nullptr, 'b'},
+                                           {"debug", no_argument, nullptr, 'd'},
+                                           {"help", no_argument, nullptr, 'h'},
+                                           {nullptr, 0, nullptr, 0}};
+
+    iterations = MP4PERF_ITERATIONS;
+    filter = nullptr;
+
+    while ((c = getopt_long(argc, argv, "n:f:h", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+
+            case 'f':
+                filter = optarg;
+                break;
+
+            case 'b':
+                mp4_mem_block_size = atoll(optarg);
+                break;
+
+            case 'd':
+                mp4_debug_enabled = true;
+                break;
+
+            default:
+                mp4perf_usage();
+                return 2;
+        }
+    }
+
+    if (optind != argc || iterations <= 0 || mp4_mem_block_size < 0) {
+        mp4perf_usage();
+        return 2;
+    }
+
+    printf("%-36s %10s %10s %10s %10s %10s\n", "config", "moov", "p50_us", "p99_us", "req/s", "moov_MB/s");
+
+    for (d = 0; d < sizeof(mp4perf_durations) / sizeof(mp4perf_durations[0]); d++) {
+        for (t = 0; t < sizeof(mp4perf_traks) / sizeof(mp4perf_traks[0]); t++) {
+            for (k = 0; k < 4; k++) {
+                for (s = 0; s < sizeof(mp4perf_seeks) / sizeof(mp4perf_seeks[0]); s++) {
+                    conf.duration = mp4perf_durations[d];
+                    conf.traks = mp4perf_traks[t];
+                    conf.co64 = k & 1;
+                    conf.uniform = k & 2;
+                    conf.seek = mp4perf_seeks[s];
+
+                    mp4perf_config_name(&conf, name, sizeof(name));
+                    if (filter && strstr(name, filter) == nullptr) {
+                        continue;
+                    }
+
+                    cl = mp4perf_generate(&conf, &file, &moov);
+                    samples.clear();
+                    err = MP4_ERROR_NONE;
+
+                    // 第一次不计入, 让 arena 的空闲块和 malloc 进入稳定状态
+                    for (m = 0; m <= (size_t) iterations; m++) {
+                        ns = mp4perf_request(&conf, file, cl, &err);
+                        if (ns < 0) {
+                            break;
+                        }
+
+                        if (m > 0) {
+                            samples.push_back(ns);
+                        }
+                    }
+
+                    if (ns < 0) {
+                        printf("%-36s %10" PRId64 " failed: %s\n", name, moov, mp4_parse_error_name(err));
+                        continue;
+                    }
+
+                    std::sort(samples.begin(), samples.end());
+
+                    sum = 0;
+                    for (i = 0; i < samples.size(); i++) {
+                        sum += samples[i];
+                    }
+                    mean = (double) sum / samples.size();
+
+                    printf("%-36s %10" PRId64 " %10.1f %10.1f %10.1f %10.1f\n", name, moov,
+                           samples[(samples.size() - 1) * 50 / 100] / 1e3,
+                           samples[(samples.size() - 1) * 99 / 100] / 1e3, 1e9 / mean,
+                           moov / mean * 1e9 / (1 << 20));
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
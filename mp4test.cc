@@ -0,0 +1,606 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+  http://www.apache.org/licenses/LICENSE-2.0
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+/*
+ * mp4test: 在生成的 mp4 上执行和插件相同的裁剪, 检查输出是否正确, 由 ctest 运行.
+ * 每个 sample 的数据以 (trak id << 24 | sample 序号) 开头, 对 stsz/stz2 x stco/co64 的每种组合和一组起止时间检查:
+ *   - stts, stsz/stz2, stsc(按 stco/co64 的 chunk 数展开) 得到的 sample 数相同, ctts 覆盖全部 sample
+ *   - 带 stss 的 trak 从关键帧开始(stss[0] == 1), 输出的关键帧和原文件一致
+ *   - chunk 中的每个 sample 都落在 mdat 的数据里, mdat 在最后一个输出的 sample 处结束
+ *   - 每个 trak 输出的 sample 和原文件中一段连续的 sample 逐字节相同
+ *   - stz2 4 位 entry 从奇数 sample 开始(输出整体移半个字节)时同样满足以上各项
+ * 全部通过返回 0, 否则输出失败的 case 并返回 1.
+ */
+
+#include <stdarg.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "mp4_synth.h"
+
+#define MP4TEST_READ_SIZE 4096 // 小块喂给 parse_meta_atoms, 覆盖 box 跨块的情况
+#define MP4TEST_DURATION 20    // 秒
+#define MP4TEST_GOP 25         // 视频每 25 个 sample(1s)一个关键帧
+
+typedef struct {
+    const char *name;
+    uint32_t field_size; // 视频 trak 的 sample size 位数: 32 为 stsz, 4/8/16 为 stz2
+    bool co64;
+    bool uniform;        // 音频 trak 的 sample 大小相同, stsz 没有表
+} Mp4TestConfig;
+
+static const Mp4TestConfig mp4test_configs[] = {
+        {"stsz/stco", 32, false, false},
+        {"stsz/co64", 32, true, false},
+        {"stsz/stco/uniform", 32, false, true},
+        {"stz2-4/stco", 4, false, false},
+        {"stz2-8/co64", 8, true, false},
+        {"stz2-16/stco", 16, false, true},
+};
+
+// 起点落在关键帧(每 25 个 sample)前后, 1s, 3s 对应奇数 sample
+static const double mp4test_starts[] = {0, 0.5, 1, 3.04, 7.5, 10, 19.5};
+static const double mp4test_lengths[] = {0, 4};
+static const int64_t mp4test_block_sizes[] = {0, 7};
+
+// 输出中一个 trak 的 sample 表
+typedef struct {
+    uint32_t id;
+    uint32_t stts_samples;
+    uint32_t ctts_samples;
+    bool has_ctts;
+    bool has_stss;
+    std::vector<uint32_t> stss;
+    std::vector<uint32_t> stsc; // first chunk, samples per chunk 交替存放
+    std::vector<uint32_t> sizes;
+    std::vector<uint64_t> chunks;
+} Mp4TestOutTrak;
+
+static std::string mp4test_case;
+
+static bool
+mp4test_fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static bool
+mp4test_fail(const char *fmt, ...) {
+    va_list args;
+
+    fprintf(stderr, "FAIL %s: ", mp4test_case.c_str());
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+
+    return false;
+}
+
+/*
+ * 生成 ftyp + moov + mdat, 1 个视频 trak 和 1 个音频 trak, 每个 sample 的数据以标记开头
+ */
+static void
+mp4test_generate(const Mp4TestConfig *conf, std::vector<u_char> *file, std::vector<Mp4SynthTrak> *traks) {
+    uint32_t j, k, seed;
+    uint64_t mdat_size;
+    int64_t moov_size;
+
+    traks->clear();
+    traks->push_back(Mp4SynthTrak(1, true, MP4TEST_DURATION * 25, MP4TEST_GOP));
+    traks->push_back(Mp4SynthTrak(2, false, MP4TEST_DURATION * 44100 / 1024, 0));
+
+    (*traks)[0].field_size = conf->field_size;
+    (*traks)[1].field_size = conf->field_size == 16 ? 16 : 32;
+
+    // sample 至少 4 字节放得下标记, 不超过 field size 能表示的范围
+    seed = 1;
+    for (auto &t : *traks) {
+        t.uniform = !t.video && conf->uniform && t.field_size == 32;
+        t.sizes.resize(t.samples);
+
+        for (j = 0; j < t.samples; j++) {
+            seed = seed * 1103515245 + 12345;
+
+            if (t.uniform) {
+                t.sizes[j] = 256;
+
+            } else if (t.field_size == 4) {
+                t.sizes[j] = 4 + (seed >> 8) % 12;
+
+            } else if (t.field_size == 8) {
+                t.sizes[j] = 4 + (seed >> 8) % 252;
+
+            } else {
+                t.sizes[j] = t.key(j) ? 500 + (seed >> 8) % 400 : (t.video ? 60 : 150) + (seed >> 8) % 200;
+            }
+        }
+
+        // B 帧的 composition offset, 每 3 个 sample 循环
+        if (t.video) {
+            t.ctts.resize(t.samples);
+            for (j = 0; j < t.samples; j++) {
+                t.ctts[j] = (j % 3) * t.delta;
+            }
+        }
+    }
+
+    mdat_size = mp4_synth_generate(traks, MP4TEST_DURATION, conf->co64, file, &moov_size);
+    file->resize(file->size() + mdat_size);
+
+    for (auto &t : *traks) {
+        for (j = 0; j < t.samples; j++) {
+            mp4_set_32value(&(*file)[t.sample_offset[j]], t.id << 24 | j);
+            for (k = 4; k < t.sizes[j]; k++) {
+                (*file)[t.sample_offset[j] + k] = (u_char) (j * 7 + k + t.id);
+            }
+        }
+    }
+}
+
+/*
+ * 和 mp4clip 相同的流程: 按块解析到 moov 结束, 裁剪, 生成新的 meta, 再接上 [start_pos, end_pos) 的数据.
+ * lead_start 返回第一个 trak 的起始 sample
+ */
+static bool
+mp4test_clip(const std::vector<u_char> &file, double start, double length, std::vector<u_char> *out,
+             uint32_t *lead_start) {
+    int ret;
+    int64_t pos, n, meta, end;
+    Mp4Arena *arena;
+    Mp4Meta *mm;
+
+    arena = Mp4Arena::create();
+    mm = arena->make<Mp4Meta>(arena);
+
+    mm->start = start * 1000;
+    mm->length = length * 1000;
+    mm->cl = file.size();
+
+    ret = 0;
+    pos = 0;
+
+    while (ret == 0 && pos < (int64_t) file.size()) {
+        n = std::min((int64_t) MP4TEST_READ_SIZE, (int64_t) file.size() - pos);
+        Mp4IOBufferWrite(mm->meta_buffer, &file[pos], n);
+        pos += n;
+        ret = mm->parse_meta_atoms(pos >= (int64_t) file.size());
+    }
+
+    if (ret > 0) {
+        ret = mm->post_process_meta() == 0 ? 1 : -1;
+    }
+
+    if (ret <= 0) {
+        mp4test_fail("can't clip, %s",
+                     mp4_parse_error_name(mm->parse_error == MP4_ERROR_NONE ? MP4_ERROR_MALFORMED
+                                                                            : mm->parse_error.load()));
+        goto failed;
+    }
+
+    out->clear();
+
+    do {
+        meta = mm->mp4_write_meta(MP4_META_WRITE_SIZE);
+        if (meta < 0) {
+            mp4test_fail("mp4_write_meta failed");
+            goto failed;
+        }
+
+        n = Mp4IOBufferReaderAvail(mm->out_handle.reader);
+        out->resize(out->size() + n);
+        IOBufferReaderCopy(mm->out_handle.reader, &(*out)[out->size() - n], n);
+        Mp4IOBufferReaderConsume(mm->out_handle.reader, n);
+    } while (meta > 0);
+
+    if ((int64_t) out->size() != mm->meta_size) {
+        mp4test_fail("meta is %zu bytes, expected %" PRId64, out->size(), (int64_t) mm->meta_size);
+        goto failed;
+    }
+
+    end = mm->end_pos > 0 ? mm->end_pos : (int64_t) file.size();
+    out->insert(out->end(), file.begin() + mm->start_pos, file.begin() + end);
+
+    *lead_start = mm->trak_vec[0]->start_sample;
+
+    mm->~Mp4Meta();
+    Mp4Arena::destroy(arena);
+    return true;
+
+failed:
+    mm->~Mp4Meta();
+    Mp4Arena::destroy(arena);
+    return false;
+}
+
+/*
+ * 在 [start, end) 中找名字为 name 的 box, 返回 box 数据(header 之后)的范围
+ */
+static bool
+mp4test_find_box(const std::vector<u_char> &d, size_t start, size_t end, const char *name, size_t *body,
+                 size_t *body_end) {
+    uint64_t size;
+    size_t header;
+
+    while (start + sizeof(mp4_atom_header) <= end) {
+        size = mp4_get_32value(&d[start]);
+        header = sizeof(mp4_atom_header);
+
+        if (size == 1) {
+            size = mp4_get_64value(&d[start + 8]);
+            header = sizeof(mp4_atom_header64);
+
+        } else if (size == 0) {
+            size = end - start;
+        }
+
+        if (size < header || start + size > end) {
+            return false;
+        }
+
+        if (memcmp(&d[start + 4], name, 4) == 0) {
+            *body = start + header;
+            *body_end = start + size;
+            return true;
+        }
+
+        start += size;
+    }
+
+    return false;
+}
+
+static bool
+mp4test_read_trak(const std::vector<u_char> &d, size_t trak, size_t trak_end, Mp4TestOutTrak *t) {
+    uint32_t i, n, fs;
+    size_t p, e, mdia, mdia_end, minf, minf_end, stbl, stbl_end;
+
+    if (!mp4test_find_box(d, trak, trak_end, "tkhd", &p, &e) ||
+        !mp4test_find_box(d, trak, trak_end, "mdia", &mdia, &mdia_end) ||
+        !mp4test_find_box(d, mdia, mdia_end, "minf", &minf, &minf_end) ||
+        !mp4test_find_box(d, minf, minf_end, "stbl", &stbl, &stbl_end)) {
+        return mp4test_fail("trak without tkhd/mdia/minf/stbl");
+    }
+
+    t->id = mp4_get_32value(&d[p + offsetof(mp4_tkhd_atom, track_id) - sizeof(mp4_atom_header)]);
+
+    if (!mp4test_find_box(d, stbl, stbl_end, "stts", &p, &e)) {
+        return mp4test_fail("trak %u: no stts", t->id);
+    }
+
+    n = mp4_get_32value(&d[p + 4]);
+    if (p + 8 + (size_t) n * 8 != e) {
+        return mp4test_fail("trak %u: stts has %u entries in %zu bytes", t->id, n, e - p);
+    }
+
+    t->stts_samples = 0;
+    for (i = 0; i < n; i++) {
+        t->stts_samples += mp4_get_32value(&d[p + 8 + i * 8]);
+    }
+
+    t->has_ctts = mp4test_find_box(d, stbl, stbl_end, "ctts", &p, &e);
+    t->ctts_samples = 0;
+    if (t->has_ctts) {
+        n = mp4_get_32value(&d[p + 4]);
+        if (p + 8 + (size_t) n * 8 != e) {
+            return mp4test_fail("trak %u: ctts has %u entries in %zu bytes", t->id, n, e - p);
+        }
+
+        for (i = 0; i < n; i++) {
+            t->ctts_samples += mp4_get_32value(&d[p + 8 + i * 8]);
+        }
+    }
+
+    t->has_stss = mp4test_find_box(d, stbl, stbl_end, "stss", &p, &e);
+    if (t->has_stss) {
+        n = mp4_get_32value(&d[p + 4]);
+        if (p + 8 + (size_t) n * 4 != e) {
+            return mp4test_fail("trak %u: stss has %u entries in %zu bytes", t->id, n, e - p);
+        }
+
+        for (i = 0; i < n; i++) {
+            t->stss.push_back(mp4_get_32value(&d[p + 8 + i * 4]));
+        }
+    }
+
+    if (!mp4test_find_box(d, stbl, stbl_end, "stsc", &p, &e)) {
+        return mp4test_fail("trak %u: no stsc", t->id);
+    }
+
+    n = mp4_get_32value(&d[p + 4]);
+    if (p + 8 + (size_t) n * 12 != e) {
+        return mp4test_fail("trak %u: stsc has %u entries in %zu bytes", t->id, n, e - p);
+    }
+
+    for (i = 0; i < n; i++) {
+        t->stsc.push_back(mp4_get_32value(&d[p + 8 + i * 12]));
+        t->stsc.push_back(mp4_get_32value(&d[p + 8 + i * 12 + 4]));
+    }
+
+    if (mp4test_find_box(d, stbl, stbl_end, "stsz", &p, &e)) {
+        n = mp4_get_32value(&d[p + 8]);
+
+        if (mp4_get_32value(&d[p + 4])) {
+            t->sizes.assign(n, mp4_get_32value(&d[p + 4]));
+
+        } else {
+            if (p + 12 + (size_t) n * 4 != e) {
+                return mp4test_fail("trak %u: stsz has %u entries in %zu bytes", t->id, n, e - p);
+            }
+
+            for (i = 0; i < n; i++) {
+                t->sizes.push_back(mp4_get_32value(&d[p + 12 + i * 4]));
+            }
+        }
+
+    } else if (mp4test_find_box(d, stbl, stbl_end, "stz2", &p, &e)) {
+        fs = d[p + 7];
+        n = mp4_get_32value(&d[p + 8]);
+
+        if (p + 12 + ((size_t) n * fs + 7) / 8 != e) {
+            return mp4test_fail("trak %u: stz2 has %u %u-bit entries in %zu bytes", t->id, n, fs, e - p);
+        }
+
+        for (i = 0; i < n; i++) {
+            if (fs == 4) {
+                t->sizes.push_back(i & 1 ? d[p + 12 + i / 2] & 0x0f : d[p + 12 + i / 2] >> 4);
+
+            } else if (fs == 8) {
+                t->sizes.push_back(d[p + 12 + i]);
+
+            } else {
+                t->sizes.push_back(d[p + 12 + i * 2] << 8 | d[p + 12 + i * 2 + 1]);
+            }
+        }
+
+    } else {
+        return mp4test_fail("trak %u: no stsz/stz2", t->id);
+    }
+
+    if (mp4test_find_box(d, stbl, stbl_end, "stco", &p, &e)) {
+        n = mp4_get_32value(&d[p + 4]);
+        if (p + 8 + (size_t) n * 4 != e) {
+            return mp4test_fail("trak %u: stco has %u entries in %zu bytes", t->id, n, e - p);
+        }
+
+        for (i = 0; i < n; i++) {
+            t->chunks.push_back(mp4_get_32value(&d[p + 8 + i * 4]));
+        }
+
+    } else if (mp4test_find_box(d, stbl, stbl_end, "co64", &p, &e)) {
+        n = mp4_get_32value(&d[p + 4]);
+        if (p + 8 + (size_t) n * 8 != e) {
+            return mp4test_fail("trak %u: co64 has %u entries in %zu bytes", t->id, n, e - p);
+        }
+
+        for (i = 0; i < n; i++) {
+            t->chunks.push_back(mp4_get_64value(&d[p + 8 + i * 8]));
+        }
+
+    } else {
+        return mp4test_fail("trak %u: no stco/co64", t->id);
+    }
+
+    return true;
+}
+
+/*
+ * 检查一个 trak: 各个表的 sample 数, 关键帧, chunk 偏移, 以及 sample 数据和原文件的一段连续 sample 相同
+ */
+static bool
+mp4test_check_trak(const std::vector<u_char> &d, size_t mdat, size_t mdat_end, const Mp4TestOutTrak *t,
+                   const Mp4SynthTrak *src, const std::vector<u_char> &file, size_t *data_end) {
+    uint32_t i, c, k, n, first, run, chunk_samples, marker;
+    uint64_t off;
+
+    n = t->stts_samples;
+
+    if (n == 0) {
+        return mp4test_fail("trak %u: no samples", t->id);
+    }
+
+    if (t->sizes.size() != n) {
+        return mp4test_fail("trak %u: stts has %u samples, stsz %zu", t->id, n, t->sizes.size());
+    }
+
+    if (t->has_ctts && t->ctts_samples != n) {
+        return mp4test_fail("trak %u: stts has %u samples, ctts %u", t->id, n, t->ctts_samples);
+    }
+
+    if (t->stsc.empty() || t->stsc[0] != 1) {
+        return mp4test_fail("trak %u: stsc doesn't start at chunk 1", t->id);
+    }
+
+    if (src->video != t->has_stss) {
+        return mp4test_fail("trak %u: stss %s", t->id, t->has_stss ? "unexpected" : "missing");
+    }
+
+    if (t->has_stss && (t->stss.empty() || t->stss[0] != 1)) {
+        return mp4test_fail("trak %u: stss[0] is %u, not a keyframe start", t->id, t->stss.empty() ? 0 : t->stss[0]);
+    }
+
+    for (i = 1; i < t->stss.size(); i++) {
+        if (t->stss[i] <= t->stss[i - 1] || t->stss[i] > n) {
+            return mp4test_fail("trak %u: stss[%u] = %u out of order", t->id, i, t->stss[i]);
+        }
+    }
+
+    // 第一个 sample 的标记给出它在原文件中的序号
+    first = 0;
+    k = 0;
+    run = 0;
+
+    for (c = 0; c < t->chunks.size(); c++) {
+        if (run + 1 < t->stsc.size() / 2 && t->stsc[(run + 1) * 2] == c + 1) {
+            run++;
+        }
+
+        chunk_samples = t->stsc[run * 2 + 1];
+        off = t->chunks[c];
+
+        for (i = 0; i < chunk_samples; i++, k++) {
+            if (k >= n) {
+                return mp4test_fail("trak %u: stsc has more than %u samples", t->id, n);
+            }
+
+            if (off < mdat || off + t->sizes[k] > mdat_end) {
+                return mp4test_fail("trak %u: sample %u at %" PRIu64 " is outside mdat [%zu, %zu)", t->id, k, off,
+                                    mdat, mdat_end);
+            }
+
+            marker = mp4_get_32value(&d[off]);
+
+            if (k == 0) {
+                first = marker & 0xffffff;
+            }
+
+            if (marker >> 24 != t->id || (marker & 0xffffff) != first + k || first + k >= src->samples) {
+                return mp4test_fail("trak %u: sample %u has marker %08x, expected source sample %u", t->id, k, marker,
+                                    first + k);
+            }
+
+            if (t->sizes[k] != src->sizes[first + k] ||
+                memcmp(&d[off], &file[src->sample_offset[first + k]], t->sizes[k]) != 0) {
+                return mp4test_fail("trak %u: sample %u differs from source sample %u", t->id, k, first + k);
+            }
+
+            off += t->sizes[k];
+            *data_end = std::max(*data_end, (size_t) off);
+        }
+    }
+
+    if (k != n) {
+        return mp4test_fail("trak %u: stsc covers %u samples, stts %u", t->id, k, n);
+    }
+
+    if (src->video) {
+        if (!src->key(first)) {
+            return mp4test_fail("trak %u: starts at source sample %u, not a keyframe", t->id, first);
+        }
+
+        for (i = 0; i < t->stss.size(); i++) {
+            if (!src->key(first + t->stss[i] - 1)) {
+                return mp4test_fail("trak %u: stss[%u] = %u is not a source keyframe", t->id, i, t->stss[i]);
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool
+mp4test_check(const std::vector<u_char> &out, const std::vector<u_char> &file,
+              const std::vector<Mp4SynthTrak> &traks) {
+    uint32_t i, checked;
+    size_t moov, moov_end, mdat, mdat_end, data_end, p, e;
+
+    if (!mp4test_find_box(out, 0, out.size(), "moov", &moov, &moov_end) ||
+        !mp4test_find_box(out, 0, out.size(), "mdat", &mdat, &mdat_end)) {
+        return mp4test_fail("no moov/mdat in output");
+    }
+
+    if (mdat_end != out.size()) {
+        return mp4test_fail("mdat ends at %zu, output is %zu bytes", mdat_end, out.size());
+    }
+
+    checked = 0;
+    data_end = mdat;
+    p = moov;
+
+    while (mp4test_find_box(out, p, moov_end, "trak", &p, &e)) {
+        Mp4TestOutTrak t;
+
+        if (!mp4test_read_trak(out, p, e, &t)) {
+            return false;
+        }
+
+        for (i = 0; i < traks.size() && traks[i].id != t.id; i++) {
+        }
+
+        if (i == traks.size()) {
+            return mp4test_fail("unknown trak %u", t.id);
+        }
+
+        if (!mp4test_check_trak(out, mdat, mdat_end, &t, &traks[i], file, &data_end)) {
+            return false;
+        }
+
+        checked++;
+        p = e;
+    }
+
+    if (checked != traks.size()) {
+        return mp4test_fail("output has %u traks, source %zu", checked, traks.size());
+    }
+
+    // 结束位置按最后一个输出的 sample 计算, mdat 后面不应该多带数据
+    if (data_end != mdat_end) {
+        return mp4test_fail("mdat has %zu bytes after the last sample", mdat_end - data_end);
+    }
+
+    return true;
+}
+
+int
+main() {
+    size_t c, s, l, b;
+    uint32_t lead_start;
+    int failed, total;
+    bool odd;
+    char name[128];
+    std::vector<u_char> file, out;
+    std::vector<Mp4SynthTrak> traks;
+
+    failed = 0;
+    total = 0;
+
+    for (c = 0; c < sizeof(mp4test_configs) / sizeof(mp4test_configs[0]); c++) {
+        mp4test_generate(&mp4test_configs[c], &file, &traks);
+        odd = false;
+
+        for (b = 0; b < sizeof(mp4test_block_sizes) / sizeof(mp4test_block_sizes[0]); b++) {
+            mp4_mem_block_size = mp4test_block_sizes[b];
+
+            for (s = 0; s < sizeof(mp4test_starts) / sizeof(mp4test_starts[0]); s++) {
+                for (l = 0; l < sizeof(mp4test_lengths) / sizeof(mp4test_lengths[0]); l++) {
+                    snprintf(name, sizeof(name), "%s start=%.2f length=%.0f block=%" PRId64, mp4test_configs[c].name,
+                             mp4test_starts[s], mp4test_lengths[l], mp4_mem_block_size);
+                    mp4test_case = name;
+                    total++;
+
+                    if (!mp4test_clip(file, mp4test_starts[s], mp4test_lengths[l], &out, &lead_start) ||
+                        !mp4test_check(out, file, traks)) {
+                        failed++;
+                        continue;
+                    }
+
+                    odd = odd || (lead_start & 1);
+                }
+            }
+        }
+
+        // 4 位 stz2 必须覆盖从奇数 sample 开始的情况
+        if (mp4test_configs[c].field_size == 4 && !odd) {
+            mp4test_case = mp4test_configs[c].name;
+            mp4test_fail("no clip starts at an odd sample");
+            failed++;
+        }
+    }
+
+    mp4_mem_block_size = 0;
+
+    printf("mp4test: %d cases, %d failed\n", total, failed);
+    return failed ? 1 : 0;
+}
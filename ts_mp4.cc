@@ -24,13 +24,45 @@ static void mp4_read_response(Mp4Context *mc, TSHttpTxn txnp);
 
 static void mp4_client_send_response(Mp4Context *mc, TSHttpTxn txnp);
 
-static void mp4_add_transform(Mp4Context *mc, TSHttpTxn txnp);
+static void mp4_add_transform(Mp4Context *mc, TSHttpTxn txnp, bool cache_hit);
 
 static int mp4_transform_entry(TSCont contp, TSEvent event, void *edata);
 
 static int mp4_transform_handler(TSCont contp, Mp4Context *mc);
 
-static int mp4_parse_meta(Mp4TransformContext *mtc, bool body_complete);
+static int mp4_parse_meta(TSCont contp, Mp4Context *mc, bool body_complete);
+
+static int mp4_crop_traks(TSCont contp, Mp4Context *mc);
+
+static int mp4_crop_job(TSCont contp, TSEvent event, void *edata);
+
+static int mp4_crop_join(TSCont contp, TSEvent event, void *edata);
+
+static void mp4_memory_report(Mp4Context *mc, TSHttpTxn txnp);
+
+static void mp4_parse_failure_stat(TSMp4ParseError err);
+
+static void mp4_phase_done(Mp4TransformContext *mtc, TSMp4Phase phase, TSHRTime elapsed);
+
+static void mp4_server_timing(Mp4Context *mc, TSHttpTxn txnp);
+
+static void mp4_slow_log(Mp4Context *mc, TSHttpTxn txnp);
+
+static void mp4_seek_report(Mp4Context *mc, TSHttpTxn txnp);
+
+static int mp4_seek_flush(TSCont contp, TSEvent event, void *edata);
+
+static int64_t mp4_transform_write_meta(Mp4Context *mc);
+
+static int64_t mp4_transform_write_body(Mp4Context *mc);
+
+static bool mp4_parse_size(const char *str, int64_t *size);
+
+static TSTextLogObject mp4_slow_log_object; // 所有 remap 共用, 第一个配置了慢请求阈值的 remap 创建
+static TSTextLogObject mp4_seek_log_object; // 所有 remap 共用, 周期由第一个配置了 --seek-log 的 remap 决定
+static TSCont mp4_seek_flush_contp;
+static TSAction mp4_seek_flush_action;
+static int mp4_seek_log_refs; // 使用 mp4_seek_log_object 的 remap 数, 最后一个删除时停止输出并销毁
 
 TSReturnCode
 TSRemapInit(TSRemapInterface *api_info, char *errbuf, int errbuf_size) {
@@ -44,32 +76,121 @@ TSRemapInit(TSRemapInterface *api_info, char *errbuf, int errbuf_size) {
         return TS_ERROR;
     }
 
+    mp4_stats_init();
+
     return TS_SUCCESS;
 }
 
 TSReturnCode
-TSRemapNewInstance(int argc, char ** /* argv ATS_UNUSED */, void **ih, char *errbuf, int errbuf_size) {
-    if (argc > 2) {
-        snprintf(errbuf, errbuf_size, "[TSRemapNewInstance] - Argument should be removed");
+TSRemapNewInstance(int argc, char **argv, void **ih, char *errbuf, int errbuf_size) {
+    int i;
+    bool ok;
+    Mp4Config *conf;
+
+    conf = new Mp4Config();
+
+    for (i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--meta-budget=", sizeof("--meta-budget=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--meta-budget=") - 1, &conf->meta_budget);
+
+        } else if (strncmp(argv[i], "--work-budget=", sizeof("--work-budget=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--work-budget=") - 1, &conf->work_budget);
+
+        } else if (strncmp(argv[i], "--offload-entries=", sizeof("--offload-entries=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--offload-entries=") - 1, &conf->offload_entries);
+
+        } else if (strcmp(argv[i], "--server-timing") == 0) {
+            conf->server_timing = true;
+            ok = true;
+
+        } else if (strncmp(argv[i], "--slow-parse-ms=", sizeof("--slow-parse-ms=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--slow-parse-ms=") - 1, &conf->slow_parse_ms);
+
+        } else if (strncmp(argv[i], "--slow-total-ms=", sizeof("--slow-total-ms=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--slow-total-ms=") - 1, &conf->slow_total_ms);
+
+        } else if (strncmp(argv[i], "--slow-moov=", sizeof("--slow-moov=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--slow-moov=") - 1, &conf->slow_moov);
+
+        } else if (strncmp(argv[i], "--slow-discard=", sizeof("--slow-discard=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--slow-discard=") - 1, &conf->slow_discard);
+
+        } else if (strncmp(argv[i], "--seek-log=", sizeof("--seek-log=") - 1) == 0) {
+            ok = mp4_parse_size(argv[i] + sizeof("--seek-log=") - 1, &conf->seek_log);
+
+        } else {
+            snprintf(errbuf, errbuf_size, "[TSRemapNewInstance] - Argument %s should be removed", argv[i]);
+            continue;
+        }
+
+        if (!ok) {
+            snprintf(errbuf, errbuf_size, "[TSRemapNewInstance] - Invalid argument %s", argv[i]);
+            delete conf;
+            return TS_ERROR;
+        }
+    }
+
+    if (conf->slow_log() && mp4_slow_log_object == nullptr &&
+        TSTextLogObjectCreate("ts_mp4_slow", TS_LOG_MODE_ADD_TIMESTAMP, &mp4_slow_log_object) != TS_SUCCESS) {
+        TSError("[%s] Couldn't create slow request log", PLUGIN_NAME);
+        mp4_slow_log_object = nullptr;
     }
 
-    *ih = nullptr;
+    if (conf->seek_log > 0 && mp4_seek_log_object == nullptr) {
+        if (TSTextLogObjectCreate("ts_mp4_seek", TS_LOG_MODE_ADD_TIMESTAMP, &mp4_seek_log_object) != TS_SUCCESS) {
+            TSError("[%s] Couldn't create seek cost log", PLUGIN_NAME);
+            mp4_seek_log_object = nullptr;
+            conf->seek_log = 0; // 这个 remap 不统计, 也不持有引用
+
+        } else {
+            mp4_seek_flush_contp = TSContCreate(mp4_seek_flush, TSMutexCreate());
+            mp4_seek_flush_action = TSContScheduleEveryOnPool(mp4_seek_flush_contp, conf->seek_log * 1000,
+                                                              TS_THREAD_POOL_TASK);
+        }
+    }
+
+    if (conf->seek_log > 0) {
+        mp4_seek_log_refs++;
+    }
+
+    *ih = conf;
     return TS_SUCCESS;
 }
 
 void
-TSRemapDeleteInstance(void * /* ih ATS_UNUSED */) {
-    return;
+TSRemapDeleteInstance(void *ih) {
+    Mp4Config *conf;
+    TSMutex mutex;
+
+    conf = (Mp4Config *) ih;
+
+    if (conf->seek_log > 0 && --mp4_seek_log_refs == 0) {
+        // 持有 continuation 的锁取消, 保证 mp4_seek_flush 没有在执行
+        mutex = TSContMutexGet(mp4_seek_flush_contp);
+        TSMutexLock(mutex);
+        TSActionCancel(mp4_seek_flush_action);
+        TSMutexUnlock(mutex);
+
+        TSContDestroy(mp4_seek_flush_contp);
+        TSTextLogObjectDestroy(mp4_seek_log_object);
+
+        mp4_seek_flush_contp = nullptr;
+        mp4_seek_flush_action = nullptr;
+        mp4_seek_log_object = nullptr;
+    }
+
+    delete conf;
 }
 
 TSRemapStatus
-TSRemapDoRemap(void * /* ih ATS_UNUSED */, TSHttpTxn rh, TSRemapRequestInfo *rri) {
+TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri) {
     const char *method, *query, *path, *range, *range_separator;
     const char *f_start, *f_end;
     int method_len, query_len, path_len, range_len;
     float start, end;
     TSMLoc ae_field, range_field;
     TSCont contp;
+    Mp4Arena *arena;
     Mp4Context *mc;
     bool start_find;
     bool end_find;
@@ -193,7 +314,8 @@ TSRemapDoRemap(void * /* ih ATS_UNUSED */, TSHttpTxn rh, TSRemapRequestInfo *rri
         TSMimeHdrFieldDestroy(rri->requestBufp, rri->requestHdrp, range_field);
         TSHandleMLocRelease(rri->requestBufp, rri->requestHdrp, range_field);
     }
-    mc = new Mp4Context(start, end, range_start, range_tag);
+    arena = Mp4Arena::create();
+    mc = arena->make<Mp4Context>(start, end, range_start, range_tag, *(Mp4Config *) ih, arena);
     contp = TSContCreate(mp4_handler, nullptr);
     TSContDataSet(contp, mc);
 
@@ -223,9 +345,18 @@ mp4_handler(TSCont contp, TSEvent event, void *edata) {
         case TS_EVENT_HTTP_SEND_RESPONSE_HDR:
             if (mc->range_tag)
                 mp4_client_send_response(mc, txnp);
+            if (mc->conf.server_timing && mc->mtc)
+                mp4_server_timing(mc, txnp);
             break;
         case TS_EVENT_HTTP_TXN_CLOSE:
-            delete mc;
+            if (mc->transform_added) {
+                mp4_stat_decrement(MP4_STAT_TRANSFORMS_ACTIVE, 1);
+            }
+
+            mp4_memory_report(mc, txnp);
+            mp4_slow_log(mc, txnp);
+            mp4_seek_report(mc, txnp);
+            mc->release();
             TSContDestroy(contp);
             break;
 
@@ -256,6 +387,7 @@ mp4_client_send_response(Mp4Context *mc, TSHttpTxn txnp) {
             TSHttpHdrReasonSet(response, resp_hdr, TSHttpHdrReasonLookup(TS_HTTP_STATUS_PARTIAL_CONTENT),
                                strlen(TSHttpHdrReasonLookup(TS_HTTP_STATUS_PARTIAL_CONTENT)));
             TSDebug(PLUGIN_NAME, "Set response header to TS_HTTP_STATUS_PARTIAL_CONTENT.");
+            mp4_stat_increment(MP4_STAT_RANGE_206, 1);
 
             char cl_buff[64];
             int length;
@@ -316,7 +448,7 @@ mp4_cache_lookup_complete(Mp4Context *mc, TSHttpTxn txnp) {
 
     TSDebug(PLUGIN_NAME, "[mp4_cache_lookup_complete]  content_length=%ld", n);
     mc->cl = n;
-    mp4_add_transform(mc, txnp);
+    mp4_add_transform(mc, txnp, true);
 
     release:
 
@@ -355,7 +487,7 @@ mp4_read_response(Mp4Context *mc, TSHttpTxn txnp) {
     TSDebug(PLUGIN_NAME, "[mp4_cache_lookup_complete]  content_length=%ld", n);
 
     mc->cl = n;
-    mp4_add_transform(mc, txnp);
+    mp4_add_transform(mc, txnp, false);
 
     release:
 
@@ -363,7 +495,7 @@ mp4_read_response(Mp4Context *mc, TSHttpTxn txnp) {
 }
 
 static void
-mp4_add_transform(Mp4Context *mc, TSHttpTxn txnp) {
+mp4_add_transform(Mp4Context *mc, TSHttpTxn txnp, bool cache_hit) {
     TSVConn connp;
 
     if (!mc)
@@ -388,7 +520,8 @@ mp4_add_transform(Mp4Context *mc, TSHttpTxn txnp) {
         return;
     }
 
-    mc->mtc = new Mp4TransformContext(mc->start, mc->end, mc->cl);
+    mc->mtc = mc->arena->make<Mp4TransformContext>(mc->start, mc->end, mc->cl, mc->conf, mc->arena);
+    mc->mtc->mm.txn_id = TSHttpTxnIdGet(txnp);
 
 //    TSDebug(PLUGIN_NAME, "[mp4_add_transform] start=%lf, end=%lf, cl=%lld", mc->start, mc->end, mc->cl);
 
@@ -397,22 +530,42 @@ mp4_add_transform(Mp4Context *mc, TSHttpTxn txnp) {
 
     connp = TSTransformCreate(mp4_transform_entry, txnp);
     TSContDataSet(connp, mc);
+    mc->mtc->transform = connp;
     TSHttpTxnHookAdd(txnp, TS_HTTP_RESPONSE_TRANSFORM_HOOK, connp);
 
     mc->transform_added = true;
+
+    mp4_stat_increment(MP4_STAT_TRANSFORMS, 1);
+    mp4_stat_increment(cache_hit ? MP4_STAT_TRANSFORMS_CACHE_HIT : MP4_STAT_TRANSFORMS_CACHE_MISS, 1);
+    mp4_stat_increment(MP4_STAT_TRANSFORMS_ACTIVE, 1);
 }
 
 static int
-mp4_transform_entry(TSCont contp, TSEvent event, void * /* edata ATS_UNUSED */) {
+mp4_transform_entry(TSCont contp, TSEvent event, void *edata) {
     TSVIO input_vio;
     Mp4Context *mc = (Mp4Context *) TSContDataGet(contp);
 
     if (TSVConnClosedGet(contp)) {
+        if (mc->mtc->offload_action && edata != mc->mtc->offload_action) {
+            TSActionCancel(mc->mtc->offload_action);
+        }
+
+        mc->mtc->offload_action = nullptr;
+        mc->mtc->transform_closed = true;
         TSContDestroy(contp);
         return 0;
     }
 
     switch (event) {
+        case TS_EVENT_IMMEDIATE:
+            if (edata != nullptr && edata == mc->mtc->offload_action) { // 在 task 线程上继续裁剪 meta
+                mc->mtc->offload_action = nullptr;
+                mc->mtc->offload = MP4_OFFLOAD_RUN;
+            }
+
+            mp4_transform_handler(contp, mc);
+            break;
+
         case TS_EVENT_ERROR:
             input_vio = TSVConnWriteVIOGet(contp);
             TSContCall(TSVIOContGet(input_vio), TS_EVENT_ERROR, input_vio);
@@ -438,8 +591,8 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
     TSVConn output_conn;
     TSVIO input_vio;
     TSIOBufferReader input_reader;
-    int64_t avail, toread, need, upstream_done, re_meta_length;
-    int ret;
+    int64_t avail, toread, upstream_done;
+    int64_t ret;
     bool write_down;
     Mp4TransformContext *mtc;
 
@@ -449,13 +602,26 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
     input_vio = TSVConnWriteVIOGet(contp);
     input_reader = TSVIOReaderGet(input_vio);
 
+    MP4_PROBE2(transform_start, mtc->mm.txn_id, mtc->total);
+
     if (!TSVIOBufferGet(input_vio)) {
         if (mtc->output.buffer) {
+            // 上游已经结束, 新的 meta 还没有全部输出时随着下游的消耗继续输出
+            if (!mtc->raw_transform && !mc->meta_copy && mp4_transform_write_meta(mc) >= 0) {
+                mp4_transform_write_body(mc);
+                TSVIOReenable(mtc->output.vio);
+                if (!mc->meta_copy) {
+                    MP4_PROBE2(transform_done, mtc->mm.txn_id, mtc->total);
+                    return 1;
+                }
+            }
+
             TSVIONBytesSet(mtc->output.vio, mtc->total);
             TSVIOReenable(mtc->output.vio);
 //            TSDebug(PLUGIN_NAME, "[mp4_transform_handler] !input_buff Done Get=%ld, total=%ld",
 //                    TSVIONDoneGet(mtc->output.vio), mtc->total);
         }
+        MP4_PROBE2(transform_done, mtc->mm.txn_id, mtc->total);
         return 1;
     }
 
@@ -469,6 +635,12 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
     TSIOBufferReaderConsume(input_reader, avail);
     TSVIONDoneSet(input_vio, upstream_done + avail);
 
+    MP4_PROBE3(transform_read, mtc->mm.txn_id, avail, upstream_done + avail);
+
+    if (mtc->first_byte_time == 0 && avail > 0) {
+        mtc->first_byte_time = TShrtime();
+    }
+
     toread = TSVIONTodoGet(input_vio);//还剩下多少未读
 
 //    TSDebug(PLUGIN_NAME, "[mp4_transform_handler] after write toread is %ld", toread);
@@ -478,7 +650,7 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
 
     if (!mtc->parse_over) {//解析mp4头
 //        TSDebug(PLUGIN_NAME, "[mp4_transform_handler] in parse_over toread-avail=%ld", (toread - avail));
-        ret = mp4_parse_meta(mtc, toread <= 0);
+        ret = mp4_parse_meta(contp, mc, toread <= 0);
 //        TSDebug(PLUGIN_NAME, "[mp4_transform_handler] ret=%d", ret);
         if (ret == 0) {
             goto trans;
@@ -490,12 +662,17 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
         mtc->output.reader = TSIOBufferReaderAlloc(mtc->output.buffer);
 
         if (ret < 0) {//解析失败的话，就将整个文件返回
+            mp4_parse_failure_stat(mtc->mm.parse_error);
+            mp4_stat_increment(MP4_STAT_RAW_PASSTHROUGH, 1);
+
             mtc->output.vio = TSVConnWrite(output_conn, contp, mtc->output.reader, mc->cl);// cl 为原始文件长度
             mtc->raw_transform = true;
 
             mc->range_tag = false; //不在提供range 功能
 
         } else {//解析成功的话，就按照之前的start, end 的流程走
+            mp4_stat_increment(MP4_STAT_PARSE_SUCCESS, 1);
+
             mc->real_cl = mtc->content_length;
             mc->mp4_calculation_range(mtc->meta_length, mtc->start_tail, mtc->end_tail, mtc->content_length);
             if (mc->range_tag) {
@@ -509,6 +686,14 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
                 mtc->output.vio = TSVConnWrite(output_conn, contp, mtc->output.reader, mtc->content_length);//修剪之后的文件长度
             }
 
+            if (mc->cl > TSVIONBytesGet(mtc->output.vio)) {
+                mp4_stat_increment(MP4_STAT_BYTES_SAVED, mc->cl - TSVIONBytesGet(mtc->output.vio));
+            }
+
+            mp4_stat_increment(MP4_STAT_SEEK_GOP_BYTES, mtc->mm.seek_gop_bytes);
+            mp4_stat_increment(MP4_STAT_SEEK_INTERLEAVE_BYTES, mtc->mm.seek_interleave_bytes);
+            mp4_stat_increment(MP4_STAT_SEEK_MDAT_BYTES, mtc->mm.seek_mdat_bytes);
+
         }
     }
 
@@ -523,135 +708,281 @@ mp4_transform_handler(TSCont contp, Mp4Context *mc) {
             TSIOBufferReaderConsume(mtc->res_reader, avail);
             mtc->total += avail;
             write_down = true;
+            MP4_PROBE3(write_raw, mtc->mm.txn_id, avail, mtc->total);
         }
 
     } else {//解析mp4 meta，并且修改成功
-        // copy the new meta data, 如果total < meta_length 说明还没有copy 过
-        if(!mc->meta_copy) {
-            mc->meta_copy = true;
-            if (mc->range_tag) {
-                re_meta_length = mtc->meta_length - mc->mp4_meta_start_dup;
+        ret = mp4_transform_write_meta(mc);
+        if (ret < 0) {
+            TSVIONBytesSet(mtc->output.vio, mtc->total);
+            TSVIOReenable(mtc->output.vio);
+            MP4_PROBE2(transform_done, mtc->mm.txn_id, mtc->total);
+            return 1;
+        }
 
-                if (mc->mp4_meta_start_dup) {
-                    TSIOBufferReaderConsume(mtc->mm.out_handle.reader, mc->mp4_meta_start_dup);
-                }
+        if (ret > 0) {
+            write_down = true;
+        }
 
-                TSIOBufferCopy(mtc->output.buffer, mtc->mm.out_handle.reader, re_meta_length, 0);
-                mtc->total += re_meta_length;
-                write_down = true;
+        if (mp4_transform_write_body(mc) > 0) {
+            write_down = true;
+        }
+    }
 
+    trans:
 
-            } else {
-                TSIOBufferCopy(mtc->output.buffer, mtc->mm.out_handle.reader, mtc->meta_length, 0);
-                mtc->total += mtc->meta_length;
-                write_down = true;
-            }
+    if (write_down) {//有数据写入
+        TSVIOReenable(mtc->output.vio);
+    }
+
+    mtc->mp4_memory_sample();
+
+    if (mtc->first_out_time == 0 && mtc->total > 0) {
+        mtc->first_out_time = TShrtime();
+        mp4_phase_done(mtc, MP4_PHASE_FIRST_BYTE, mtc->first_out_time - mtc->first_byte_time);
+    }
+
+    if (toread > 0) {
+        TSContCall(TSVIOContGet(input_vio), TS_EVENT_VCONN_WRITE_READY, input_vio);
+
+    } else if (mtc->offload == MP4_OFFLOAD_PENDING || mtc->offload == MP4_OFFLOAD_CROP) {
+        // 裁剪还在 task 线程的队列里, 完成后由 task 线程继续输出并结束上游
+
+    } else {//整个流程结束
+//        TSDebug(PLUGIN_NAME, "last Done Get=%ld, input_vio Done=%ld, mtc->total=%ld", TSVIONDoneGet(mtc->output.vio),
+//                TSVIONDoneGet(input_vio), mtc->total);
+        if (mtc->raw_transform || mc->meta_copy) {// meta 还没输出完时, 剩下的由下游的 WRITE_READY 驱动
+            TSVIONBytesSet(mtc->output.vio, mtc->total);
+        }
+        TSContCall(TSVIOContGet(input_vio), TS_EVENT_VCONN_WRITE_COMPLETE, input_vio);
+    }
+
+    MP4_PROBE2(transform_done, mtc->mm.txn_id, mtc->total);
+    return 1;
+}
+
+/**
+ * 输出新的 meta. 每次只在下游还没有积压 MP4_META_WRITE_SIZE 字节时才继续生成,
+ * 所以大的 moov 不会一次全部生成在内存里. range 请求跳过 meta 开头 mp4_meta_start_dup 字节.
+ * 返回本次输出的字节数, -1 表示出错
+ */
+static int64_t
+mp4_transform_write_meta(Mp4Context *mc) {
+    int64_t avail, skip, written;
+    Mp4TransformContext *mtc;
+    Mp4Meta *mm;
+
+    mtc = mc->mtc;
+    mm = &mtc->mm;
+    written = 0;
+
+    if (mc->meta_copy) {
+        return 0;
+    }
+
+    if (mc->range_tag && mtc->meta_pos < mc->mp4_meta_start_dup && mc->mp4_meta_start_dup >= mtc->meta_length) {
+        mtc->meta_pos = mtc->meta_length; // range 从 body 开始, 不需要生成 meta
+    }
+
+    while (mtc->meta_pos < mtc->meta_length && TSIOBufferReaderAvail(mtc->output.reader) < MP4_META_WRITE_SIZE) {
+        if (mm->mp4_write_meta(MP4_META_WRITE_SIZE) <= 0) {
+            TSDebug(PLUGIN_NAME, "[mp4_transform_write_meta] failed to write meta at %" PRId64, mtc->meta_pos);
+            return -1;
+        }
+
+        avail = TSIOBufferReaderAvail(mm->out_handle.reader);
+
+        skip = mc->range_tag ? mc->mp4_meta_start_dup - mtc->meta_pos : 0;
+        if (skip > avail) {
+            skip = avail;
+        }
+
+        if (skip > 0) {
+            TSIOBufferReaderConsume(mm->out_handle.reader, skip);
+            mtc->meta_pos += skip;
+            avail -= skip;
+        }
+
+        if (avail > 0) {
+            TSIOBufferCopy(mtc->output.buffer, mm->out_handle.reader, avail, 0);
+            TSIOBufferReaderConsume(mm->out_handle.reader, avail);
+            mtc->meta_pos += avail;
+            mtc->total += avail;
+            written += avail;
+            MP4_PROBE3(write_meta, mm->txn_id, avail, mtc->meta_pos);
+        }
+    }
+
+    if (mtc->meta_pos >= mtc->meta_length) {
+        mc->meta_copy = true;
+    }
+
+    return written;
+}
+
+/**
+ * 新的 meta 输出完之后再输出 [start_tail, end_tail) 之间的媒体数据, 返回本次输出的字节数
+ */
+static int64_t
+mp4_transform_write_body(Mp4Context *mc) {
+    int64_t avail, need, written;
+    Mp4TransformContext *mtc;
+
+    mtc = mc->mtc;
+    written = 0;
+
+    if (!mc->meta_copy) {
+        return 0;
+    }
+
+    // ignore useless part, 忽视无用的部分，  tail 为丢弃的结束位置
+    if (mtc->start_pos < mtc->start_tail) {
+        avail = TSIOBufferReaderAvail(mtc->res_reader);
+        need = mtc->start_tail - mtc->start_pos;
+        if (need > avail) {
+            need = avail;
         }
 
+        if (need > 0) {
+            TSIOBufferReaderConsume(mtc->res_reader, need);
+            mtc->start_pos += need;
+        }
+    }
 
-        // ignore useless part, 忽视无用的部分，  tail 为丢弃的结束位置
-        if (mtc->start_pos < mtc->start_tail) {
+    // copy the video & audio data  后面从此地方入手，操作end
+    if (mtc->end_tail > 0) {
+        if (mtc->start_pos >= mtc->start_tail && mtc->start_pos <= mtc->end_tail) {
             avail = TSIOBufferReaderAvail(mtc->res_reader);
-            need = mtc->start_tail - mtc->start_pos;
+            need = mtc->end_tail - mtc->start_pos;
             if (need > avail) {
                 need = avail;
             }
 
             if (need > 0) {
+                TSIOBufferCopy(mtc->output.buffer, mtc->res_reader, need, 0);
                 TSIOBufferReaderConsume(mtc->res_reader, need);
+                mtc->total += need;
+                written += need;
                 mtc->start_pos += need;
+                MP4_PROBE3(write_body, mtc->mm.txn_id, need, mtc->start_pos);
             }
-        }
-
-        // copy the video & audio data  后面从此地方入手，操作end
-        if (mtc->end_tail > 0) {
-            if (mtc->start_pos >= mtc->start_tail && mtc->start_pos <= mtc->end_tail) {
-                avail = TSIOBufferReaderAvail(mtc->res_reader);
-                need = mtc->end_tail - mtc->start_pos;
-                if (need > avail) {
-                    need = avail;
-                }
-
-                if (need > 0) {
-                    TSIOBufferCopy(mtc->output.buffer, mtc->res_reader, need, 0);
-                    TSIOBufferReaderConsume(mtc->res_reader, need);
-                    mtc->total += need;
-                    write_down = true;
-                    mtc->start_pos += need;
-                }
 
-            } else {
-                avail = TSIOBufferReaderAvail(mtc->res_reader);
-                TSIOBufferReaderConsume(mtc->res_reader, avail);
-            }
         } else {
-            if (mtc->start_pos >= mtc->start_tail) {
-                avail = TSIOBufferReaderAvail(mtc->res_reader);
+            avail = TSIOBufferReaderAvail(mtc->res_reader);
+            TSIOBufferReaderConsume(mtc->res_reader, avail);
+        }
+    } else {
+        if (mtc->start_pos >= mtc->start_tail) {
+            avail = TSIOBufferReaderAvail(mtc->res_reader);
 
-                if (avail > 0) {
-                    TSIOBufferCopy(mtc->output.buffer, mtc->res_reader, avail, 0);
-                    TSIOBufferReaderConsume(mtc->res_reader, avail);
+            if (avail > 0) {
+                TSIOBufferCopy(mtc->output.buffer, mtc->res_reader, avail, 0);
+                TSIOBufferReaderConsume(mtc->res_reader, avail);
 
-                    mtc->start_pos += avail;
-                    mtc->total += avail;
-                    write_down = true;
-                }
+                mtc->start_pos += avail;
+                mtc->total += avail;
+                written += avail;
+                MP4_PROBE3(write_body, mtc->mm.txn_id, avail, mtc->start_pos);
             }
-
         }
 
     }
 
-    trans:
-
-    if (write_down) {//有数据写入
-        TSVIOReenable(mtc->output.vio);
-    }
-
-    if (toread > 0) {
-        TSContCall(TSVIOContGet(input_vio), TS_EVENT_VCONN_WRITE_READY, input_vio);
-
-    } else {//整个流程结束
-//        TSDebug(PLUGIN_NAME, "last Done Get=%ld, input_vio Done=%ld, mtc->total=%ld", TSVIONDoneGet(mtc->output.vio),
-//                TSVIONDoneGet(input_vio), mtc->total);
-        TSVIONBytesSet(mtc->output.vio, mtc->total);
-        TSContCall(TSVIOContGet(input_vio), TS_EVENT_VCONN_WRITE_COMPLETE, input_vio);
-    }
-
-    return 1;
+    return written;
 }
 
+/*
+ * 在网络线程上增量解析 box; 表 entry 很多时把裁剪(post_process_meta)调度到 task 线程,
+ * 调度的是 transform 自身, 所以执行时持有 transform 的 mutex, 完成后直接继续输出.
+ * 在 task 线程上 lead trak 之外的 trak 再分给 task 线程池并行裁剪, 全部完成后再统一调整偏移.
+ *  -1: error
+ *   0: unfinished
+ *   1: success
+ */
 static int
-mp4_parse_meta(Mp4TransformContext *mtc, bool body_complete) {
+mp4_parse_meta(TSCont contp, Mp4Context *mc, bool body_complete) {
     int ret;
     int64_t avail, bytes;
+    TSHRTime start, now;
     TSIOBufferBlock blk;
     const char *data;
     Mp4Meta *mm;
+    Mp4TransformContext *mtc;
 
+    mtc = mc->mtc;
     mm = &mtc->mm;
 
-    avail = TSIOBufferReaderAvail(mtc->dup_reader);
-    blk = TSIOBufferReaderStart(mtc->dup_reader);
+    if (mtc->offload == MP4_OFFLOAD_PENDING || mtc->offload == MP4_OFFLOAD_CROP) {
+        return 0;
+    }
 
-    while (blk != nullptr) {
-        data = TSIOBufferBlockReadStart(blk, mtc->dup_reader, &bytes);
-        if (bytes > 0) {
-            TSIOBufferWrite(mm->meta_buffer, data, bytes);
+    if (mtc->offload == MP4_OFFLOAD_NONE) {
+        avail = TSIOBufferReaderAvail(mtc->dup_reader);
+        blk = TSIOBufferReaderStart(mtc->dup_reader);
+
+        while (blk != nullptr) {
+            data = TSIOBufferBlockReadStart(blk, mtc->dup_reader, &bytes);
+            if (bytes > 0) {
+                TSIOBufferWrite(mm->meta_buffer, data, bytes);
+            }
+
+            blk = TSIOBufferBlockNext(blk);
         }
 
-        blk = TSIOBufferBlockNext(blk);
-    }
+        TSIOBufferReaderConsume(mtc->dup_reader, avail);
+
+        MP4_PROBE2(parse_start, mm->txn_id, avail);
+
+        start = TShrtime();
+        ret = mm->parse_meta_atoms(body_complete);
+        now = TShrtime();
+        mtc->phase_time[MP4_PHASE_PARSE] += now - start;
 
-    TSIOBufferReaderConsume(mtc->dup_reader, avail);
+        MP4_PROBE3(parse_end, mm->txn_id, ret, now - start);
 
-    ret = mm->parse_meta(body_complete);
+        if (ret != 0) { // moov 读完或失败
+            mp4_phase_done(mtc, MP4_PHASE_WAIT_MOOV, mtc->first_byte_time > 0 ? now - mtc->first_byte_time : 0);
+            mp4_phase_done(mtc, MP4_PHASE_PARSE, mtc->phase_time[MP4_PHASE_PARSE]);
+        }
+
+        if (ret > 0) {
+            mtc->crop_start = now;
+        }
+
+        if (ret > 0 && mm->mp4_table_entries() >= mtc->offload_entries) {
+            TSDebug(PLUGIN_NAME, "[mp4_parse_meta] %" PRId64 " table entries, post process on task thread",
+                    mm->mp4_table_entries());
+            mtc->offload = MP4_OFFLOAD_PENDING;
+            mtc->offload_action = TSContScheduleOnPool(contp, 0, TS_THREAD_POOL_TASK);
+            return 0;
+        }
+
+        if (ret > 0) {
+            ret = mm->post_process_meta() == 0 ? 1 : -1;
+        }
+
+    } else if (mtc->offload == MP4_OFFLOAD_RUN) {
+        ret = mp4_crop_traks(contp, mc);
+        if (ret == 0) {
+            return 0;
+        }
+
+    } else { // MP4_OFFLOAD_JOIN
+        ret = mtc->crop_failed ? -1 : 1;
+        if (ret > 0) {
+            ret = mm->mp4_finish_meta() == 0 ? 1 : -1;
+        }
+    }
+
+    if (mtc->crop_start > 0) {
+        mp4_phase_done(mtc, MP4_PHASE_CROP, TShrtime() - mtc->crop_start);
+    }
 
     if (ret > 0) { // meta success
         mtc->start_tail = mm->start_pos;
         mtc->end_tail = mm->end_pos;
         mtc->content_length = mm->content_length;
-        mtc->meta_length = TSIOBufferReaderAvail(mm->out_handle.reader);
+        mtc->meta_length = mm->meta_size;
 //        TSDebug(PLUGIN_NAME, "[mp4_parse_meta] start_tail=%lld, end_tail=%lld, content_length=%lld, meta_length=%lld",
 //                mtc->start_tail, mtc->end_tail, mtc->content_length, mtc->meta_length);
     }
@@ -659,7 +990,338 @@ mp4_parse_meta(Mp4TransformContext *mtc, bool body_complete) {
     if (ret != 0) {
         TSIOBufferReaderFree(mtc->dup_reader);
         mtc->dup_reader = nullptr;
+
+        MP4_PROBE4(meta_done, mm->txn_id, ret, (int) mm->parse_error.load(), mtc->meta_length);
     }
 
     return ret;
 }
+
+/*
+ * 在 task 线程上裁剪 lead trak, 其余 trak 每个一个任务调度到 task 线程池.
+ * 任务各持有 mc 的一个引用, 事务提前结束时 mtc 也不会在任务执行中被释放.
+ *  -1: error
+ *   0: trak 任务已调度, 由 mp4_crop_join 继续
+ *   1: success
+ */
+static int
+mp4_crop_traks(TSCont contp, Mp4Context *mc) {
+    uint32_t i, n;
+    Mp4Trak *lead;
+    Mp4Meta *mm;
+    TSCont job;
+    Mp4CropJob *cj;
+    Mp4TransformContext *mtc;
+
+    mtc = mc->mtc;
+    mm = &mtc->mm;
+
+    if (mm->mp4_start_meta(&lead) != 0) {
+        return -1;
+    }
+
+    n = mm->trak_num - (lead ? 1 : 0);
+
+    if (n <= 1) { // 只剩一个 trak 时不值得再调度
+        for (i = 0; i < mm->trak_num; i++) {
+            if (mm->trak_vec[i] != lead && mm->mp4_process_trak(mm->trak_vec[i]) != 0) {
+                return -1;
+            }
+        }
+
+        return mm->mp4_finish_meta() == 0 ? 1 : -1;
+    }
+
+    TSDebug(PLUGIN_NAME, "[mp4_crop_traks] crop %u traks on task threads", n);
+
+    mtc->offload = MP4_OFFLOAD_CROP;
+    mtc->crop_jobs = n;
+    mtc->crop_join = TSContCreate(mp4_crop_join, TSContMutexGet(contp));
+    TSContDataSet(mtc->crop_join, mc);
+    mc->refcount += n + 1;
+
+    for (i = 0; i < mm->trak_num; i++) {
+        if (mm->trak_vec[i] == lead) {
+            continue;
+        }
+
+        cj = mc->arena->make<Mp4CropJob>(mc, mm->trak_vec[i]);
+        job = TSContCreate(mp4_crop_job, TSMutexCreate());
+        TSContDataSet(job, cj);
+        TSContScheduleOnPool(job, 0, TS_THREAD_POOL_TASK);
+    }
+
+    return 0;
+}
+
+static int
+mp4_crop_job(TSCont contp, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */) {
+    Mp4CropJob *cj = (Mp4CropJob *) TSContDataGet(contp);
+    Mp4Context *mc = cj->mc;
+    Mp4TransformContext *mtc = mc->mtc;
+
+    if (!mtc->transform_closed && !mtc->crop_failed && mtc->mm.mp4_process_trak(cj->trak) != 0) {
+        mtc->crop_failed = true;
+    }
+
+    if (--mtc->crop_jobs == 0) { // 最后一个完成的任务回到 transform 的 mutex 下继续
+        TSContScheduleOnPool(mtc->crop_join, 0, TS_THREAD_POOL_TASK);
+    }
+
+    TSContDestroy(contp);
+    mc->release();
+    return 0;
+}
+
+static int
+mp4_crop_join(TSCont contp, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */) {
+    Mp4Context *mc = (Mp4Context *) TSContDataGet(contp);
+    Mp4TransformContext *mtc = mc->mtc;
+
+    if (!mtc->transform_closed) {
+        mtc->offload = MP4_OFFLOAD_JOIN;
+        TSContCall(mtc->transform, TS_EVENT_IMMEDIATE, nullptr);
+    }
+
+    mtc->crop_join = nullptr;
+    TSContDestroy(contp);
+    mc->release();
+    return 0;
+}
+
+/*
+ * 事务结束时记录内存峰值, 进入前 MP4_MEM_TOP_NUM 名的请求连同 URL 和 moov 大小写入 diags.log
+ */
+static void
+mp4_memory_report(Mp4Context *mc, TSHttpTxn txnp) {
+    int len;
+    char *url;
+    Mp4TransformContext *mtc;
+
+    mtc = mc->mtc;
+    if (mtc == nullptr) {
+        return;
+    }
+
+    mp4_stat_decrement(MP4_STAT_MEM_CURRENT, mtc->mem_cur);
+    mtc->mem_cur = 0;
+
+    if (mtc->mem_peak <= 0 || !mp4_stat_memory_peak(mtc->mem_peak)) {
+        return;
+    }
+
+    url = TSHttpTxnEffectiveUrlStringGet(txnp, &len);
+    TSNote("[%s] memory peak %" PRId64 " bytes, moov %" PRId64 " bytes, %d traks, url %.*s", PLUGIN_NAME,
+           mtc->mem_peak, mtc->mm.src_moov_size, mtc->mm.trak_num, url ? len : 0, url ? url : "");
+
+    if (url) {
+        TSfree(url);
+    }
+}
+
+static void
+mp4_phase_done(Mp4TransformContext *mtc, TSMp4Phase phase, TSHRTime elapsed) {
+    mtc->phase_time[phase] = elapsed;
+    mp4_stat_latency(phase, elapsed);
+}
+
+/*
+ * 在给客户端的响应里加上 Server-Timing, 区分等待源站(moov)和插件自身(parse, crop)的耗时.
+ * 发送响应头时 meta 已经处理完, 输出第一个字节的时间还不知道.
+ */
+static void
+mp4_server_timing(Mp4Context *mc, TSHttpTxn txnp) {
+    int length;
+    char buf[128];
+    TSMBuffer response;
+    TSMLoc resp_hdr, field_loc;
+    Mp4TransformContext *mtc;
+
+    mtc = mc->mtc;
+    if (!mtc->parse_over) {
+        return;
+    }
+
+    if (TSHttpTxnClientRespGet(txnp, &response, &resp_hdr) != TS_SUCCESS) {
+        return;
+    }
+
+    length = snprintf(buf, sizeof(buf), "mp4-moov;dur=%.3f, mp4-parse;dur=%.3f, mp4-crop;dur=%.3f",
+                      mtc->phase_time[MP4_PHASE_WAIT_MOOV] / 1000000.0, mtc->phase_time[MP4_PHASE_PARSE] / 1000000.0,
+                      mtc->phase_time[MP4_PHASE_CROP] / 1000000.0);
+
+    if (TSMimeHdrFieldCreateNamed(response, resp_hdr, "Server-Timing", sizeof("Server-Timing") - 1, &field_loc) ==
+        TS_SUCCESS) {
+        TSMimeHdrFieldValueStringInsert(response, resp_hdr, field_loc, -1, buf, length);
+        TSMimeHdrFieldAppend(response, resp_hdr, field_loc);
+        TSHandleMLocRelease(response, resp_hdr, field_loc);
+    }
+
+    TSHandleMLocRelease(response, TS_NULL_MLOC, resp_hdr);
+}
+
+/*
+ * 超过任一阈值的请求在 ts_mp4_slow.log 中写一行, 包括 URL, 拖动参数, 各阶段耗时, 内存峰值和每个 trak 的表大小
+ */
+static void
+mp4_slow_log(Mp4Context *mc, TSHttpTxn txnp) {
+    int len, n;
+    uint32_t i;
+    char *url;
+    char tables[512];
+    const char *result;
+    int64_t total_ms, parse_ms;
+    Mp4Trak *trak;
+    Mp4Meta *mm;
+    Mp4TransformContext *mtc;
+
+    mtc = mc->mtc;
+    if (mtc == nullptr || mp4_slow_log_object == nullptr || !mc->conf.slow_log()) {
+        return;
+    }
+
+    mm = &mtc->mm;
+    total_ms = (TShrtime() - mc->start_time) / 1000000;
+    parse_ms = (mtc->phase_time[MP4_PHASE_PARSE] + mtc->phase_time[MP4_PHASE_CROP]) / 1000000;
+
+    if (!(mc->conf.slow_parse_ms > 0 && parse_ms >= mc->conf.slow_parse_ms) &&
+        !(mc->conf.slow_total_ms > 0 && total_ms >= mc->conf.slow_total_ms) &&
+        !(mc->conf.slow_moov > 0 && mm->src_moov_size >= mc->conf.slow_moov) &&
+        !(mc->conf.slow_discard > 0 && mtc->start_tail >= mc->conf.slow_discard)) {
+        return;
+    }
+
+    // 每个 trak: stts/stss/ctts/stsc/stsz/stco 的 entry 数. 并行裁剪还没结束时 trak 正在被修改, 不输出
+    n = 0;
+    tables[0] = '\0';
+    for (i = 0; i < mm->trak_num && mtc->offload != MP4_OFFLOAD_CROP && n < (int) sizeof(tables); i++) {
+        trak = mm->trak_vec[i];
+        n += snprintf(tables + n, sizeof(tables) - n, "%s%u/%u/%u/%u/%u/%u", i ? "," : "",
+                      trak->time_to_sample_entries, trak->sync_samples_entries, trak->composition_offset_entries,
+                      trak->sample_to_chunk_entries, trak->sample_sizes_entries, trak->chunks);
+    }
+
+    if (!mtc->parse_over) {
+        result = "unfinished";
+
+    } else if (mtc->raw_transform) {
+        result = mp4_parse_error_name(mm->parse_error == MP4_ERROR_NONE ? MP4_ERROR_MALFORMED : mm->parse_error.load());
+
+    } else {
+        result = mp4_parse_error_name(MP4_ERROR_NONE);
+    }
+
+    url = TSHttpTxnEffectiveUrlStringGet(txnp, &len);
+
+    TSTextLogObjectWrite(mp4_slow_log_object,
+                         "start=%.3f end=%.3f result=%s total_ms=%" PRId64 " wait_moov_ms=%" PRId64 " parse_ms=%" PRId64
+                         " crop_ms=%" PRId64 " first_byte_ms=%" PRId64 " moov=%" PRId64 " traks=%u tables=%s discard=%"
+                         PRId64 " gop_bytes=%" PRId64 " interleave_bytes=%" PRId64 " cl=%" PRId64 " out=%" PRId64
+                         " mem_peak=%" PRId64 " url=%.*s",
+                         mc->start, mc->end, result,
+                         total_ms, mtc->phase_time[MP4_PHASE_WAIT_MOOV] / 1000000,
+                         mtc->phase_time[MP4_PHASE_PARSE] / 1000000, mtc->phase_time[MP4_PHASE_CROP] / 1000000,
+                         mtc->phase_time[MP4_PHASE_FIRST_BYTE] / 1000000, mm->src_moov_size, mm->trak_num, tables,
+                         mtc->start_tail, mm->seek_gop_bytes, mm->seek_interleave_bytes, mc->cl, mtc->total,
+                         mtc->mem_peak, url ? len : 0, url ? url : "");
+
+    if (url) {
+        TSfree(url);
+    }
+}
+
+/*
+ * 裁剪成功的请求把代价累加到文件(remap 之后的 URL, 已去掉 start/end), 用来找出需要缩短 GOP 或改善交错的文件
+ */
+static void
+mp4_seek_report(Mp4Context *mc, TSHttpTxn txnp) {
+    int len;
+    char *url;
+    Mp4TransformContext *mtc;
+
+    mtc = mc->mtc;
+    if (mtc == nullptr || !mtc->parse_over || mtc->raw_transform || mc->conf.seek_log <= 0 ||
+        mp4_seek_log_object == nullptr) {
+        return;
+    }
+
+    url = TSHttpTxnEffectiveUrlStringGet(txnp, &len);
+    if (url == nullptr) {
+        return;
+    }
+
+    mp4_stat_seek_object(url, len, mtc->mm.seek_gop_bytes, mtc->mm.seek_interleave_bytes, mtc->mm.seek_mdat_bytes);
+    TSfree(url);
+}
+
+static int
+mp4_seek_flush(TSCont /* contp ATS_UNUSED */, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */) {
+    mp4_stat_seek_flush(mp4_seek_log_object);
+    return 0;
+}
+
+static void
+mp4_parse_failure_stat(TSMp4ParseError err) {
+    switch (err) {
+        case MP4_ERROR_META_BUDGET:
+            mp4_stat_increment(MP4_STAT_PARSE_META_BUDGET, 1);
+            break;
+
+        case MP4_ERROR_WORK_BUDGET:
+            mp4_stat_increment(MP4_STAT_WORK_EXCEEDED, 1);
+            break;
+
+        case MP4_ERROR_CMOV:
+            mp4_stat_increment(MP4_STAT_PARSE_CMOV, 1);
+            break;
+
+        case MP4_ERROR_MOOV_AFTER_MDAT:
+            mp4_stat_increment(MP4_STAT_PARSE_MOOV_AFTER_MDAT, 1);
+            break;
+
+        default: // 没有记录原因的失败都是文件本身的问题
+            mp4_stat_increment(MP4_STAT_PARSE_MALFORMED, 1);
+            break;
+    }
+}
+
+/*
+ * 解析 remap 参数中的数值, 支持 K/M/G 后缀
+ */
+static bool
+mp4_parse_size(const char *str, int64_t *size) {
+    int64_t n;
+    char *ptr;
+
+    n = strtoll(str, &ptr, 10);
+
+    switch (*ptr) {
+        case 'k':
+        case 'K':
+            n <<= 10;
+            ptr++;
+            break;
+
+        case 'm':
+        case 'M':
+            n <<= 20;
+            ptr++;
+            break;
+
+        case 'g':
+        case 'G':
+            n <<= 30;
+            ptr++;
+            break;
+
+        default:
+            break;
+    }
+
+    if (ptr == str || *ptr != '\0' || n <= 0) {
+        return false;
+    }
+
+    *size = n;
+    return true;
+}